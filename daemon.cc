@@ -0,0 +1,340 @@
+/* -*- c++ -*-
+
+This is Picprog, Microchip PIC programmer software for the serial port device.
+Copyright © 2010 Jaakko Hyvätti
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see http://www.gnu.org/licenses/ .
+
+The author may be contacted at:
+
+Email: Jaakko.Hyvatti@iki.fi
+URL:   http://www.iki.fi/hyvatti/
+Phone: +358 40 5011222
+
+Please send any suggestions, bug reports, success stories etc. to the
+Email address above.  Include word 'picprog' in the subject line to
+make sure your email passes my spam filtering.
+
+*/
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <string>
+#include <vector>
+
+#include <sysexits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "daemon.h"
+
+using namespace std;
+
+// Request: a header with the length of the rest, sent together with
+// the client's stdout and stderr descriptors, then the working
+// directory and the arguments, each ending in a NUL.  Reply: the
+// exit code.
+
+static bool
+write_all (int fd, const void *buf, size_t len)
+{
+  const char *p = (const char *) buf;
+  while (len > 0) {
+    ssize_t n = write (fd, p, len);
+    if (n < 0 && EINTR == errno)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool
+read_all (int fd, void *buf, size_t len)
+{
+  char *p = (char *) buf;
+  while (len > 0) {
+    ssize_t n = read (fd, p, len);
+    if (n < 0 && EINTR == errno)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+static int
+socket_address (const char *socket_name, struct sockaddr_un &sa)
+{
+  memset (&sa, 0, sizeof (sa));
+  sa.sun_family = AF_UNIX;
+  if (strlen (socket_name) >= sizeof (sa.sun_path)) {
+    cerr << socket_name << ":socket name too long" << endl;
+    return EX_USAGE;
+  }
+  strcpy (sa.sun_path, socket_name);
+  return EX_OK;
+}
+
+string
+default_socket ()
+{
+  const char *dir = getenv ("XDG_RUNTIME_DIR");
+  if (dir && *dir)
+    return string (dir) + "/picprogd.socket";
+  char name [64];
+  snprintf (name, sizeof (name), "/tmp/picprogd-%lu/picprogd.socket",
+	    (unsigned long) geteuid ());
+  return name;
+}
+
+// The directory the socket goes in, created if it is missing, must
+// belong to this user or root and be writable by nobody else.
+// Otherwise another user could replace the socket.
+
+static int
+private_directory (const char *socket_name)
+{
+  string dir (socket_name);
+  size_t slash = dir.rfind ('/');
+  struct stat st;
+
+  dir = string::npos == slash ? "." : 0 == slash ? "/" : dir.substr (0, slash);
+  if (mkdir (dir.c_str (), 0700) && EEXIST != errno) {
+    int e = errno;
+    cerr << dir << ":unable to create:" << strerror (e) << endl;
+    return EX_CANTCREAT;
+  }
+  if (lstat (dir.c_str (), &st)) {
+    int e = errno;
+    cerr << dir << ":" << strerror (e) << endl;
+    return EX_OSERR;
+  }
+  if (!S_ISDIR (st.st_mode) || (st.st_mode & 022)
+      || (st.st_uid != geteuid () && 0 != st.st_uid)) {
+    cerr << dir << ":socket directory is not private to this user" << endl;
+    return EX_NOPERM;
+  }
+  return EX_OK;
+}
+
+// Receive one request.  On success fds holds the client's stdout and
+// stderr and args the working directory and the arguments.
+
+static bool
+receive_job (int c, int fds [2], vector<char> &args)
+{
+  uint32_t len;
+  struct iovec iov = { &len, sizeof (len) };
+  char control [CMSG_SPACE (2 * sizeof (int))];
+  struct msghdr msg;
+
+  memset (&msg, 0, sizeof (msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof (control);
+  if (recvmsg (c, &msg, 0) != sizeof (len))
+    return false;
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR (&msg);
+  if (!cmsg || SOL_SOCKET != cmsg->cmsg_level || SCM_RIGHTS != cmsg->cmsg_type
+      || cmsg->cmsg_len != CMSG_LEN (2 * sizeof (int)))
+    return false;
+  memcpy (fds, CMSG_DATA (cmsg), 2 * sizeof (int));
+
+  if (len == 0 || len > 65536) {
+    close (fds [0]);
+    close (fds [1]);
+    return false;
+  }
+  args.resize (len);
+  if (!read_all (c, &args [0], len) || args [len - 1]) {
+    close (fds [0]);
+    close (fds [1]);
+    return false;
+  }
+  return true;
+}
+
+int
+serve (const char *socket_name, picport &pic, job_runner run)
+{
+  struct sockaddr_un sa;
+  int s, retval;
+
+  if (EX_OK != (retval = socket_address (socket_name, sa))
+      || EX_OK != (retval = private_directory (socket_name)))
+    return retval;
+  unlink (socket_name);
+  mode_t mask = umask (077);
+  if (0 > (s = socket (AF_UNIX, SOCK_STREAM, 0))
+      || 0 > bind (s, (struct sockaddr *) &sa, sizeof (sa))
+      || 0 > chmod (socket_name, 0600)
+      || 0 > listen (s, 4)) {
+    int e = errno;
+    umask (mask);
+    cerr << socket_name << ":unable to listen:" << strerror (e) << endl;
+    return EX_OSERR;
+  }
+  umask (mask);
+  // A client that goes away must not take the daemon with it.
+  signal (SIGPIPE, SIG_IGN);
+  cout << "picprogd: " << pic.port () << " ready on " << socket_name << endl;
+
+  int saved_out = dup (1), saved_err = dup (2);
+  int saved_cwd = open (".", O_RDONLY);
+
+  for (;;) {
+    int c = accept (s, NULL, NULL);
+    if (c < 0) {
+      if (EINTR == errno)
+	continue;
+      int e = errno;
+      cerr << socket_name << ":accept failed:" << strerror (e) << endl;
+      return EX_OSERR;
+    }
+
+    struct ucred peer;
+    socklen_t peer_len = sizeof (peer);
+    if (getsockopt (c, SOL_SOCKET, SO_PEERCRED, &peer, &peer_len))
+      peer.uid = (uid_t) -1;
+
+    int fds [2];
+    vector<char> args;
+    if (!receive_job (c, fds, args)) {
+      close (c);
+      continue;
+    }
+
+    // Jobs write files and run with the daemon's rights.
+    if (peer.uid != geteuid ()) {
+      static const char refused [] = "picprogd: job refused, not the same user\n";
+      int32_t status = EX_NOPERM;
+      cerr << "picprogd: refused a job from uid " << (long) peer.uid << endl;
+      write_all (fds [1], refused, sizeof (refused) - 1);
+      close (fds [0]);
+      close (fds [1]);
+      write_all (c, &status, sizeof (status));
+      close (c);
+      continue;
+    }
+
+    vector<char *> argv;
+    for (size_t i = 0; i < args.size (); i += strlen (&args [i]) + 1)
+      argv.push_back (&args [i]);
+    int argc = argv.size () - 1;
+    argv.push_back (NULL);
+
+    cout.flush ();
+    cerr.flush ();
+    fflush (stdout);
+    fflush (stderr);
+    dup2 (fds [0], 1);
+    dup2 (fds [1], 2);
+    close (fds [0]);
+    close (fds [1]);
+
+    int32_t status;
+    if (chdir (argv [0])) {
+      int e = errno;
+      cerr << argv [0] << ":" << strerror (e) << endl;
+      status = EX_NOINPUT;
+    } else {
+      // The previous job left the chip somewhere, start it over.
+      pic.reset (0);
+      status = run (argc, &argv [1], &pic);
+    }
+
+    cout.flush ();
+    cerr.flush ();
+    fflush (stdout);
+    fflush (stderr);
+    dup2 (saved_out, 1);
+    dup2 (saved_err, 2);
+    if (0 <= saved_cwd && fchdir (saved_cwd))
+      cerr << "picprogd: unable to return to the working directory" << endl;
+
+    write_all (c, &status, sizeof (status));
+    close (c);
+  }
+}
+
+int
+forward (const char *socket_name, int argc, char **argv)
+{
+  struct sockaddr_un sa;
+  int s, retval;
+
+  if (EX_OK != (retval = socket_address (socket_name, sa)))
+    return retval;
+  if (0 > (s = socket (AF_UNIX, SOCK_STREAM, 0))
+      || 0 > connect (s, (struct sockaddr *) &sa, sizeof (sa))) {
+    int e = errno;
+    cerr << socket_name << ":unable to connect to picprogd:"
+	 << strerror (e) << endl;
+    return EX_UNAVAILABLE;
+  }
+
+  char cwd [PATH_MAX];
+  if (!getcwd (cwd, sizeof (cwd))) {
+    int e = errno;
+    cerr << "Unable to get the working directory:" << strerror (e) << endl;
+    return EX_OSERR;
+  }
+  string args (cwd, strlen (cwd) + 1);
+  for (int i = 0; i < argc; ++i)
+    args.append (argv [i], strlen (argv [i]) + 1);
+
+  uint32_t len = args.size ();
+  struct iovec iov = { &len, sizeof (len) };
+  char control [CMSG_SPACE (2 * sizeof (int))];
+  struct msghdr msg;
+  int fds [2] = { 1, 2 };
+
+  memset (&msg, 0, sizeof (msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof (control);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR (&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN (sizeof (fds));
+  memcpy (CMSG_DATA (cmsg), fds, sizeof (fds));
+
+  int32_t status;
+  if (sendmsg (s, &msg, 0) != sizeof (len)
+      || !write_all (s, args.data (), args.size ())
+      || !read_all (s, &status, sizeof (status))) {
+    cerr << socket_name << ":picprogd did not finish the job" << endl;
+    close (s);
+    return EX_IOERR;
+  }
+  close (s);
+  return status;
+}
@@ -0,0 +1,52 @@
+/* -*- c++ -*-
+
+This is Picprog, Microchip PIC programmer software for the serial port device.
+Copyright © 2010 Jaakko Hyvätti
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see http://www.gnu.org/licenses/ .
+
+The author may be contacted at:
+
+Email: Jaakko.Hyvatti@iki.fi
+URL:   http://www.iki.fi/hyvatti/
+Phone: +358 40 5011222
+
+Please send any suggestions, bug reports, success stories etc. to the
+Email address above.  Include word 'picprog' in the subject line to
+make sure your email passes my spam filtering.
+
+*/
+
+#ifndef H_DAEMON
+#define H_DAEMON
+
+#include <string>
+
+#include "picport.h"
+
+// picprogd keeps the programmer open and runs jobs sent to it over a
+// Unix domain socket.  A job is a picprog command line, run in the
+// client's working directory with the client's stdout and stderr.
+// The reply is the exit code of the job.  Only jobs from the user
+// the daemon runs as are taken.
+
+typedef int (*job_runner) (int argc, char **argv, picport *held);
+
+// picprogd.socket in $XDG_RUNTIME_DIR, or in /tmp/picprogd-<uid>.
+std::string default_socket ();
+
+int serve (const char *socket_name, picport &pic, job_runner run);
+int forward (const char *socket_name, int argc, char **argv);
+
+#endif // H_DAEMON
@@ -0,0 +1,1345 @@
+/* -*- c++ -*-
+
+This is Picprog, Microchip PIC programmer software for the serial port device.
+Copyright © 2010 Jaakko Hyvätti
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see http://www.gnu.org/licenses/ .
+
+The author may be contacted at:
+
+Email: Jaakko.Hyvatti@iki.fi
+URL:   http://www.iki.fi/hyvatti/
+Phone: +358 40 5011222
+
+Please send any suggestions, bug reports, success stories etc. to the
+Email address above.  Include word 'picprog' in the subject line to
+make sure your email passes my spam filtering.
+
+*/
+
+#include <iostream>
+#include <fstream>
+#include <deque>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h>
+
+#include "hw_defs.h"
+#include "stk500v2_private.h"
+#include "hexfile.h"
+#include "emulator.h"
+
+using namespace std;
+
+// Largest feature report of the AVR-Doper, for the USB transfer count.
+#define REPORT_SIZE 125
+
+/*
+
+  Simulated chips.  The programmer drives the clock, clock () is one
+  pulse of it.  pgd is the level the programmer puts on the data
+  line, the return value the level it reads back: the chip's bit when
+  the chip drives the line, pgd otherwise.
+
+  Memory holds the locations written since the last erase, keyed by
+  address.  Missing locations read as erased.
+
+ */
+
+class emu_target {
+public:
+  emu_target (int d) : dev (d) {}
+  virtual ~emu_target () {}
+
+  // MCLR raised to the programming voltage.
+  virtual void enter () = 0;
+  virtual int clock (int pgd) = 0;
+  // MCLR raised with PGD high, which starts the programming executive
+  // of the parts that have one.
+  virtual void enter_executive () { enter (); }
+  // The level of the data line between transfers.  The executive
+  // pulls it low when it has an answer.
+  virtual int data_line () const { return 1; }
+
+  bool load (const char *name);
+  bool save (const char *name) const;
+
+protected:
+  typedef map<unsigned long, int> memory;
+  memory mem;
+  int dev;
+
+  const hexfile::devinf &info () const { return hexfile::deviceinfo [dev]; }
+  int get (unsigned long addr, int erased) const;
+  void erase (unsigned long begin, unsigned long end);
+};
+
+int
+emu_target::get (unsigned long addr, int erased) const
+{
+  memory::const_iterator i = mem.find (addr);
+  return i == mem.end () ? erased : i->second;
+}
+
+void
+emu_target::erase (unsigned long begin, unsigned long end)
+{
+  mem.erase (mem.lower_bound (begin), mem.lower_bound (end));
+}
+
+bool
+emu_target::load (const char *name)
+{
+  ifstream f (name);
+  unsigned long addr;
+  int value;
+
+  if (!f)
+    return false;
+  mem.clear ();
+  while (f >> hex >> addr >> value)
+    mem [addr] = value;
+  return true;
+}
+
+bool
+emu_target::save (const char *name) const
+{
+  ofstream f (name);
+
+  for (memory::const_iterator i = mem.begin (); i != mem.end (); ++i)
+    f << hex << i->first << ' ' << i->second << '\n';
+  return f.good ();
+}
+
+// pic16 family, 6 bit commands.  Data memory is kept at 0x10000 up.
+
+class pic16_target : public emu_target {
+  enum { cmd_bits, load_bits, read_bits } phase;
+  int nbits;
+  unsigned long shift, out;
+  unsigned long pc;
+  bool load_data, magic1, magic;
+  int latch [8];
+  unsigned latched;
+  int data_latch;
+
+  static const unsigned long data_base = 0x10000;
+
+  int row () const
+  { return pc < 0x2000 && info ().write_size > 1 ? info ().write_size : 1; }
+  int read_prog () const;
+  void command (int c);
+  void commit (bool program_only);
+
+public:
+  pic16_target (int d) : emu_target (d), pc (0) { enter (); }
+  void enter ();
+  int clock (int pgd);
+};
+
+void
+pic16_target::enter ()
+{
+  phase = cmd_bits;
+  nbits = 0;
+  shift = 0;
+  pc = 0;
+  load_data = magic1 = magic = false;
+  latched = 0;
+}
+
+int
+pic16_target::read_prog () const
+{
+  if (pc < 0x2000)
+    return get (pc % info ().prog_size, 0x3fff);
+  if (0x2006 == pc && -1 != info ().device_id)
+    return info ().device_id;
+  return get (pc, 0x3fff);
+}
+
+void
+pic16_target::command (int c)
+{
+  bool was_magic1 = magic1;
+
+  magic1 = false;
+  switch (c) {
+  case picport::load_conf:
+    pc = 0x2000;
+    // FALLTHROUGH
+  case picport::data_for_prog:
+  case picport::data_for_data:
+    load_data = picport::data_for_data == c;
+    phase = load_bits;
+    break;
+  case picport::data_from_prog:
+    out = read_prog () << 1;
+    phase = read_bits;
+    break;
+  case picport::data_from_data:
+    out = info ().data_size
+      ? get (data_base + pc % info ().data_size, 0xff) << 1 : 0x1fe;
+    phase = read_bits;
+    break;
+  case picport::inc_addr:
+    if (++pc >= 0x4000)
+      pc = 0x2000;
+    break;
+  case picport::beg_prog:
+    if (magic) {
+      // command1, command7, beg_prog clears code protection by
+      // erasing the whole chip.
+      mem.clear ();
+      magic = false;
+    } else
+      commit (false);
+    break;
+  case picport::beg_prog_only:
+    commit (true);
+    break;
+  case picport::erase_prog:
+    erase (0, 0x2000);
+    if (pc >= 0x2000)
+      erase (0x2000, 0x4000);
+    break;
+  case picport::erase_data:
+    erase (data_base, data_base + 0x10000);
+    break;
+  case picport::chip_erase:
+    mem.clear ();
+    break;
+  case picport::command1:
+    magic1 = true;
+    break;
+  case picport::command7:
+    magic = was_magic1;
+    break;
+  default:
+    ;
+  }
+}
+
+// Write the loaded latches.  Program memory writes without erase
+// can only clear bits.
+
+void
+pic16_target::commit (bool program_only)
+{
+  if (load_data) {
+    if (info ().data_size)
+      mem [data_base + pc % info ().data_size] = data_latch & 0xff;
+    return;
+  }
+  int n = row ();
+  unsigned long base = pc & ~(unsigned long)(n - 1);
+  for (int k = 0; k < n; ++k) {
+    if (!(latched & (1 << k)))
+      continue;
+    unsigned long a = base + k;
+    if (a < 0x2000)
+      a %= info ().prog_size;
+    else if (0x2006 == a)
+      continue;
+    int value = latch [k];
+    if (program_only && a < 0x2000)
+      value &= get (a, 0x3fff);
+    mem [a] = value;
+  }
+  latched = 0;
+}
+
+int
+pic16_target::clock (int pgd)
+{
+  switch (phase) {
+  case cmd_bits:
+    shift |= (unsigned long)pgd << nbits;
+    if (6 == ++nbits) {
+      nbits = 0;
+      command (shift & 0x3f);
+      shift = 0;
+    }
+    return pgd;
+
+  case load_bits:
+    shift |= (unsigned long)pgd << nbits;
+    if (16 == ++nbits) {
+      int value = (shift >> 1) & 0x3fff;
+      if (load_data)
+	data_latch = value;
+      else {
+	int k = pc & (row () - 1);
+	latch [k] = value;
+	latched |= 1 << k;
+      }
+      phase = cmd_bits;
+      nbits = 0;
+      shift = 0;
+    }
+    return pgd;
+
+  case read_bits:
+    int bit = (out >> nbits) & 1;
+    if (16 == ++nbits) {
+      phase = cmd_bits;
+      nbits = 0;
+    }
+    return bit;
+  }
+  return pgd;
+}
+
+// pic18 family, 4 bit commands with 16 bit payload.  Data memory is
+// kept at 0xf00000 up, as in the hex file.
+
+class pic18_target : public emu_target {
+  enum { cmd_bits, payload_bits } phase;
+  int nbits, cmd;
+  unsigned long shift;
+  unsigned long tblptr;
+  int tablat, w;
+  int regs [256];
+  map<unsigned long, int> pending;
+  bool erase_pending;
+  int erase_ctl;
+
+  static const unsigned long data_base = 0xf00000;
+
+  int read (unsigned long a) const;
+  void write (unsigned long a, int value);
+  void commit ();
+  void instruction (int op);
+  int reg (int op) const;
+  int reg_read (int r) const;
+  void reg_write (int r, int value);
+  void payload (int value);
+
+public:
+  pic18_target (int d) : emu_target (d) { enter (); }
+  void enter ();
+  int clock (int pgd);
+};
+
+void
+pic18_target::enter ()
+{
+  phase = cmd_bits;
+  nbits = 0;
+  shift = 0;
+  tblptr = 0;
+  tablat = w = 0;
+  memset (regs, 0, sizeof (regs));
+  pending.clear ();
+  erase_pending = false;
+  erase_ctl = 0;
+}
+
+int
+pic18_target::read (unsigned long a) const
+{
+  if (0x3ffffe == a)
+    return info ().device_id & 0xff;
+  if (0x3fffff == a)
+    return (info ().device_id >> 8) & 0xff;
+  return get (a, 0xff);
+}
+
+// Table write into the write latches, or the erase control registers.
+
+void
+pic18_target::write (unsigned long a, int value)
+{
+  if (a >= 0x3c0000 && a < 0x3c0010) {
+    if (0x3c0004 == (a & ~1UL)) {
+      erase_ctl = a & 1 ? (value >> 8) & 0xff : value & 0xff;
+      erase_pending = true;
+    }
+  } else if (a >= 0x300000 && a < 0x300010)
+    pending [a] = a & 1 ? (value >> 8) & 0xff : value & 0xff;
+  else {
+    pending [a & ~1UL] = value & 0xff;
+    pending [a | 1] = (value >> 8) & 0xff;
+  }
+}
+
+// Start of programming: flash bits can only be cleared, configuration
+// bytes are written as they are.
+
+void
+pic18_target::commit ()
+{
+  for (map<unsigned long, int>::iterator i = pending.begin ();
+       i != pending.end (); ++i) {
+    unsigned long a = i->first;
+    if (a >= 0x300000 && a < 0x300010)
+      mem [a] = i->second;
+    else if (a < info ().prog_size || (a >= 0x200000 && a < 0x200008))
+      mem [a] = i->second & get (a, 0xff);
+  }
+  pending.clear ();
+}
+
+int
+pic18_target::reg (int op) const
+{
+  int f = op & 0xff;
+  // Access bank, a == 0: upper part is special function registers.
+  if (!(op & 0x100) && f >= 0x60)
+    return 0xf00 | f;
+  return f;
+}
+
+int
+pic18_target::reg_read (int r) const
+{
+  switch (r) {
+  case 0xff8: return (tblptr >> 16) & 0xff;
+  case 0xff7: return (tblptr >> 8) & 0xff;
+  case 0xff6: return tblptr & 0xff;
+  case 0xff5: return tablat;
+  }
+  return r >= 0xf00 ? regs [r & 0xff] : 0;
+}
+
+void
+pic18_target::reg_write (int r, int value)
+{
+  value &= 0xff;
+  switch (r) {
+  case 0xff8:
+    tblptr = (tblptr & 0x00ffff) | ((unsigned long)(value & 0x3f) << 16);
+    return;
+  case 0xff7:
+    tblptr = (tblptr & 0xff00ff) | (value << 8);
+    return;
+  case 0xff6:
+    tblptr = (tblptr & 0xffff00) | value;
+    return;
+  case 0xff5:
+    tablat = value;
+    return;
+  }
+  if (r < 0xf00)
+    return;
+  regs [r & 0xff] = value;
+  if (0xfa6 != r)
+    return;
+
+  // EECON1: RD and WR of data memory, EEADRH:EEADR and EEDATA.
+  unsigned long a = data_base;
+  if (info ().data_size)
+    a += ((regs [0xaa] << 8) | regs [0xa9]) % info ().data_size;
+  if ((value & 0x01) && !(value & 0xc0))
+    regs [0xa8] = get (a, 0xff);
+  if ((value & 0x02) && (value & 0x04) && !(value & 0xc0)
+      && info ().data_size)
+    mem [a] = regs [0xa8];
+  regs [0xa6] &= ~0x03;
+}
+
+void
+pic18_target::instruction (int op)
+{
+  if (0 == op) {
+    // NOP after the erase control write starts the bulk erase.
+    if (erase_pending && (erase_ctl & 0x80))
+      mem.clear ();
+    erase_pending = false;
+    return;
+  }
+  int r = reg (op), b = (op >> 9) & 7;
+  if (0x0e00 == (op & 0xff00))
+    w = op & 0xff; // MOVLW
+  else if (0x6e00 == (op & 0xfe00))
+    reg_write (r, w); // MOVWF
+  else if (0x5000 == (op & 0xfe00))
+    w = reg_read (r); // MOVF f, W
+  else if (0x8000 == (op & 0xf000))
+    reg_write (r, reg_read (r) | (1 << b)); // BSF
+  else if (0x9000 == (op & 0xf000))
+    reg_write (r, reg_read (r) & ~(1 << b)); // BCF
+}
+
+void
+pic18_target::payload (int value)
+{
+  switch (cmd) {
+  case picport::instr:
+    instruction (value);
+    break;
+  case picport::twrite:
+    write (tblptr, value);
+    break;
+  case picport::twrite_inc2:
+    write (tblptr, value);
+    tblptr = (tblptr + 2) & 0x3fffff;
+    break;
+  case picport::twrite_dec2:
+    write (tblptr, value);
+    tblptr = (tblptr - 2) & 0x3fffff;
+    break;
+  case picport::twrite_prog:
+    write (tblptr, value);
+    commit ();
+    break;
+  }
+}
+
+int
+pic18_target::clock (int pgd)
+{
+  if (cmd_bits == phase) {
+    shift |= (unsigned long)pgd << nbits;
+    if (4 == ++nbits) {
+      cmd = shift;
+      switch (cmd) {
+      case picport::tread:
+	tablat = read (tblptr);
+	break;
+      case picport::tread_inc:
+	tablat = read (tblptr);
+	tblptr = (tblptr + 1) & 0x3fffff;
+	break;
+      case picport::tread_dec:
+	tablat = read (tblptr);
+	tblptr = (tblptr - 1) & 0x3fffff;
+	break;
+      case picport::inc_tread:
+	tblptr = (tblptr + 1) & 0x3fffff;
+	tablat = read (tblptr);
+	break;
+      }
+      phase = payload_bits;
+      nbits = 0;
+      shift = 0;
+    }
+    return pgd;
+  }
+
+  bool reading = picport::shift_out == cmd
+    || (cmd >= picport::tread && cmd <= picport::inc_tread);
+  int bit = pgd;
+  if (reading && nbits >= 8)
+    bit = (tablat >> (nbits - 8)) & 1;
+  else
+    shift |= (unsigned long)pgd << nbits;
+  if (16 == ++nbits) {
+    if (!reading)
+      payload (shift);
+    phase = cmd_bits;
+    nbits = 0;
+    shift = 0;
+  }
+  return bit;
+}
+
+// dspic30 family: SIX runs a 24 bit instruction, REGOUT shifts out
+// VISI.  Program space is kept by address, data space registers in W
+// and sfr.
+//
+// Entered with PGD high and something in executive memory, it runs a
+// stand-in for the programming executive instead: 16 bit command
+// words in and answers out, MSB first, with the READP, PROGP,
+// QBLANK, QVER and SCHECK commands.  Whatever was downloaded is taken
+// to be an executive.
+
+class dspic30_target : public emu_target {
+  enum { cmd_bits, six_bits, regout_bits, other_bits } phase;
+  int nbits;
+  unsigned long shift;
+  unsigned W [16];
+  map<int, unsigned> sfr;
+  struct latch { unsigned long value, mask; };
+  map<unsigned long, latch> pending;
+
+  // The executive, the command words it has got and its answer.
+  bool pe;
+  vector<unsigned> pe_in;
+  deque<unsigned> pe_out;
+
+  enum { TBLPAG = 0x32, NVMCON = 0x760, NVMADR = 0x762, NVMADRU = 0x764,
+	 VISI = 0x784 };
+
+  unsigned data_read (unsigned a) const;
+  void data_write (unsigned a, unsigned value);
+  unsigned long indirect (int mode, int r, int step);
+  unsigned long prog_read (unsigned long a) const;
+  void table_read (unsigned long op);
+  void table_write (unsigned long op);
+  void nvm ();
+  void instruction (unsigned long op);
+  void pe_command ();
+  int pe_clock (int pgd);
+
+  bool is_data (unsigned long a) const
+  { return a >= 0x7ff000 && a < 0x800000; }
+  bool is_conf (unsigned long a) const
+  { return a >= 0xf80000 && a < 0xf80010; }
+
+public:
+  dspic30_target (int d) : emu_target (d) { enter (); }
+  void enter ();
+  void enter_executive ();
+  int data_line () const { return pe && !pe_out.empty () ? 0 : 1; }
+  int clock (int pgd);
+};
+
+// Executive memory, 736 instructions.
+#define EXEC_BEGIN 0x800000UL
+#define EXEC_END 0x8005c0UL
+
+void
+dspic30_target::enter ()
+{
+  phase = cmd_bits;
+  nbits = 0;
+  shift = 0;
+  memset (W, 0, sizeof (W));
+  sfr.clear ();
+  pending.clear ();
+  pe = false;
+  pe_in.clear ();
+  pe_out.clear ();
+}
+
+void
+dspic30_target::enter_executive ()
+{
+  enter ();
+  pe = mem.lower_bound (EXEC_BEGIN) != mem.lower_bound (EXEC_END);
+}
+
+// W registers are mapped at the start of data space.
+
+unsigned
+dspic30_target::data_read (unsigned a) const
+{
+  if (a < 0x20)
+    return W [a >> 1];
+  map<int, unsigned>::const_iterator i = sfr.find (a & ~1);
+  return i == sfr.end () ? 0 : i->second;
+}
+
+void
+dspic30_target::data_write (unsigned a, unsigned value)
+{
+  value &= 0xffff;
+  if (a < 0x20)
+    W [a >> 1] = value;
+  else
+    sfr [a & ~1] = value;
+  if (NVMCON == (a & ~1) && (value & 0x8000))
+    nvm ();
+}
+
+// Effective address of an indirect operand, with the pre or post
+// modification of the register.
+
+unsigned long
+dspic30_target::indirect (int mode, int r, int step)
+{
+  unsigned long a = W [r];
+  switch (mode) {
+  case 2: W [r] -= step; break;
+  case 3: W [r] += step; break;
+  case 4: a = W [r] -= step; break;
+  case 5: a = W [r] += step; break;
+  }
+  W [r] &= 0xffff;
+  return a & 0xffff;
+}
+
+unsigned long
+dspic30_target::prog_read (unsigned long a) const
+{
+  a &= ~1UL;
+  if (0xff0000 == a)
+    return info ().device_id;
+  if (0xff0002 == a)
+    return 0x0001; // revision
+  return get (a, 0xffffff);
+}
+
+// TBLRDL, TBLRDH
+void
+dspic30_target::table_read (unsigned long op)
+{
+  bool high = op & 0x8000, byte = op & 0x4000;
+  int step = byte ? 1 : 2;
+  unsigned long a = (data_read (TBLPAG) << 16)
+    | indirect ((op >> 4) & 7, op & 15, step);
+  unsigned long word = prog_read (a);
+  unsigned value;
+  if (high)
+    value = byte && (a & 1) ? 0 : (word >> 16) & 0xff;
+  else if (byte)
+    value = (word >> (a & 1 ? 8 : 0)) & 0xff;
+  else
+    value = word & 0xffff;
+
+  int q = (op >> 11) & 7, d = (op >> 7) & 15;
+  if (0 == q)
+    W [d] = byte ? (W [d] & 0xff00) | value : value;
+  else
+    data_write (indirect (q, d, step), value);
+}
+
+// TBLWTL, TBLWTH into the write latches.
+void
+dspic30_target::table_write (unsigned long op)
+{
+  bool high = op & 0x8000, byte = op & 0x4000;
+  int step = byte ? 1 : 2;
+  int p = (op >> 4) & 7, s = op & 15;
+  unsigned value = W [s];
+  if (0 != p) {
+    unsigned long from = indirect (p, s, step);
+    value = data_read (from);
+    // Byte reads of odd addresses take the high byte.
+    if (byte && (from & 1))
+      value >>= 8;
+  }
+  unsigned long a = (data_read (TBLPAG) << 16)
+    | indirect ((op >> 11) & 7, (op >> 7) & 15, step);
+  unsigned long shift = high ? 16 : byte && (a & 1) ? 8 : 0;
+  unsigned long mask = high || byte ? 0xff : 0xffff;
+
+  latch &l = pending [a & ~1UL];
+  l.value = (l.value & ~(mask << shift)) | ((value & mask) << shift);
+  l.mask |= mask << shift;
+}
+
+// Setting NVMCON WR runs the operation it selects.
+
+void
+dspic30_target::nvm ()
+{
+  unsigned con = data_read (NVMCON);
+  unsigned long a = ((unsigned long)data_read (NVMADRU) << 16)
+    | data_read (NVMADR);
+
+  switch (con & 0x7f) {
+  case 0x7f: // bulk erase, executive memory is kept
+    erase (0, EXEC_BEGIN);
+    erase (EXEC_BEGIN + 0x600, ~0UL);
+    break;
+  case 0x41: // erase program memory row
+    erase (a & ~63UL, (a & ~63UL) + 64);
+    break;
+  case 0x44: // erase data memory word
+    erase (a & ~1UL, (a & ~1UL) + 2);
+    break;
+  case 0x45: // erase data memory row
+    erase (a & ~31UL, (a & ~31UL) + 32);
+    break;
+  default:
+    // Write the latches.  Flash bits can only be cleared.
+    for (map<unsigned long, latch>::iterator i = pending.begin ();
+	 i != pending.end (); ++i) {
+      unsigned long old = get (i->first, 0xffffff);
+      unsigned long value = (old & ~i->second.mask) | i->second.value;
+      if (!is_data (i->first) && !is_conf (i->first))
+	value &= old;
+      mem [i->first] = value;
+    }
+    pending.clear ();
+  }
+  sfr [NVMCON] = con & ~0x8000;
+}
+
+void
+dspic30_target::instruction (unsigned long op)
+{
+  if (0x200000 == (op & 0xf00000))
+    W [op & 15] = (op >> 4) & 0xffff; // MOV #lit16, Wn
+  else if (0x880000 == (op & 0xf80000))
+    data_write (((op >> 4) & 0x7fff) << 1, W [op & 15]); // MOV Wn, f
+  else if (0x800000 == (op & 0xf80000))
+    W [op & 15] = data_read (((op >> 4) & 0x7fff) << 1); // MOV f, Wn
+  else if (0xeb0000 == (op & 0xfff87f))
+    W [(op >> 7) & 15] = 0; // CLR Wn
+  else if (0xba0000 == (op & 0xff0000))
+    table_read (op);
+  else if (0xbb0000 == (op & 0xff0000))
+    table_write (op);
+  else if (0xa80000 == (op & 0xfe0000)) {
+    // BSET, BCLR
+    unsigned f = op & 0x1ffe;
+    int b = (((op >> 13) & 7) << 1) | (op & 1);
+    if (op & 0x010000)
+      data_write (f, data_read (f) & ~(1 << b));
+    else
+      data_write (f, data_read (f) | (1 << b));
+  }
+}
+
+// Run the command in pe_in.  The answer starts with a word of pass
+// 1, fail 2 or nack 3, the opcode and a code, and the length of the
+// answer in words.
+
+void
+dspic30_target::pe_command ()
+{
+  const unsigned op = pe_in [0] >> 12;
+  // READP address
+  unsigned long a = pe_in.size () >= 4
+    ? (unsigned long) (pe_in [2] & 0xff) << 16 | pe_in [3] : 0;
+
+  switch (op) {
+  case 0x0: // SCHECK
+    pe_out.push_back (0x1000);
+    pe_out.push_back (2);
+    break;
+
+  case 0x2: // READP N, address; packed two instructions in three words
+    {
+      unsigned n = pe_in.size () >= 4 ? pe_in [1] : 0;
+      pe_out.push_back (0x1200);
+      pe_out.push_back (2 + (3 * n + 1) / 2);
+      for (unsigned i = 0; i < n; i += 2, a += 4) {
+	unsigned long i0 = prog_read (a), i1 = prog_read (a + 2);
+	pe_out.push_back (i0 & 0xffff);
+	if (i + 1 == n) {
+	  pe_out.push_back (i0 >> 16);
+	  break;
+	}
+	pe_out.push_back ((i1 >> 16) << 8 | i0 >> 16);
+	pe_out.push_back (i1 & 0xffff);
+      }
+    }
+    break;
+
+  case 0x5: // PROGP address, 32 instructions packed like READP
+    {
+      bool ok = 51 == pe_in.size ();
+      a = (unsigned long) (pe_in [1] & 0xff) << 16 | pe_in [2];
+      for (unsigned i = 0; ok && i < 48; i += 3, a += 4) {
+	unsigned long w [2] = {
+	  (unsigned long) (pe_in [4 + i] & 0xff) << 16 | pe_in [3 + i],
+	  (unsigned long) (pe_in [4 + i] >> 8) << 16 | pe_in [5 + i] };
+	for (int k = 0; k < 2; ++k) {
+	  unsigned long old = get (a + 2 * k, 0xffffff);
+	  mem [a + 2 * k] = old & w [k];
+	  ok = ok && mem [a + 2 * k] == (int) w [k];
+	}
+      }
+      pe_out.push_back (ok ? 0x1500 : 0x2500);
+      pe_out.push_back (2);
+    }
+    break;
+
+  case 0xa: // QBLANK program instructions, data words
+    {
+      bool blank = pe_in.size () >= 3;
+      if (blank) {
+	unsigned long dbegin = 0x800000UL - 2 * pe_in [2];
+	blank = mem.lower_bound (0) == mem.lower_bound (2UL * pe_in [1])
+	  && mem.lower_bound (dbegin) == mem.lower_bound (0x800000UL);
+      }
+      pe_out.push_back (blank ? 0x1af0 : 0x1a0f);
+      pe_out.push_back (2);
+    }
+    break;
+
+  case 0xb: // QVER
+    pe_out.push_back (0x1b01);
+    pe_out.push_back (2);
+    break;
+
+  default:
+    pe_out.push_back (0x3000 | op << 8);
+    pe_out.push_back (2);
+  }
+}
+
+int
+dspic30_target::pe_clock (int pgd)
+{
+  if (!pe_out.empty ()) {
+    int bit = (pe_out.front () >> (15 - nbits)) & 1;
+    if (16 == ++nbits) {
+      pe_out.pop_front ();
+      nbits = 0;
+    }
+    return bit;
+  }
+
+  shift = shift << 1 | pgd;
+  if (16 == ++nbits) {
+    pe_in.push_back (shift & 0xffff);
+    nbits = 0;
+    shift = 0;
+    if (pe_in.size () >= max (1U, pe_in [0] & 0xfffU)) {
+      pe_command ();
+      pe_in.clear ();
+    }
+  }
+  return pgd;
+}
+
+int
+dspic30_target::clock (int pgd)
+{
+  if (pe)
+    return pe_clock (pgd);
+  switch (phase) {
+  case cmd_bits:
+    shift |= (unsigned long)pgd << nbits;
+    if (4 == ++nbits) {
+      if (picport::SIX == shift)
+	phase = six_bits;
+      else if (picport::REGOUT == shift)
+	phase = regout_bits;
+      else
+	phase = other_bits;
+      nbits = 0;
+      shift = 0;
+    }
+    return pgd;
+
+  case six_bits:
+    shift |= (unsigned long)pgd << nbits;
+    if (24 == ++nbits) {
+      instruction (shift);
+      phase = cmd_bits;
+      nbits = 0;
+      shift = 0;
+    }
+    return pgd;
+
+  case other_bits:
+    // Not a dspic30 command, like the pic18 reads done while
+    // detecting the device.  The line is not driven.
+    if (16 == ++nbits) {
+      phase = cmd_bits;
+      nbits = 0;
+    }
+    return pgd;
+
+  case regout_bits:
+    // 8 idle clocks, then VISI
+    int bit = nbits < 8 ? pgd : (data_read (VISI) >> (nbits - 8)) & 1;
+    if (24 == ++nbits) {
+      phase = cmd_bits;
+      nbits = 0;
+    }
+    return bit;
+  }
+  return pgd;
+}
+
+//**************************************************************************
+
+emulator::emulator (const char *device, const char *serial)
+  : target (0), out_pos (0), latency (0), realtime (false), basic (false),
+    pgc (0), pgd (0), vdd (0), mclr_hv (0)
+{
+  int d = hexfile::find_device (device);
+  if (-1 == d) {
+    cerr << device << ": unknown device to emulate" << endl;
+    return;
+  }
+  switch (hexfile::deviceinfo [d].prog_bits) {
+  case 14:
+    target = new pic16_target (d);
+    break;
+  case 16:
+    target = new pic18_target (d);
+    break;
+  case 24:
+    target = new dspic30_target (d);
+    break;
+  default:
+    cerr << device << ": emulation of "
+	 << hexfile::deviceinfo [d].prog_bits << " bit devices not supported"
+	 << endl;
+    return;
+  }
+
+  const char *s;
+  if ((s = getenv ("PIC_EMULATE_LATENCY")))
+    latency = strtoul (s, NULL, 0);
+  if ((s = getenv ("PIC_EMULATE_REALTIME")))
+    realtime = atoi (s) != 0;
+  if ((s = getenv ("PIC_EMULATE_BASIC")))
+    basic = atoi (s) != 0;
+  if ((s = getenv ("PIC_EMULATE_STATE")) && *s) {
+    state_file = s;
+    if (serial && getenv ("PIC_EMULATE_SERIALS"))
+      state_file = state_file + "-" + serial;
+    target->load (state_file.c_str ());
+  }
+}
+
+emulator::~emulator ()
+{
+  if (target && !state_file.empty () && !target->save (state_file.c_str ()))
+    cerr << state_file << ": unable to save emulated chip" << endl;
+  delete target;
+}
+
+// Frames may arrive in pieces, each complete one is answered.
+
+int
+emulator::send (const unsigned char *buf, size_t len)
+{
+  in.append ((const char *)buf, len);
+  for (;;) {
+    size_t start = in.find ((char)MESSAGE_START);
+    if (string::npos == start) {
+      in.clear ();
+      break;
+    }
+    in.erase (0, start);
+    if (in.size () < 5)
+      break;
+    size_t body = ((unsigned char)in [2] << 8) | (unsigned char)in [3];
+    if (in.size () < body + 6)
+      break;
+    unsigned char sum = 0;
+    for (size_t i = 0; i < body + 6; ++i)
+      sum ^= in [i];
+    if (TOKEN == in [4] && 0 == sum)
+      message (in [1], (const unsigned char *)in.data () + 5, body);
+    in.erase (0, body + 6);
+  }
+  return 0;
+}
+
+int
+emulator::recv (unsigned char *buf, size_t len)
+{
+  if (out_pos + len > out.size ())
+    return -1;
+  memcpy (buf, out.data () + out_pos, len);
+  out_pos += len;
+  if (out_pos == out.size ()) {
+    out.clear ();
+    out_pos = 0;
+  }
+  return 0;
+}
+
+void
+emulator::drain ()
+{
+  out.clear ();
+  out_pos = 0;
+}
+
+void
+emulator::reply (unsigned char seq, const string &body)
+{
+  string f;
+  f += (char)MESSAGE_START;
+  f += (char)seq;
+  f += (char)(body.size () >> 8);
+  f += (char)(body.size () & 0xff);
+  f += (char)TOKEN;
+  f += body;
+  unsigned char sum = 0;
+  for (size_t i = 0; i < f.size (); ++i)
+    sum ^= f [i];
+  f += (char)sum;
+  out += f;
+}
+
+// Commands execute () runs, as told by STK_CMD_GET_CAPS_ISCP.
+
+static bool
+known (int c)
+{
+  switch (c) {
+  case c_nop:
+  case c_enablePGC_D:
+  case c_PGDlow:
+  case c_PGDhigh:
+  case c_PGClow:
+  case c_PGChigh:
+  case c_VDDon:
+  case c_VDDoff:
+  case c_HVReset_ENABLE:
+  case c_HVReset_OFF:
+  case c_HVReset_TO_RESET:
+  case c_HVReset_TO_HV:
+  case c_clock_delay:
+  case c_DelayMs:
+  case c_DelayUs:
+  case c_pic_send:
+  case c_dspic_send_24:
+  case c_pic_send_n:
+  case c_pic_read:
+  case c_pic_read_14_bits:
+  case c_pic_read_byte2:
+  case c_dspic_read_16_bits:
+  case c_set_param:
+  case c_dspic_pe_send:
+  case c_dspic_pe_read:
+    return true;
+  }
+  return false;
+}
+
+void
+emulator::message (unsigned char seq, const unsigned char *body, size_t len)
+{
+  string r;
+  unsigned long us = 0;
+
+  if (!len)
+    return;
+  r += (char)body [0];
+  switch (body [0]) {
+  case CMD_SIGN_ON:
+    r += (char)STATUS_CMD_OK;
+    r += (char)8;
+    r += "STK500_2";
+    break;
+  case STK_CMD_PREPARE_PROGMODE_ISCP:
+    r += (char)STATUS_CMD_OK;
+    break;
+  case STK_CMD_LEAVE_PROGMODE_ISCP:
+    vdd = mclr_hv = 0;
+    r += (char)STATUS_CMD_OK;
+    break;
+  case STK_CMD_GET_CAPS_ISCP:
+    if (basic) {
+      r += (char)STATUS_CMD_UNKNOWN;
+      break;
+    }
+    r += (char)STATUS_CMD_OK;
+    r += (char)1;
+    r += (char)(LBUFCMDSIZE & 0xff);
+    r += (char)(LBUFCMDSIZE >> 8);
+    r += (char)(LBUFCMDSIZE & 0xff);
+    r += (char)(LBUFCMDSIZE >> 8);
+    r += (char)0;		// clock delay
+    r += (char)(1000 & 0xff);	// 1 us PGC period
+    r += (char)(1000 >> 8);
+    {
+      string commands (9, '\0');
+      for (int c = 0; c < 72; ++c)
+	if (known (c))
+	  commands [c / 8] |= 1 << (c & 7);
+      r += commands;
+    }
+    break;
+  case STK_CMD_RUN_ISCP: {
+    string reads;
+    if (len > (basic ? LBUFCMDMAX : LBUFCMDSIZE)
+	|| execute (body + 1, len - 1, reads, us) < 0)
+      r += (char)STATUS_CMD_FAILED;
+    else {
+      r += (char)STATUS_CMD_OK;
+      r += reads;
+    }
+    break;
+  }
+  default:
+    r += (char)STATUS_CMD_UNKNOWN;
+  }
+  reply (seq, r);
+
+  // Transfers as avrdoper would make them: the frame in feature
+  // reports, then at least one report to fetch the answer.
+  unsigned long transfers = (len + 6 + REPORT_SIZE - 1) / REPORT_SIZE
+    + (r.size () + 6 + REPORT_SIZE - 1) / REPORT_SIZE;
+  if (!realtime)
+    us = 0;
+  us += transfers * latency;
+  if (us)
+    usleep (us);
+}
+
+int
+emulator::clock (int bit)
+{
+  // Without power and programming voltage nothing answers, the line
+  // reads high.
+  if (!vdd || !mclr_hv)
+    return 1;
+  return target->clock (bit);
+}
+
+void
+emulator::write_bits (int n, unsigned long value)
+{
+  for (int i = 0; i < n; ++i)
+    clock ((value >> i) & 1);
+}
+
+unsigned long
+emulator::read_bits (int n)
+{
+  unsigned long value = 0;
+  for (int i = 0; i < n; ++i)
+    value |= (unsigned long)clock (1) << i;
+  return value;
+}
+
+// Run the commands of one STK_CMD_RUN_ISCP frame.  Every read adds
+// two bytes, low byte first, to reads.
+
+int
+emulator::execute (const unsigned char *p, size_t len, string &reads, unsigned long &us)
+{
+  size_t i = 0;
+
+  while (i < len) {
+    int c = p [i++];
+    unsigned long value;
+    int n;
+    bool read = false;
+
+    switch (c) {
+    case c_nop:
+    case c_enablePGC_D:
+    case c_clock_delay:
+    case c_HVReset_ENABLE:
+      break;
+    case c_PGDlow:
+      pgd = 0;
+      break;
+    case c_PGDhigh:
+      pgd = 1;
+      break;
+    case c_PGClow:
+      // Bits are taken on the falling edge.
+      if (pgc)
+	clock (pgd);
+      pgc = 0;
+      break;
+    case c_PGChigh:
+      pgc = 1;
+      break;
+    case c_VDDon:
+      vdd = 1;
+      break;
+    case c_VDDoff:
+      vdd = 0;
+      break;
+    case c_HVReset_OFF:
+    case c_HVReset_TO_RESET:
+      mclr_hv = 0;
+      break;
+    case c_HVReset_TO_HV:
+      if (!mclr_hv && vdd) {
+	if (pgd)
+	  target->enter_executive ();
+	else
+	  target->enter ();
+      }
+      mclr_hv = 1;
+      break;
+    case c_DelayMs:
+      if (i >= len)
+	return -1;
+      us += p [i++] * 1000;
+      break;
+    case c_DelayUs:
+      if (i >= len)
+	return -1;
+      us += p [i++] * 5;
+      break;
+    case c_pic_send:
+      if (i >= len || !(n = p [i++]) || n > 32 || i + (n + 7) / 8 > len)
+	return -1;
+      value = 0;
+      for (int k = 0; k < (n + 7) / 8; ++k)
+	value |= (unsigned long)p [i++] << (8 * k);
+      write_bits (n, value);
+      break;
+    case c_pic_send_n:
+      {
+	if (basic || i + 3 > len || (n = p [i + 1]) > 32 || !n)
+	  return -1;
+	int words = p [i], gap = p [i + 2], bytes = (n + 7) / 8;
+	i += 3;
+	if (i + words * bytes > len)
+	  return -1;
+	for (int w = 0; w < words; ++w) {
+	  value = 0;
+	  for (int k = 0; k < bytes; ++k)
+	    value |= (unsigned long)p [i++] << (8 * k);
+	  write_bits (n, value);
+	  us += gap * 5;
+	}
+      }
+      break;
+    case c_dspic_send_24:
+      if (i + 3 > len)
+	return -1;
+      value = p [i] | (p [i + 1] << 8) | ((unsigned long)p [i + 2] << 16);
+      i += 3;
+      write_bits (24, value);
+      break;
+    case c_pic_read:
+      value = read_bits (16);
+      read = true;
+      break;
+    case c_pic_read_14_bits:
+      // Start bit, 14 data bits, stop bit
+      value = (read_bits (16) >> 1) & 0x3fff;
+      read = true;
+      break;
+    case c_pic_read_byte2:
+      write_bits (8, 0);
+      value = read_bits (8);
+      read = true;
+      break;
+    case c_dspic_read_16_bits:
+      write_bits (4, picport::REGOUT);
+      write_bits (8, 0);
+      value = read_bits (16);
+      read = true;
+      break;
+    case c_set_param:
+      if (i + 2 > len)
+	return -1;
+      i += 2;
+      break;
+    case c_dspic_pe_send:
+      if (basic || i >= len || i + 1 + 2 * p [i] > len)
+	return -1;
+      n = p [i++];
+      for (int w = 0; w < n; ++w, i += 2)
+	for (int b = 15; b >= 0; --b)
+	  clock (((p [i] | p [i + 1] << 8) >> b) & 1);
+      break;
+    case c_dspic_pe_read:
+      if (basic)
+	return -1;
+      value = 0xffff;
+      if (vdd && mclr_hv && !target->data_line ()) {
+	value = 0;
+	for (int b = 0; b < 16; ++b)
+	  value = value << 1 | clock (1);
+      }
+      read = true;
+      break;
+    default:
+      cerr << "emulator: unknown command 0x" << hex << c << dec << endl;
+      return -1;
+    }
+    if (read) {
+      reads += (char)(value & 0xff);
+      reads += (char)((value >> 8) & 0xff);
+    }
+  }
+  return 0;
+}
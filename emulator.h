@@ -0,0 +1,94 @@
+/* -*- c++ -*-
+
+This is Picprog, Microchip PIC programmer software for the serial port device.
+Copyright © 2010 Jaakko Hyvätti
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see http://www.gnu.org/licenses/ .
+
+The author may be contacted at:
+
+Email: Jaakko.Hyvatti@iki.fi
+URL:   http://www.iki.fi/hyvatti/
+Phone: +358 40 5011222
+
+Please send any suggestions, bug reports, success stories etc. to the
+Email address above.  Include word 'picprog' in the subject line to
+make sure your email passes my spam filtering.
+
+*/
+
+#ifndef H_EMULATOR
+#define H_EMULATOR
+
+#include <cstddef>
+#include <map>
+#include <string>
+
+/*
+
+  Software stand-in for the Multiprog board and a chip on it, for
+  running picprog without hardware.  It takes the STK500v2 frames
+  avrdoper would send over USB, runs the hw_defs.h commands in them
+  and clocks the bits into a simulated pic16 (14 bit), pic18 or
+  dspic30 target.
+
+  Selected with environment variables:
+
+  PIC_EMULATE=device		device to simulate, as in --device
+  PIC_EMULATE_LATENCY=us	delay added per USB transfer
+  PIC_EMULATE_REALTIME=1	also wait the delays the commands encode
+  PIC_EMULATE_STATE=file	keep the chip contents in file between runs
+  PIC_EMULATE_BASIC=1		firmware without the command extensions
+  PIC_EMULATE_SERIALS=a,b	programmers found, each with its own
+				chip kept in the state file plus -serial
+
+ */
+
+class emu_target;
+
+class emulator {
+public:
+  emulator (const char *device, const char *serial = 0);
+  ~emulator ();
+
+  bool ok () const { return target != 0; }
+
+  // Same conventions as avrdoper_send/recv/drain.  recv returns -1
+  // when no reply is pending, like a timeout.
+  int send (const unsigned char *buf, size_t len);
+  int recv (unsigned char *buf, size_t len);
+  void drain ();
+
+private:
+  emu_target *target;
+  std::string in, out;
+  size_t out_pos;
+
+  unsigned long latency;
+  bool realtime;
+  bool basic;
+  std::string state_file;
+
+  // Pin state of the programmer.
+  int pgc, pgd, vdd, mclr_hv;
+
+  void message (unsigned char seq, const unsigned char *body, size_t len);
+  void reply (unsigned char seq, const std::string &body);
+  int execute (const unsigned char *p, size_t len, std::string &reads, unsigned long &us);
+  int clock (int bit);
+  void write_bits (int n, unsigned long value);
+  unsigned long read_bits (int n);
+};
+
+#endif // H_EMULATOR
@@ -36,9 +36,14 @@ make sure your email passes my spam filtering.
 #include <cerrno>
 #include <csignal>
 #include <cassert>
+#include <vector>
+#include <algorithm>
 
 #include <sysexits.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 
 #include "hexfile.h"
 
@@ -66,7 +71,9 @@ using namespace std;
     and 2 for 16f87 and 16f88.
   - Word bit length.  Only 14 bit and 16 bit (18f) ones supported.
   - For 18f series, panel size.  0 means multipanel writes disabled.
-  - How many words or bytes to write at one command (18f)
+  - How many words or bytes to write at one command (18f), or the
+    number of write latches of 14 bit flash parts.  0 means single
+    word writes.
   - Program memory type.
   - Non-volatile data memory size.
   - Non-volatile data memory type.
@@ -83,8 +90,8 @@ const struct hexfile::devinf hexfile::deviceinfo [] = {
   {"pic16f83", 512, 0, 0, 1, 14, 0, 0, flash, 64, eeprom, -1},
   {"pic16f84", 1024, 0, 0, 1, 14, 0, 0, flash, 64, eeprom, -1}, // no OSCCAL
   {"pic16f84a", 1024, 0, 0, 1, 14, 0, 0, flash, 64, eeprom, 0x0560},
-  {"pic16f87", 4096, 0, 0, 2, 14, 0, 0, flash5, 256, eeprom, 0x0720},
-  {"pic16f88", 4096, 0, 0, 2, 14, 0, 0, flash5, 256, eeprom, 0x0760},
+  {"pic16f87", 4096, 0, 0, 2, 14, 0, 4, flash5, 256, eeprom, 0x0720},
+  {"pic16f88", 4096, 0, 0, 2, 14, 0, 4, flash5, 256, eeprom, 0x0760},
 
   // 16c6x family
 
@@ -123,10 +130,10 @@ const struct hexfile::devinf hexfile::deviceinfo [] = {
   {"pic16f648a", 4096, 0, 0, 1, 14, 0, 0, flash4, 128, eeprom, 0x1100}, // no OSCCAL
 
   // 16f88x family
-  {"pic16f883",  4096, 0, 0, 2, 14, 0, 0, flash4, 256, eeprom, 0x2020},
-  {"pic16f884",  4096, 0, 0, 2, 14, 0, 0, flash4, 256, eeprom, 0x2040},
-  {"pic16f886",  8192, 0, 0, 2, 14, 0, 0, flash4, 256, eeprom, 0x2060},
-  {"pic16f887",  8192, 0, 0, 2, 14, 0, 0, flash4, 256, eeprom, 0x2080},
+  {"pic16f883",  4096, 0, 0, 2, 14, 0, 8, flash4, 256, eeprom, 0x2020},
+  {"pic16f884",  4096, 0, 0, 2, 14, 0, 8, flash4, 256, eeprom, 0x2040},
+  {"pic16f886",  8192, 0, 0, 2, 14, 0, 8, flash4, 256, eeprom, 0x2060},
+  {"pic16f887",  8192, 0, 0, 2, 14, 0, 8, flash4, 256, eeprom, 0x2080},
 
   // 16ce62x family
 
@@ -206,19 +213,19 @@ const struct hexfile::devinf hexfile::deviceinfo [] = {
   {"pic16f871", 2048, 0, 0, 1, 14, 0, 0, flash, 64, eeprom, 0x0d20},
   {"pic16f872", 2048, 0, 0, 1, 14, 0, 0, flash, 64, eeprom, 0x08e0},
   {"pic16f873", 4096, 0, 0, 1, 14, 0, 0, flash, 128, eeprom, 0x0960},
-  {"pic16f873a", 4096, 0, 0, 1, 14, 0, 0, flash3, 128, eeprom, 0x0e40},
+  {"pic16f873a", 4096, 0, 0, 1, 14, 0, 8, flash3, 128, eeprom, 0x0e40},
   {"pic16f874", 4096, 0, 0, 1, 14, 0, 0, flash, 128, eeprom, 0x0920},
-  {"pic16f874a", 4096, 0, 0, 1, 14, 0, 0, flash3, 128, eeprom, 0x0e60},
+  {"pic16f874a", 4096, 0, 0, 1, 14, 0, 8, flash3, 128, eeprom, 0x0e60},
   {"pic16f876", 8192, 0, 0, 1, 14, 0, 0, flash, 256, eeprom, 0x09e0},
-  {"pic16f876a", 8192, 0, 0, 1, 14, 0, 0, flash3, 256, eeprom, 0x0e00},
+  {"pic16f876a", 8192, 0, 0, 1, 14, 0, 8, flash3, 256, eeprom, 0x0e00},
   {"pic16f877", 8192, 0, 0, 1, 14, 0, 0, flash, 256, eeprom, 0x09a0},
-  {"pic16f877a", 8192, 0, 0, 1, 14, 0, 0, flash3, 256, eeprom, 0x0e20},
+  {"pic16f877a", 8192, 0, 0, 1, 14, 0, 8, flash3, 256, eeprom, 0x0e20},
 
   {"pic16f785", 2048, 0, 0, 1, 14, 0, 0, flash4, 256, eeprom, 0x1200},
   {"pic16hv785", 2048, 0, 0, 1, 14, 0, 0, flash4, 256, eeprom, 0x1220},
 
-  {"pic16f818", 1024, 0, 0, 1, 14, 0, 0, flash5, 128, eeprom, 0x04c0},
-  {"pic16f819", 2048, 0, 0, 1, 14, 0, 0, flash5, 128, eeprom, 0x04e0},
+  {"pic16f818", 1024, 0, 0, 1, 14, 0, 4, flash5, 128, eeprom, 0x04c0},
+  {"pic16f819", 2048, 0, 0, 1, 14, 0, 4, flash5, 128, eeprom, 0x04e0},
 
   {"pic16c923", 4096, 0, 0, 1, 14, 0, 0, eprom, 0, eprom, -1},
   {"pic16c924", 4096, 0, 0, 1, 14, 0, 0, eprom, 0, eprom, -1},
@@ -406,7 +413,7 @@ pic18f8490
 
 };
 
-static int got_signal = 0;
+static volatile sig_atomic_t got_signal = 0;
 
 void
 term_handler (int a)
@@ -415,279 +422,695 @@ term_handler (int a)
   signal (a, term_handler);
 }
 
+typedef void (*sig_type)(int);
+
+// Set while hold_signals () keeps the handlers installed for several
+// threads.  Then term_signals leaves them alone.
+static bool signals_held = false;
+
+// Catches the termination signals while it is in scope, so that the
+// chip is left in order, and puts the old handlers back on every
+// return.
+
+class term_signals {
+  sig_type save_t, save_q, save_i;
+  bool installed;
+public:
+  term_signals () : installed (!signals_held) {
+    if (!installed)
+      return;
+    save_t = signal (SIGTERM, term_handler);
+    save_q = signal (SIGQUIT, term_handler);
+    save_i = signal (SIGINT, term_handler);
+  }
+  ~term_signals () {
+    if (!installed)
+      return;
+    signal (SIGTERM, save_t);
+    signal (SIGQUIT, save_q);
+    signal (SIGINT, save_i);
+  }
+};
+
+void
+hexfile::clear_signal ()
+{
+  got_signal = 0;
+}
+
+void
+hexfile::hold_signals (bool hold)
+{
+  static term_signals *held = 0;
+
+  if (hold && !held) {
+    got_signal = 0;
+    held = new term_signals;
+    signals_held = true;
+  } else if (!hold && held) {
+    signals_held = false;
+    delete held;
+    held = 0;
+  }
+}
+
+// Value of each character as a hex digit, -1 if it is not one, and
+// the two uppercase digits of each byte value.
+
+static signed char hex_value [256];
+static char hex_byte [256][2];
+
+static struct hex_value_init {
+  hex_value_init () {
+    static const char digits [] = "0123456789ABCDEF";
+    memset (hex_value, -1, sizeof (hex_value));
+    for (int i = 0; i < 10; ++i)
+      hex_value ['0' + i] = i;
+    for (int i = 0; i < 6; ++i)
+      hex_value ['a' + i] = hex_value ['A' + i] = 10 + i;
+    for (int i = 0; i < 256; ++i) {
+      hex_byte [i][0] = digits [i >> 4];
+      hex_byte [i][1] = digits [i & 15];
+    }
+  }
+} hex_value_init;
+
+// The whole input file in memory, mapped if it is a regular file and
+// read otherwise.
+
+class input_text {
+  void *map;
+  size_t map_len;
+  string copy;
+public:
+  const char *begin, *end;
+
+  input_text () : map (0), map_len (0), begin (0), end (0) {}
+  ~input_text () {
+    if (map)
+      munmap (map, map_len);
+  }
+
+  // Returns 0 or errno.
+  int open (int fd) {
+    struct stat st;
+    if (0 == fstat (fd, &st) && S_ISREG (st.st_mode) && st.st_size > 0) {
+      void *p = mmap (0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (MAP_FAILED != p) {
+	map = p;
+	map_len = st.st_size;
+	begin = (const char *) p;
+	end = begin + map_len;
+	return 0;
+      }
+    }
+    char buf [65536];
+    ssize_t n;
+    while (0 < (n = read (fd, buf, sizeof (buf))))
+      copy.append (buf, n);
+    if (n < 0)
+      return errno;
+    begin = copy.data ();
+    end = begin + copy.size ();
+    return 0;
+  }
+};
+
 int
 hexfile::load (const char *name)
 {
-  ifstream f(name);
-  char buf [128];
+  int fd = open (name, O_RDONLY);
+  input_text in;
   int line = 0;
   unsigned long addr32 = 0;
   enum formats format = unknown;
-  unsigned long addr;
-  int words, check, sum, word, i;
   int e;
 
-  if (!f) {
+  if (fd < 0) {
     e = errno;
     cerr << name << ":unable to load hexfile:" << strerror (e) << endl;
     return EX_NOINPUT;
   }
+  e = in.open (fd);
+  close (fd);
+  if (e) {
+    cerr << name << ':' << line << ':' << strerror (e) << ":" << endl;
+    return EX_IOERR;
+  }
   if (dev < 0) {
     cerr << "Internal error: no device defined" << endl;
     return EX_SOFTWARE;
   }
-  while (f.get (buf, sizeof (buf))) {
-    line++;
-    char c;
-    if (f.get (c) && '\n' != c) {
-      cerr << name << ':' << line << ":long input line" << endl;
-      return EX_DATAERR;
-    }
-    int len = strlen (buf);
-    while (len && isspace (buf [len-1]))
-      len--;
-    buf [len] = '\0';
-    if (!strcmp (buf, ":00000001FF")) // eof
-      return EX_OK;
 
-    if (15 == len
-	&& (unknown == format || ihx32 == format)
-	&& !strncmp (buf, ":02000004", 9)) {
-      // ihx32 address extension
-      format = ihx32;
-      check = strtol (buf + 13, 0, 16);
-      buf [len - 2] = '\0';
-      addr32 = strtol (buf + 9, 0, 16);
-      sum = 0x02 + 0x04 + addr32 + (addr32 >> 8);
-      if ((sum + check) & 0xff) {
-      cerr << name << ':' << line << ":checksum mismatch, checksum is 0x"
-	   << hex << setw(2) << setfill('0') << check << ", should be 0x"
-	   << setw(2) << (-sum & 0xff) << dec << endl;
-	return EX_DATAERR;
-      }
-      addr32 <<= 16;
+  // Where the memories of this device are in the hex file address
+  // space.  The last one hit is tried first.
+  const int bits = deviceinfo [dev].prog_bits;
+  const int regions [4] = { region_pgm, region_data, region_ids, region_conf };
+  image *images [4] = { &pgm, &data, &ids, &conf };
+  struct {
+    unsigned long base, len;
+    image *dst;
+    short mask;
+  } map [4];
+  int maps = 0, hit = 0;
+  if (loading_executive) {
+    map [0].base = exec_base;
+    map [0].len = executive.size ();
+    map [0].dst = &executive;
+    map [0].mask = 0xff;
+    ++maps;
+  }
+  for (int r = 0; r < 4 && !loading_executive; ++r) {
+    if (!region_size (regions [r]))
       continue;
-    }
+    map [maps].base = region_base (regions [r]);
+    map [maps].len = region_size (regions [r]);
+    map [maps].dst = images [r];
+    map [maps].mask = 16 <= bits || region_data == regions [r] ? 0xff
+      : 12 == bits ? 0xfff : 0x3fff;
+    ++maps;
+  }
 
+  // A record decoded to bytes: count, address, type, data, checksum.
+  unsigned char rec [1 + 2 + 1 + 255 * 2 + 1];
+
+  for (const char *p = in.begin; p < in.end; ) {
+    const char *eol = (const char *) memchr (p, '\n', in.end - p);
+    if (!eol)
+      eol = in.end;
+    const char *buf = p;
+    int len = eol - p;
+    p = eol + 1;
+    line++;
+    while (len && isspace ((unsigned char) buf [len - 1]))
+      len--;
     if (!len)
       continue; // empty line, I do not want to whine about it
+    if (len > 1 + 2 * (int) sizeof (rec)) {
+      cerr << name << ':' << line << ":long input line" << endl;
+      return EX_DATAERR;
+    }
 
-    i = len - 1;
-    while (i && isxdigit (buf [i]))
-      i--;
-
-    if (i || ':' != buf [0] || 1 != (len & 1) || len < 13
-	|| '0' != buf [7] || '0' != buf [8]) {
+    // Decode the hex digits and sum the bytes in one pass.
+    int bytes = (len - 1) / 2, sum = 0, bad = 0;
+    for (int k = 0; k < bytes; ++k) {
+      int hi = hex_value [(unsigned char) buf [1 + 2 * k]];
+      int lo = hex_value [(unsigned char) buf [2 + 2 * k]];
+      bad |= hi | lo;
+      rec [k] = hi << 4 | lo;
+      sum += rec [k];
+    }
+    int words = rec [0], type = rec [3];
+    if (bad < 0 || ':' != buf [0] || 1 != (len & 1) || len < 11
+	|| (0 != type && 1 != type && 4 != type)
+	|| (4 == type && (15 != len || (unknown != format && ihx32 != format)))) {
       cerr << name << ':' << line << ":invalid input line." << endl
 	   << "Are you sure this is an 8 or 16 bit intel hex file?" << endl;
       return EX_DATAERR;
     }
-    check = strtol (buf + len - 2, 0, 16);
-    buf [7] = '\0';
-    addr = strtol (buf + 3, 0, 16);
-    buf [3] = '\0';
-    words = strtol (buf + 1, 0, 16);
-    if (unknown == format) {
-      if (words * 4 + 11 == len)
-	format = ihx16;
-      else if (words * 2 + 11 == len)
-	format = ihx8m;
-      else {
-	cerr << name << ':' << line <<
-	  ":unknown input format, only ihx8m, ihx16, and ihx32 accepted" << endl;
+    if (0 == type) {
+      if (unknown == format) {
+	if (words * 4 + 11 == len)
+	  format = ihx16;
+	else if (words * 2 + 11 == len)
+	  format = ihx8m;
+	else {
+	  cerr << name << ':' << line <<
+	    ":unknown input format, only ihx8m, ihx16, and ihx32 accepted" << endl;
+	  return EX_DATAERR;
+	}
+      }
+      if (words * (ihx16 == format ? 4 : 2) + 11 != len) {
+	cerr << name << ':' << line << ":line length mismatch:"
+	     << (ihx16 == format ? "ihx16 "
+		 : (ihx8m == format ? "ihx8m " : "ihx32 "))
+	     << words * (ihx16 == format ? 4 : 2) + 11 << " != " << len << endl;
 	return EX_DATAERR;
       }
     }
-    if (words * (ihx16 == format ? 4 : 2) + 11 != len) {
-      cerr << name << ':' << line << ":line length mismatch:"
-	   << (ihx16 == format ? "ihx16 "
-	       : (ihx8m == format ? "ihx8m " : "ihx32 "))
-	   << words * (ihx16 == format ? 4 : 2) + 11 << " != " << len << endl;
+    if (sum & 0xff) {
+      int check = rec [bytes - 1];
+      cerr << name << ':' << line << ":checksum mismatch, checksum is 0x"
+	   << hex << setw(2) << setfill('0') << check << ", should be 0x"
+	   << setw(2) << (-(sum - check) & 0xff) << dec << endl;
       return EX_DATAERR;
     }
-    sum = words + addr + (addr >> 8);
-    addr += addr32;
 
-    if (14 == deviceinfo [dev].prog_bits) {
-      if (ihx16 != format) {
-	if ((words & 1) || (addr & 1)) {
-	  cerr << name << ':' << line
-	       << ":odd address or number of words." << endl;
-	  return EX_DATAERR;
-	}
-	words /= 2;
-	addr /= 2;
-      }
+    if (1 == type) { // eof
+      hash_image ();
+      return EX_OK;
+    }
+    if (4 == type) {
+      // ihx32 address extension
+      format = ihx32;
+      addr32 = (unsigned long) (rec [4] << 8 | rec [5]) << 16;
+      continue;
+    }
 
-      while (words--) {
-	buf [13 + words * 4] = '\0';
-	word = strtol (buf + 9 + words * 4, 0, 16);
-	if (ihx16 != format)
-	  word = (word & 0xff) << 8 | word >> 8;
-	sum += word + (word >> 8);
-
-	unsigned long a = addr + words;
-	if (a >= 0x2007 && a < 0x2007 + deviceinfo [dev].conf_size)
-	  conf [a - 0x2007] = word & 0x3fff;
-	else if (a >= 0x2100
-		 && a < 0x2100 + deviceinfo [dev].data_size)
-	  data [a - 0x2100] = word & 0x00ff;
-	else if (a >= 0x2000 && a < 0x2004)
-	  ids [a - 0x2000] = word & 0x3fff;
-	else if (a < deviceinfo [dev].prog_size)
-	  pgm [a] = word & 0x3fff;
-	else {
-	  cerr << name << ':' << line << ":invalid address 0x" << hex
-	       << setw(4) << setfill('0') << addr << dec
-	       << ", possibly not hex file for correct pic type?"
-	       << endl;
-	  return EX_DATAERR;
-	}
-      }
-    } else if (12 == deviceinfo [dev].prog_bits) {
+    unsigned long addr = (rec [1] << 8 | rec [2]) + addr32;
+    const unsigned char *d = rec + 4;
+    unsigned long n = words;
+    if (16 > bits) {
+      // 14 and 12 bit words, ihx16 has them high byte first.
       if (ihx16 != format) {
 	if ((words & 1) || (addr & 1)) {
 	  cerr << name << ':' << line
 	       << ":odd address or number of words." << endl;
 	  return EX_DATAERR;
 	}
-	words /= 2;
+	n /= 2;
 	addr /= 2;
       }
-
-      while (words--) {
-	buf [13 + words * 4] = '\0';
-	word = strtol (buf + 9 + words * 4, 0, 16);
-	if (ihx16 != format)
-	  word = (word & 0xff) << 8 | word >> 8;
-	sum += word + (word >> 8);
-
-	unsigned long a = addr + words;
-	if (a >= 0xfff && a < 0xfff + deviceinfo [dev].conf_size)
-	  conf [a - 0xfff] = word & 0xfff;
-	else if (a >= deviceinfo [dev].prog_size && a < deviceinfo [dev].prog_size + 5)
-	  // Includes 4 id words and a backup osccal word
-	  ids [a - deviceinfo [dev].prog_size] = word & 0xfff;
-	else if (a < deviceinfo [dev].prog_size)
-	  pgm [a] = word & 0xfff;
-	else {
-	  cerr << name << ':' << line << ":invalid address 0x" << hex
-	       << setw(4) << setfill('0') << addr << dec
-	       << ", possibly not hex file for correct pic type?"
-	       << endl;
-	  return EX_DATAERR;
-	}
-      }
-    } else {
+    } else if (ihx16 == format) {
       // pic18, dspic30
-      if (ihx16 == format) {
-	words *= 2;
-	addr *= 2;
-      }
+      n *= 2;
+      addr *= 2;
+    }
 
-      while (words--) {
-	buf [11 + words * 2] = '\0';
-	word = strtol (buf + 9 + words * 2, 0, 16);
-	sum += word;
-	unsigned long a = addr + words;
+    for (unsigned long k = 0; k < n; ++k) {
+      unsigned long a = addr + k;
+      int word;
+      if (16 <= bits) {
+	word = d [k];
 	if (ihx16 == format)
 	  a ^= 1;
+      } else if (ihx16 == format)
+	word = d [2 * k] << 8 | d [2 * k + 1];
+      else
+	word = d [2 * k] | d [2 * k + 1] << 8;
 
-	if ((flash18 == deviceinfo [dev].prog_type)
-	    && a >= 0x300000 && a < 0x300000 + deviceinfo [dev].conf_size)
-	  conf [a - 0x300000] = word;
-	else if ((flash18 == deviceinfo [dev].prog_type)
-		 && a >= 0xf00000
-		 && a < 0xf00000 + deviceinfo [dev].data_size)
-	  data [a - 0xf00000] = word;
-	else if ((flash18 == deviceinfo [dev].prog_type)
-		 && a >= 0x200000 && a < 0x200008)
-	  ids [a - 0x200000] = word;
-	else if (flash30 == deviceinfo [dev].prog_type
-	    && a >= 0xf80000 && a < 0xf80000 + deviceinfo [dev].conf_size)
-	  conf [a - 0xf80000] = word;
-	else if (flash30 == deviceinfo [dev].prog_type
-		 && a >= 0x800000 - deviceinfo [dev].data_size
-		 && a < 0x800000)
-	  data [a - (0x800000 - deviceinfo [dev].data_size)] = word;
-	else if (a < deviceinfo [dev].prog_size)
-	  pgm [a] = word;
-	else {
+      if (a - map [hit].base >= map [hit].len) {
+	for (hit = 0; hit < maps && a - map [hit].base >= map [hit].len; ++hit)
+	  ;
+	if (hit == maps) {
+	  hit = 0;
 	  cerr << name << ':' << line << ":invalid address 0x" << hex
-	       << setw(6) << setfill('0') << a << dec
+	       << setw(16 <= bits ? 6 : 4) << setfill('0')
+	       << (16 <= bits ? a : addr) << dec
 	       << ", possibly not hex file for correct pic type?"
 	       << endl;
 	  return EX_DATAERR;
 	}
       }
+      map [hit].dst->set (a - map [hit].base, word & map [hit].mask);
     }
-
-    if ((sum + check) & 0xff) {
-      cerr << name << ':' << line << ":checksum mismatch, checksum is 0x"
-	   << hex << setw(2) << setfill('0') << check << ", should be 0x"
-	   << setw(2) << (-sum & 0xff) << dec << endl;
-      return EX_DATAERR;
-    }
-  }
-  e = errno;
-  if (!f.eof ()) {
-    cerr << name << ':' << line << ':' << strerror (e) << ":" << endl;
-    return EX_IOERR;
   }
   cerr << name << ':' << line << ":warning:unexpected eof" << endl;
+  hash_image ();
   return EX_OK;
 }
 
+// Load the dspic30 programming executive from hex file name, to be
+// downloaded into executive memory when the chip is programmed after
+// an erase.
+
+int
+hexfile::load_executive (const char *name)
+{
+  if (dev < 0 || 24 != deviceinfo [dev].prog_bits) {
+    cerr << name << ":programming executive is only for dspic30 devices"
+	 << endl;
+    return EX_USAGE;
+  }
+  executive.assign (exec_len, false);
+  loading_executive = true;
+  int e = load (name);
+  loading_executive = false;
+  if (EX_OK == e && !executive.defined_end (0, exec_len)) {
+    cerr << name << ":no programming executive at 0x"
+	 << hex << exec_base << dec << endl;
+    e = EX_DATAERR;
+  }
+  if (EX_OK != e)
+    executive.assign (0, false);
+  return e;
+}
+
+// 64 bit FNV-1a hash over the defined locations of program memory,
+// data memory and configuration words.
+
 void
-hexfile::save_line (ofstream& f, const short *pgmp, unsigned long begin, unsigned long len, enum hexfile::formats format) const
+hexfile::hash_image ()
+{
+  const image *regions [3] = { &pgm, &data, &conf };
+  const unsigned long sizes [3] = { region_size (region_pgm),
+				    deviceinfo [dev].data_size,
+				    deviceinfo [dev].conf_size };
+  unsigned long long h = 14695981039346656037ULL;
+
+  for (int r = 0; r < 3; ++r) {
+    const image &img = *regions [r];
+    for (unsigned long i = img.next_defined (0, sizes [r]); i < sizes [r];
+	 i = img.next_defined (i + 1, sizes [r])) {
+      unsigned long v [2] = { (unsigned long)r << 24 | i,
+			      (unsigned long)(img [i] & 0xffff) };
+      for (int k = 0; k < 2; ++k)
+	for (int b = 0; b < 32; b += 8) {
+	  h ^= (v [k] >> b) & 0xff;
+	  h *= 1099511628211ULL;
+	}
+    }
+  }
+  image_hash = h;
+}
+
+// Spread the image hash over the user id words: 4 words of 14 bits
+// (12 bits on 12 bit parts), or 8 bytes on PIC18.  Returns the
+// number of id words, 0 if the device has none.
+
+int
+hexfile::stamp_ids (short *dst) const
 {
-  unsigned long p_begin, p_len, i;
-  int sum;
-  // f << "#saving line " << setw(6) << begin << " len " << setw(2) << len << endl;
+  int n, bits;
 
-  if (14 == deviceinfo [dev].prog_bits) {
-    if (ihx16 == format) {
-      p_begin = begin;
-      p_len = len;
-    } else {
-      p_begin = begin * 2;
-      p_len = len * 2;
+  if (24 == deviceinfo [dev].prog_bits)
+    return 0;
+  if (16 == deviceinfo [dev].prog_bits)
+    n = 8, bits = 8;
+  else
+    n = 4, bits = deviceinfo [dev].prog_bits;
+  for (int i = 0; i < n; ++i)
+    dst [i] = (image_hash >> (i * bits)) & ((1 << bits) - 1);
+  return n;
+}
+
+// Implemented bits of the PIC18 configuration bytes 0x300000-0x30000d.
+// Unimplemented bits read as 0 whatever the image holds.  Parts not
+// listed here are compared in full.
+
+static const struct {
+  const char *name;
+  unsigned char mask [14];
+} conf18_masks [] = {
+  {"pic18f242",  {0, 0x27, 0x0f, 0x0f, 0, 0x01, 0x85, 0, 0x03, 0xc0, 0x03, 0xe0, 0x03, 0x40}},
+  {"pic18f252",  {0, 0x27, 0x0f, 0x0f, 0, 0x01, 0x85, 0, 0x0f, 0xc0, 0x0f, 0xe0, 0x0f, 0x40}},
+  {"pic18f442",  {0, 0x27, 0x0f, 0x0f, 0, 0x01, 0x85, 0, 0x03, 0xc0, 0x03, 0xe0, 0x03, 0x40}},
+  {"pic18f452",  {0, 0x27, 0x0f, 0x0f, 0, 0x01, 0x85, 0, 0x0f, 0xc0, 0x0f, 0xe0, 0x0f, 0x40}},
+  {"pic18f2525", {0, 0xcf, 0x1f, 0x1f, 0, 0x87, 0xc5, 0, 0x07, 0xc0, 0x07, 0xe0, 0x07, 0x40}},
+  {"pic18f2620", {0, 0xcf, 0x1f, 0x1f, 0, 0x87, 0xc5, 0, 0x0f, 0xc0, 0x0f, 0xe0, 0x0f, 0x40}},
+  {"pic18f4525", {0, 0xcf, 0x1f, 0x1f, 0, 0x87, 0xc5, 0, 0x07, 0xc0, 0x07, 0xe0, 0x07, 0x40}},
+  {"pic18f4620", {0, 0xcf, 0x1f, 0x1f, 0, 0x87, 0xc5, 0, 0x0f, 0xc0, 0x0f, 0xe0, 0x0f, 0x40}},
+};
+
+static int
+conf18_mask (const char *name, unsigned long addr)
+{
+  for (unsigned i = 0; i < sizeof (conf18_masks) / sizeof (conf18_masks [0]); ++i)
+    if (!strcmp (conf18_masks [i].name, name))
+      return addr < 14 ? conf18_masks [i].mask [addr] : 0xff;
+  return 0xff;
+}
+
+// Read the id words and configuration words, and tell if they hold
+// the stamp and fuses of this image.  All reads go in one batch.
+
+bool
+hexfile::is_current (picport &pic)
+{
+  short stamp [8];
+  int n = stamp_ids (stamp);
+  vector<int> tickets;
+  vector<short> expected;
+  vector<int> masks;
+  unsigned long a;
+
+  if (16 == deviceinfo [dev].prog_bits) {
+    // Enable access to program memory.
+    pic.command18 (picport::instr, 0x8ea6);
+    pic.command18 (picport::instr, 0x9ca6);
+    pic.setaddress (0x200000);
+    for (a = 0; a < (unsigned long)n; ++a) {
+      tickets.push_back (pic.command18 (picport::tread_inc, 0, False));
+      expected.push_back (stamp [a]);
+      masks.push_back (0xff);
+    }
+    pic.setaddress (0x300000);
+    for (a = 0; a < deviceinfo [dev].conf_size; ++a) {
+      int ticket = pic.command18 (picport::tread_inc, 0, False);
+      if (-1 == conf [a])
+	continue;
+      tickets.push_back (ticket);
+      expected.push_back (conf [a]);
+      masks.push_back (conf18_mask (deviceinfo [dev].name, a));
+    }
+  } else if (14 == deviceinfo [dev].prog_bits) {
+    pic.command (picport::load_conf, 0);
+    for (a = 0x2000; a < 0x2007 + deviceinfo [dev].conf_size; ++a) {
+      if (a < 0x2004) {
+	tickets.push_back (pic.command (picport::data_from_prog, 0, False));
+	expected.push_back (stamp [a - 0x2000]);
+	masks.push_back (0x3fff);
+      } else if (a >= 0x2007 && -1 != conf [a - 0x2007]) {
+	tickets.push_back (pic.command (picport::data_from_prog, 0, False));
+	expected.push_back (conf [a - 0x2007]);
+	// Calibration bits are not part of the image.
+	masks.push_back (0x3fff & ~(0x2007 == a ? deviceinfo [dev].config_mask : 0));
+      }
+      pic.command (picport::inc_addr);
     }
+  } else {
+    cout << "Checking the id stamp is not supported on this device." << endl;
+    return false;
+  }
+
+  bool match = n > 0;
+  for (unsigned long i = 0; match && i < tickets.size (); ++i) {
+    int value = pic.result (tickets [i]);
+    match = -1 != value && (value & masks [i]) == (expected [i] & masks [i]);
+  }
+  pic.forget_results ();
+  return match;
+}
+
+void
+image::assign (unsigned long n, bool wide_values)
+{
+  len = n;
+  wide = wide_values;
+  bytes.assign (wide ? 0 : n, 0);
+  words.assign (wide ? n : 0, 0);
+  bits.assign ((n + 63) / 64, 0);
+}
 
-    f << ':' << setw (2) << p_len << setw (4) << (p_begin & 0xffff) << "00";
+void
+image::set (unsigned long i, int value)
+{
+  if (-1 == value) {
+    bits [i / 64] &= ~(1ULL << i % 64);
+    return;
+  }
+  if (wide)
+    words [i] = value;
+  else
+    bytes [i] = value;
+  bits [i / 64] |= 1ULL << i % 64;
+}
+
+void
+image::erase (unsigned long begin, unsigned long end)
+{
+  for (unsigned long i = begin; i < end; ++i)
+    set (i, -1);
+}
+
+void
+image::copy (const image &src, unsigned long begin, unsigned long end)
+{
+  for (unsigned long i = begin; i < end; ++i)
+    set (i, src [i]);
+}
+
+void
+image::merge (const image &src)
+{
+  for (unsigned long i = src.next_defined (0, len); i < len;
+       i = src.next_defined (i + 1, len))
+    set (i, src [i]);
+}
+
+// The scans take a bitmap word at a time.  Locations past the end
+// count as undefined.
+
+unsigned long
+image::next_defined (unsigned long i, unsigned long end) const
+{
+  unsigned long stop = min (end, len);
+  if (i >= stop)
+    return end;
+  unsigned long w = i / 64;
+  unsigned long long m = bits [w] & ~0ULL << i % 64;
+  while (!m) {
+    if (++w * 64 >= stop)
+      return end;
+    m = bits [w];
+  }
+  i = w * 64 + __builtin_ctzll (m);
+  return i < stop ? i : end;
+}
+
+unsigned long
+image::next_undefined (unsigned long i, unsigned long end) const
+{
+  unsigned long stop = min (end, len);
+  if (i >= stop)
+    return i < end ? i : end;
+  unsigned long w = i / 64;
+  unsigned long long m = ~bits [w] & ~0ULL << i % 64;
+  while (!m) {
+    if (++w * 64 >= stop)
+      return stop;
+    m = ~bits [w];
+  }
+  i = w * 64 + __builtin_ctzll (m);
+  return min (i, stop);
+}
 
-    sum = p_len + p_begin + (p_begin >> 8);
-    for (i = 0; i != len; i++) {
-      int word = pgmp [i];
-      if (ihx16 != format)
-	word = (word & 0xff) << 8 | (word & 0xff00) >> 8;
-      f << setw (4) << word;
-      sum += word + (word >> 8);
+unsigned long
+image::defined_end (unsigned long begin, unsigned long end) const
+{
+  end = min (end, len);
+  while (end > begin) {
+    unsigned long w = (end - 1) / 64;
+    unsigned long long m = bits [w];
+    if (end % 64)
+      m &= (1ULL << end % 64) - 1;
+    if (m) {
+      unsigned long i = w * 64 + 64 - __builtin_clzll (m);
+      return max (i, begin);
     }
+    end = w * 64;
+  }
+  return begin;
+}
 
-    f << setw (2) << (-sum & 0xff) << endl;
-  } else {
-    // pic18, dspic30
+// Runs of defined locations that do not hold skip, for saving without
+// erased values.  With the default skip these are the bitmap runs.
+
+static unsigned long
+run_begin (const image &p, unsigned long i, unsigned long end, int skip = -1)
+{
+  i = p.next_defined (i, end);
+  while (-1 != skip && i < end && skip == p [i])
+    i = p.next_defined (i + 1, end);
+  return i;
+}
 
-    f << ':' << setw (2) << len << setw (4) << (begin & 0xffff) << "00";
+static unsigned long
+run_end (const image &p, unsigned long i, unsigned long end, int skip = -1)
+{
+  unsigned long j = p.next_undefined (i, end);
+  if (-1 != skip)
+    for (; i < j; ++i)
+      if (skip == p [i])
+	return i;
+  return j;
+}
 
-    sum = len + begin + (begin >> 8);
-    for (i = 0; i != len; i++) {
-      int word = pgmp [i];
-      f << setw (2) << word;
-      sum += word;
+// Hex records are formatted straight into this buffer, which goes out
+// with one write () whenever it fills up.
+
+class output_text {
+  int fd;
+  size_t used;
+  int error;
+  char buf [65536];
+public:
+  // The longest record there is, with 255 data bytes.
+  enum { record_max = 1 + 2 * (4 + 255 + 1) + 1 };
+
+  explicit output_text (int f) : fd (f), used (0), error (0) {}
+
+  // Room for one more record, finished with done ().
+  char *record () {
+    if (sizeof (buf) - used < record_max)
+      flush ();
+    return buf + used;
+  }
+  void done (char *p) { used = p - buf; }
+
+  // Returns 0 or errno.
+  int flush () {
+    for (size_t off = 0; off < used && !error; ) {
+      ssize_t n = write (fd, buf + off, used - off);
+      if (n > 0)
+	off += n;
+      else if (n < 0 && EINTR != errno)
+	error = errno;
     }
+    used = 0;
+    return error;
+  }
+};
+
+// Append one byte as two hex digits and add it to the checksum.
+
+static inline char *
+put_byte (char *p, unsigned b, unsigned &sum)
+{
+  b &= 0xff;
+  sum += b;
+  p [0] = hex_byte [b][0];
+  p [1] = hex_byte [b][1];
+  return p + 2;
+}
+
+static inline char *
+put_header (char *p, unsigned count, unsigned long addr, unsigned type, unsigned &sum)
+{
+  *p++ = ':';
+  p = put_byte (p, count, sum);
+  p = put_byte (p, addr >> 8, sum);
+  p = put_byte (p, addr, sum);
+  return put_byte (p, type, sum);
+}
+
+static inline char *
+put_checksum (char *p, unsigned sum)
+{
+  p = put_byte (p, -sum, sum);
+  *p++ = '\n';
+  return p;
+}
+
+void
+hexfile::save_line (output_text &f, const image &img, unsigned long i, unsigned long begin, unsigned long len, enum hexfile::formats format) const
+{
+  char *p = f.record ();
+  unsigned sum = 0;
+  unsigned long end = i + len;
+
+  if (16 > deviceinfo [dev].prog_bits) {
+    // 14 and 12 bit words, byte addresses unless ihx16
+    if (ihx16 == format)
+      p = put_header (p, len, begin, 0, sum);
+    else
+      p = put_header (p, len * 2, begin * 2, 0, sum);
 
-    f << setw (2) << (-sum & 0xff) << endl;
+    for (; i != end; i++) {
+      int word = img [i];
+      if (ihx16 == format) {
+	p = put_byte (p, word >> 8, sum);
+	p = put_byte (p, word, sum);
+      } else {
+	p = put_byte (p, word, sum);
+	p = put_byte (p, word >> 8, sum);
+      }
+    }
+  } else {
+    // pic18, dspic30
+    p = put_header (p, len, begin, 0, sum);
+    for (; i != end; i++)
+      p = put_byte (p, img [i], sum);
   }
+  f.done (put_checksum (p, sum));
 }
 
 int
-hexfile::save_region (ofstream& f, const short *pgmp, unsigned long addr0, unsigned long len0, enum hexfile::formats format, bool skip_ones, unsigned long &addr32) const
+hexfile::save_region (output_text &f, const image &img, unsigned long addr0, unsigned long len0, enum hexfile::formats format, bool skip_ones, unsigned long &addr32) const
 {
   unsigned long len;
-  unsigned long addr = addr0;
-  short skip_value;
+  unsigned long addr;
+  int skip_value;
   unsigned long rowlen;
 
   if (!skip_ones)
@@ -699,34 +1122,32 @@ hexfile::save_region (ofstream& f, const short *pgmp, unsigned long addr0, unsig
     skip_value = 0xfff;
   else
     skip_value = 0x3fff;
+
+  // record_len counts data bytes, two of them in each 12 or 14 bit word.
   if (16 <= deviceinfo [dev].prog_bits)
-    rowlen = 16;
+    rowlen = record_len;
   else
-    rowlen = 8;
-
-  while (addr < addr0 + len0) {
-
-    // Skip undefined locations or ignored values
-    if (skip_value == pgmp [addr-addr0]
-	|| -1 == pgmp [addr-addr0]) {
-      addr++;
-      continue;
-    }
-
-    len = 1;
-    while (len < rowlen
-	   && (addr + len) % rowlen
-	   && addr + len < addr0 + len0
-	   && skip_value != pgmp [addr - addr0 + len]
-	   && -1 != pgmp [addr - addr0 + len])
-      len++;
+    rowlen = record_len / 2;
+  if (!rowlen)
+    rowlen = 1;
+
+  for (unsigned long i = 0;
+       (i = run_begin (img, i, len0, skip_value)) < len0;
+       i += len) {
+    addr = addr0 + i;
+
+    // Up to the end of the row or of the run of defined locations
+    len = min (rowlen - addr % rowlen, len0 - i);
+    len = run_end (img, i + 1, i + len, skip_value) - i;
     if (ihx32 == format) {
       if (addr32 != (addr & 0xffff0000)) {
 	addr32 = addr & 0xffff0000;
-	int sum = 0x02 + 0x04 + (addr32 >> 16) + (addr32 >> 24);
-	f << ":02000004"
-	  << setw(4) << (addr32 >> 16)
-	  << setw(2) << (-sum & 0xff) << endl;
+	char *p = f.record ();
+	unsigned sum = 0;
+	p = put_header (p, 2, 0, 4, sum);
+	p = put_byte (p, addr32 >> 24, sum);
+	p = put_byte (p, addr32 >> 16, sum);
+	f.done (put_checksum (p, sum));
       }
     } else {
       // not ihx32
@@ -735,8 +1156,7 @@ hexfile::save_region (ofstream& f, const short *pgmp, unsigned long addr0, unsig
 	return EX_USAGE;
       }
     }
-    save_line (f, pgmp + (addr - addr0), addr, len, format);
-    addr += len;
+    save_line (f, img, i, addr, len, format);
   }
   return EX_OK;
 }
@@ -744,7 +1164,7 @@ hexfile::save_region (ofstream& f, const short *pgmp, unsigned long addr0, unsig
 int
 hexfile::save (const char *name, enum hexfile::formats format, bool skip_ones) const
 {
-  ofstream f (name);
+  int fd = open (name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
   int e;
   unsigned long addr32 = 1; // flag that addr32 line must be output on first line
 
@@ -755,57 +1175,75 @@ hexfile::save (const char *name, enum hexfile::formats format, bool skip_ones) c
       format = ihx16;
   }
 
-  if (!f) {
+  if (fd < 0) {
     e = errno;
     cerr << name << ":unable to open save file:" << strerror (e) << endl;
     return EX_IOERR;
   }
-  f << hex << setfill ('0') << setiosflags (ios::uppercase);
+  output_text f (fd);
+
+  e = save_region (f, pgm, 0, region_size (region_pgm), format, skip_ones, addr32);
+  if (EX_OK == e) {
+    if (24 == deviceinfo [dev].prog_bits)
+      // No ids for dspic30
+      e = EX_OK;
+    else if (16 == deviceinfo [dev].prog_bits)
+      e = save_region (f, ids, 0x200000, 8, format, skip_ones, addr32);
+    else if (12 == deviceinfo [dev].prog_bits)
+      // Save the backup osccal word to the ids too!
+      e = save_region (f, ids, deviceinfo [dev].prog_size, 5, format, skip_ones, addr32);
+    else
+      e = save_region (f, ids, 0x2000, 4, format, skip_ones, addr32);
+  }
+  if (EX_OK == e) {
+    if (24 == deviceinfo [dev].prog_bits)
+      e = save_region (f, conf, 0xf80000, deviceinfo [dev].conf_size, format, skip_ones, addr32);
+    else if (16 == deviceinfo [dev].prog_bits)
+      e = save_region (f, conf, 0x300000, deviceinfo [dev].conf_size, format, skip_ones, addr32);
+    else if (12 == deviceinfo [dev].prog_bits)
+      e = save_region (f, conf, 0xfff, deviceinfo [dev].conf_size, format, skip_ones, addr32);
+    else
+      e = save_region (f, conf, 0x2007, deviceinfo [dev].conf_size, format, skip_ones, addr32);
+  }
+  if (EX_OK == e) {
+    if (24 == deviceinfo [dev].prog_bits)
+      e = save_region (f, data, 0x800000 - deviceinfo [dev].data_size, deviceinfo [dev].data_size, format, skip_ones, addr32);
+    else if (16 == deviceinfo [dev].prog_bits)
+      e = save_region (f, data, 0xf00000, deviceinfo [dev].data_size, format, skip_ones, addr32);
+    else if (12 == deviceinfo [dev].prog_bits)
+      e = EX_OK; // No 12 bit data areas implemented
+    else
+      e = save_region (f, data, 0x2100, deviceinfo [dev].data_size, format, skip_ones, addr32);
+  }
+  if (EX_OK == e) {
+    char *p = f.record ();
+    memcpy (p, ":00000001FF\n", 12);
+    f.done (p + 12);
+  }
 
-  e = save_region (f, pgm, 0, deviceinfo [dev].prog_size, format, skip_ones, addr32);
-  if (EX_OK != e)
-    return e;
-  if (24 == deviceinfo [dev].prog_bits)
-    // No ids for dspic30
-    e = EX_OK;
-  else if (16 == deviceinfo [dev].prog_bits)
-    e = save_region (f, ids, 0x200000, 8, format, skip_ones, addr32);
-  else if (12 == deviceinfo [dev].prog_bits)
-    // Save the backup osccal word to the ids too!
-    e = save_region (f, ids, deviceinfo [dev].prog_size, 5, format, skip_ones, addr32);
-  else
-    e = save_region (f, ids, 0x2000, 4, format, skip_ones, addr32);
-  if (EX_OK != e)
-    return e;
-  if (24 == deviceinfo [dev].prog_bits)
-    e = save_region (f, conf, 0xf80000, deviceinfo [dev].conf_size, format, skip_ones, addr32);
-  else if (16 == deviceinfo [dev].prog_bits)
-    e = save_region (f, conf, 0x300000, deviceinfo [dev].conf_size, format, skip_ones, addr32);
-  else if (12 == deviceinfo [dev].prog_bits)
-    e = save_region (f, conf, 0xfff, deviceinfo [dev].conf_size, format, skip_ones, addr32);
-  else
-    e = save_region (f, conf, 0x2007, deviceinfo [dev].conf_size, format, skip_ones, addr32);
-  if (EX_OK != e)
-    return e;
-  if (24 == deviceinfo [dev].prog_bits)
-    e = save_region (f, data, 0x800000 - deviceinfo [dev].data_size, deviceinfo [dev].data_size, format, skip_ones, addr32);
-  else if (16 == deviceinfo [dev].prog_bits)
-    e = save_region (f, data, 0xf00000, deviceinfo [dev].data_size, format, skip_ones, addr32);
-  else if (12 == deviceinfo [dev].prog_bits)
-    e = EX_OK; // No 12 bit data areas implemented
-  else
-    e = save_region (f, data, 0x2100, deviceinfo [dev].data_size, format, skip_ones, addr32);
-  if (EX_OK != e)
-    return e;
-  f << ":00000001FF" << endl;
-  return EX_OK;
+  int err = f.flush ();
+  if (close (fd) && !err)
+    err = errno;
+  if (EX_OK == e && err) {
+    cerr << name << ":unable to write save file:" << strerror (err) << endl;
+    e = EX_IOERR;
+  }
+  return e;
 }
 
 // Verify 8 bytes at the given address in all panels
-// available in the device.
+// available in the device.  The bytes of addr are at first in img.  All reads of the block are queued first
+// and compared only after the programmer has answered, so the block
+// costs a few packed frames instead of one round trip per byte.
 bool
-hexfile::verify18 (picport& pic, const short *pgmp, unsigned long addr, unsigned long len, unsigned long panel_size, bool verbose) const
+hexfile::verify18 (picport& pic, const image &img, unsigned long first, unsigned long addr, unsigned long len, unsigned long panel_size, bool verbose) const
 {
+  struct span {
+    unsigned long panel, first, last;
+    int ticket;
+  };
+  vector<span> spans;
+
   // If we are not handling program memory, below 0x200000, we obviously
   // loop only once.  Id and config memory must be written in single
   // panel mode.
@@ -814,34 +1252,46 @@ hexfile::verify18 (picport& pic, const short *pgmp, unsigned long addr, unsigned
 	 panel + addr < deviceinfo [dev].prog_size
 	 : 0 == panel;
        panel += panel_size) {
-    unsigned long i, j;
-    for (i = 0; i < len; ++i)
-      if (-1 != pgmp [panel + i])
-	break;
+    unsigned long b = first + panel;
+    unsigned long i = img.next_defined (b, b + len) - b;
     if (len == i)
       continue;
 
     // Find the last byte to verify
-    for (j = len - 1; -1 == pgmp [panel + j]; --j)
-      ;
+    unsigned long j = img.defined_end (b, b + len) - b - 1;
+    span s = { panel, i, j, -1 };
     pic.setaddress (panel + addr + i);
     for (; i <= j; ++i) {
-      int value = pic.command18 (picport::tread_inc);
-      if (value != pgmp [panel + i]
-	  && -1 != pgmp [panel + i]) {
-	if (verbose) {
-	  cerr << pic.port() << ":" << "0x" << hex << setfill('0') << setw(6)
+      int ticket = pic.command18 (picport::tread_inc, 0, False);
+      if (-1 == s.ticket)
+	s.ticket = ticket;
+    }
+    spans.push_back (s);
+  } // for panels
+
+  for (unsigned long n = 0; n < spans.size (); ++n) {
+    unsigned long panel = spans [n].panel;
+    for (unsigned long i = spans [n].first; i <= spans [n].last; ++i) {
+      int want = img [first + panel + i];
+      if (-1 == want)
+	continue;
+      int value = pic.result (spans [n].ticket + (i - spans [n].first));
+      if (value != want) {
+	if (verbose) {
+	  cerr << pic.port() << ":" << "0x" << hex << setfill('0') << setw(6)
 	       << panel + addr + i
 	       << ": panel " << (panel >> 13)
 	       << ", block " << setw(4) << addr
 	       << ", byte " << i << ": verification failed, read 0x"
 	       << setw(2) << value << ", should be 0x"
-	       << setw(2) << pgmp [panel + i] << dec << endl;
+	       << setw(2) << want << dec << endl;
 	}
+	pic.forget_results ();
 	return false;
       }
     }
-  } // for panels
+  }
+  pic.forget_results ();
   return true;
 }
 
@@ -849,10 +1299,30 @@ hexfile::verify18 (picport& pic, const short *pgmp, unsigned long addr, unsigned
 // assumed that correct mode is set before calling this method.  Also
 // address parameter must be < panel size, ie. 8kB for original 18f parts.
 // Call with panel_size == prog_size if multipanel writes not used.
+// The bytes of addr are at first in img.
 int
-hexfile::program18 (picport& pic, const short *pgmp, unsigned long addr, unsigned long len, unsigned long panel_size) const
+hexfile::program18 (picport& pic, const image &img, unsigned long first, unsigned long addr, unsigned long len, unsigned long panel_size) const
 {
-  if (verify18 (pic, pgmp, addr, len, panel_size, false))
+  // If the erase or the cache tells what the block holds, there is
+  // nothing to check first, and only changed blocks are written.
+  bool all_known = true, changed = false;
+  for (unsigned long panel = 0;
+       addr < 0x200000 ?
+	 panel + addr < deviceinfo [dev].prog_size
+	 : 0 == panel;
+       panel += panel_size)
+    for (unsigned long i = 0; i < len; ++i) {
+      int want = img [first + panel + i];
+      if (-1 == want)
+	continue;
+      int value = known_value (panel + addr + i, false);
+      if (-1 == value)
+	all_known = false;
+      else if (value != want)
+	changed = true;
+    }
+  if (all_known ? !changed
+      : verify18 (pic, img, first, addr, len, panel_size, false))
     return 0;
 
   unsigned long count = 0;
@@ -876,13 +1346,13 @@ hexfile::program18 (picport& pic, const short *pgmp, unsigned long addr, unsigne
 	// Last bytes of last write need programming command
 	comm = picport::twrite_prog;
 
-      // For locations that do not need programming, pgm[] has value
-      // -1.  With &0xff operation, that becomes 0xff.  This is fine,
-      // as it is the erased state of flash memory, and no bits are
-      // programmed to 0 state.
+      // For locations that do not need programming, the image has
+      // value -1.  With &0xff operation, that becomes 0xff.  This is
+      // fine, as it is the erased state of flash memory, and no bits
+      // are programmed to 0 state.
       pic.command18 (comm,
-		     (0xff & pgmp [panel + i])
-		     | ((0xff & pgmp [panel + i + 1]) << 8));
+		     (0xff & img [first + panel + i])
+		     | ((0xff & img [first + panel + i + 1]) << 8));
       count += 2;
     } // for bytes (words)
   } // for panels
@@ -890,7 +1360,7 @@ hexfile::program18 (picport& pic, const short *pgmp, unsigned long addr, unsigne
   // command with programming delay.
   pic.command18 (picport::nop_prog, 0);
 
-  if (!verify18 (pic, pgmp, addr, len, panel_size, true))
+  if (!verify18 (pic, img, first, addr, len, panel_size, true))
     return -EX_IOERR;
   return count;
 }
@@ -910,9 +1380,14 @@ hexfile::program_location (picport& pic, unsigned long addr, short word, bool is
 {
   int retval;
 
-
-  if (-1 == word
-      || (retval = pic.command (isdata ? picport::data_from_data	: picport::data_from_prog ,0, True)) == word)
+  if (-1 == word)
+    return NOT_PROGRAMMED;
+  if (-1 != (retval = known_value (addr, isdata))) {
+    // No need to read what the erase or the last programming left
+    // there.  A preserved word of a plan is written anyway.
+    if (retval == word && (isdata || !pic.preserving (addr)))
+      return NOT_PROGRAMMED;
+  } else if ((retval = pic.command (isdata ? picport::data_from_data	: picport::data_from_prog ,0, True)) == word)
     return NOT_PROGRAMMED;
 
   if (-1 == retval) {
@@ -923,6 +1398,240 @@ hexfile::program_location (picport& pic, unsigned long addr, short word, bool is
   pic.command (isdata ? picport::data_for_data : picport::data_for_prog,
 	       word);
 
+  if (EX_OK != (retval = program_cycle (pic, addr)))
+    return retval;
+
+  // verify, but do not verify fuses if Code Protect bit is cleared!
+
+  int read_val = pic.command (isdata ? picport::data_from_data : picport::data_from_prog,0, True);
+  if (word != read_val)
+  if (word != (read_val = pic.command (isdata ? picport::data_from_data : picport::data_from_prog,0, True) )) {
+    cerr << pic.port() << ':' << hex << setw (4) << setfill ('0') << addr
+	 << ": programmed=" << setw (4) << setfill ('0') << word
+	 << ", read=" << setw (4) << setfill ('0') << read_val
+	 << dec << ":unable to verify pic while programming." << endl;
+    if (pic.address () != 0x2007) {
+      cerr << "Is code protection enabled, or does the chip need to be " << endl
+	   << "erased completely before programming?" << endl
+	   << "Use --erase option to disable code protection." << endl;
+      return EX_IOERR;
+    } else {
+      cerr << "This is the configuration word, which often has hardwired" << endl
+	   << "bits and therefore does not verify.  It also has the code" << endl
+	   << "protection bits, and if they were programmed to enabled" << endl
+	   << "state, verification fails.  Therefore this error is ignored." << endl;
+    }
+  }
+  return EX_OK;
+}
+
+// Memory region of a device address.
+
+int
+hexfile::region_of (unsigned long addr, bool isdata) const
+{
+  if (isdata)
+    return region_data;
+  if (16 <= deviceinfo [dev].prog_bits)
+    return addr < 0x200000 ? region_pgm
+      : addr < 0x300000 ? region_ids : region_conf;
+  if (addr < deviceinfo [dev].prog_size)
+    return region_pgm;
+  if (12 == deviceinfo [dev].prog_bits)
+    return addr < deviceinfo [dev].prog_size + 5 ? region_ids : region_conf;
+  return addr < 0x2004 ? region_ids : region_conf;
+}
+
+// Value of an erased location.
+
+int
+hexfile::erased_value (bool isdata) const
+{
+  if (isdata || 16 <= deviceinfo [dev].prog_bits)
+    return 0xff;
+  if (12 == deviceinfo [dev].prog_bits)
+    return 0xfff;
+  return 0x3fff;
+}
+
+// Image value of a device address, -1 if it is undefined or there is
+// no such location.
+
+int
+hexfile::location (unsigned long addr, bool isdata) const
+{
+  if (16 <= deviceinfo [dev].prog_bits) {
+    if (isdata)
+      return addr - 0xf00000 < deviceinfo [dev].data_size
+	? data [addr - 0xf00000] : -1;
+    if (addr < deviceinfo [dev].prog_size)
+      return pgm [addr];
+    if (addr - 0x200000 < 8)
+      return ids [addr - 0x200000];
+    if (addr - 0x300000 < deviceinfo [dev].conf_size)
+      return conf [addr - 0x300000];
+    return -1;
+  }
+  if (isdata)
+    return addr - 0x2100 < deviceinfo [dev].data_size
+      ? data [addr - 0x2100] : -1;
+  if (addr < deviceinfo [dev].prog_size)
+    return pgm [addr];
+  if (12 == deviceinfo [dev].prog_bits) {
+    if (addr - deviceinfo [dev].prog_size < 5)
+      return ids [addr - deviceinfo [dev].prog_size];
+    if (addr - 0xfff < deviceinfo [dev].conf_size)
+      return conf [addr - 0xfff];
+    return -1;
+  }
+  if (addr - 0x2000 < 4)
+    return ids [addr - 0x2000];
+  if (addr - 0x2007 < deviceinfo [dev].conf_size)
+    return conf [addr - 0x2007];
+  return -1;
+}
+
+// What the location is known to hold without reading it, after an
+// erase or from a trusted cache.  -1 if unknown.  The cache is not
+// trusted for data memory, which the firmware may have rewritten.
+
+int
+hexfile::known_value (unsigned long addr, bool isdata) const
+{
+  if (erased & region_of (addr, isdata))
+    return erased_value (isdata);
+  if (known && !isdata)
+    return known->location (addr, isdata);
+  return -1;
+}
+
+// Device address of the first location of a region, and the number
+// of locations in it.
+
+unsigned long
+hexfile::region_base (int region) const
+{
+  int bits = deviceinfo [dev].prog_bits;
+
+  switch (region) {
+  case region_data:
+    return 24 == bits ? 0x800000 - deviceinfo [dev].data_size
+      : 16 == bits ? 0xf00000 : 0x2100;
+  case region_ids:
+    return 24 == bits ? 0 : 16 == bits ? 0x200000
+      : 12 == bits ? deviceinfo [dev].prog_size : 0x2000;
+  case region_conf:
+    return 24 == bits ? 0xf80000 : 16 == bits ? 0x300000
+      : 12 == bits ? 0xfff : 0x2007;
+  }
+  return 0;
+}
+
+unsigned long
+hexfile::region_size (int region) const
+{
+  int bits = deviceinfo [dev].prog_bits;
+
+  switch (region) {
+  case region_pgm:
+    // dspic30 instructions take three bytes of prog_size, and four
+    // in the hex file with the phantom byte.
+    return 24 == bits ? deviceinfo [dev].prog_size / 3 * 4
+      : deviceinfo [dev].prog_size;
+  case region_data:
+    // No 12 bit data areas implemented
+    return 12 == bits ? 0 : deviceinfo [dev].data_size;
+  case region_ids:
+    // 12f508/12f509 backup osccal is included in ids
+    return 24 == bits ? 0 : 16 == bits ? 8 : 12 == bits ? 5 : 4;
+  case region_conf:
+    return deviceinfo [dev].conf_size;
+  }
+  return 0;
+}
+
+// Indexes [first, end) into the image array of a region that the
+// selection covers.  False if it covers none.
+
+bool
+hexfile::span (int region, unsigned long &first, unsigned long &end) const
+{
+  unsigned long base = region_base (region), len = region_size (region);
+
+  if (!(selected & region) || !len
+      || range_hi < base || range_lo >= base + len)
+    return false;
+  first = range_lo > base ? range_lo - base : 0;
+  end = range_hi - base < len ? range_hi - base + 1 : len;
+  return true;
+}
+
+// Drop the locations outside the selection from the image, so they
+// are neither programmed nor verified.  The whole image is kept in
+// dropped for unrestrict_image ().
+
+void
+hexfile::restrict_image ()
+{
+  const int regions [4] = { region_pgm, region_data, region_ids, region_conf };
+  image *images [4] = { &pgm, &data, &ids, &conf };
+
+  for (int r = 0; r < 4; ++r) {
+    unsigned long first, end, len = region_size (regions [r]);
+    if (!span (regions [r], first, end))
+      first = end = len;
+    dropped [r] = *images [r];
+    images [r]->erase (0, first);
+    images [r]->erase (end, len);
+  }
+  // The id stamp hashes only what is programmed.
+  hash_image ();
+}
+
+// Put back what restrict_image () dropped, so that the image can still
+// be saved whole.
+
+void
+hexfile::unrestrict_image ()
+{
+  const int regions [4] = { region_pgm, region_data, region_ids, region_conf };
+  image *images [4] = { &pgm, &data, &ids, &conf };
+
+  for (int r = 0; r < 4; ++r) {
+    unsigned long first, end, len = region_size (regions [r]);
+    if (!span (regions [r], first, end))
+      first = end = len;
+    images [r]->copy (dropped [r], 0, first);
+    images [r]->copy (dropped [r], end, len);
+    dropped [r] = image ();
+  }
+  hash_image ();
+}
+
+// Step a 14 or 12 bit part forward to addr with queued increment
+// address commands.  14 bit configuration memory is entered with
+// load configuration, and going back needs a reset.
+
+void
+hexfile::seek (picport &pic, unsigned long addr)
+{
+  int bits = deviceinfo [dev].prog_bits;
+
+  if (14 == bits && addr >= 0x2000) {
+    if (pic.address () < 0x2000 || pic.address () > addr)
+      pic.command (picport::load_conf, 0);
+  } else if (pic.address () > addr)
+    pic.reset (12 == bits ? 0xfff : 0);
+  while (pic.address () != addr)
+    pic.command (picport::inc_addr, 12 == bits ? addr_max : 0, False);
+}
+
+// Programming cycle for the word just loaded with data_for_prog or
+// data_for_data.
+
+int
+hexfile::program_cycle (picport& pic, unsigned long addr) const
+{
   switch (deviceinfo [dev].prog_type) {
   case flash2: // pic16f77
     pic.command (picport::beg_prog);
@@ -964,42 +1673,173 @@ hexfile::program_location (picport& pic, unsigned long addr, short word, bool is
 	 << int(deviceinfo [dev].prog_type) << endl;
     return EX_SOFTWARE;
   }
+  return EX_OK;
+}
 
-  // verify, but do not verify fuses if Code Protect bit is cleared!
+// Bulk programming of 14 bit parts after the chip has been erased.
+// Nothing is read back, so the whole region streams to the
+// programmer in full frames.  Words known to hold their value already,
+// in an erased region, are passed with inc_addr only, except preserved
+// words while a plan is recorded: the plan patches in the value of the
+// chip it runs on.  Program memory of parts with write latches is
+// written a row at a time.  Returns the count of locations written or
+// a negative exit code.
 
-  int read_val = pic.command (isdata ? picport::data_from_data : picport::data_from_prog,0, True);
-  if (word != read_val)
-  if (word != (read_val = pic.command (isdata ? picport::data_from_data : picport::data_from_prog,0, True) )) {
-    cerr << pic.port() << ':' << hex << setw (4) << setfill ('0') << addr
-	 << ": programmed=" << setw (4) << setfill ('0') << word
-	 << ", read=" << setw (4) << setfill ('0') << read_val
-	 << dec << ":unable to verify pic while programming." << endl;
-    if (pic.address () != 0x2007) {
-      cerr << "Is code protection enabled, or does the chip need to be " << endl
-	   << "erased completely before programming?" << endl
-	   << "Use --erase option to disable code protection." << endl;
-      return EX_IOERR;
-    } else {
-      cerr << "This is the configuration word, which often has hardwired" << endl
-	   << "bits and therefore does not verify.  It also has the code" << endl
-	   << "protection bits, and if they were programmed to enabled" << endl
-	   << "state, verification fails.  Therefore this error is ignored." << endl;
+int
+hexfile::program_bulk (picport& pic, const image &img, unsigned long addr, unsigned long len, bool isdata) const
+{
+  int retval, count = 0;
+  unsigned long row = isdata ? 0 : deviceinfo [dev].write_size;
+
+  if (row > 1) {
+    // Load all write latches of the row, unused ones with the erased
+    // value, and program the row with one cycle at its last word.
+    for (unsigned long i = 0; i < len; i += row) {
+      unsigned long k;
+      for (k = 0; k < row && i + k < len; ++k)
+	if (-1 != img [i + k]
+	    && (known_value (addr + i + k, false) != img [i + k]
+		|| pic.preserving (addr + i + k)))
+	  break;
+      if (k == row || i + k >= len) {
+	for (k = 0; k < row && i + k < len; ++k)
+	  pic.command (picport::inc_addr);
+	continue;
+      }
+      for (k = 0; k < row && i + k < len; ++k) {
+	if (k)
+	  pic.command (picport::inc_addr);
+	pic.command (picport::data_for_prog,
+		     -1 == img [i + k] ? 0x3fff : img [i + k]);
+	if (-1 != img [i + k] && known_value (addr + i + k, false) != img [i + k])
+	  ++count;
+      }
+      if (EX_OK != (retval = program_cycle (pic, addr + i + k - 1)))
+	return -retval;
+      pic.command (picport::inc_addr);
+      if (got_signal) {
+	cerr << "Exiting." << endl;
+	return -EX_UNAVAILABLE;
+      }
     }
+    return count;
   }
-  return EX_OK;
+
+  for (unsigned long i = 0; i < len; ++i) {
+    if (-1 != img [i] && (known_value (addr + i, isdata) != img [i]
+			  || (!isdata && pic.preserving (addr + i)))) {
+      pic.command (isdata ? picport::data_for_data : picport::data_for_prog,
+		   img [i]);
+      if (EX_OK != (retval = program_cycle (pic, addr + i)))
+	return -retval;
+      ++count;
+    }
+    pic.command (picport::inc_addr);
+    if (got_signal) {
+      cerr << "Exiting." << endl;
+      return -EX_UNAVAILABLE;
+    }
+  }
+  return count;
 }
 
-typedef void (*sig_type)(int);
+// Verify pass after bulk programming.  All reads are queued and the
+// image is read back in packed frames.  Words known to be in erased
+// state are not read.  Returns the number of
+// mismatching locations, or -1 if the programmer did not answer.
+
+int
+hexfile::verify_bulk (picport& pic, const image &img, unsigned long addr, unsigned long len, bool isdata) const
+{
+  int errors = 0;
+  vector<int> tickets (len, -1);
+
+  for (unsigned long i = 0; i < len; ++i) {
+    if (-1 != img [i] && known_value (addr + i, isdata) != img [i])
+      tickets [i] = pic.command (isdata ? picport::data_from_data
+				 : picport::data_from_prog, 0, False);
+    pic.command (picport::inc_addr);
+  }
+  for (unsigned long i = 0; i < len; ++i) {
+    if (-1 == tickets [i])
+      continue;
+    int value = pic.result (tickets [i]);
+    if (-1 == value) {
+      cerr << pic.port() << ':' << hex << setfill ('0') << setw (4) << addr + i
+	   << dec << ":unable to read pic while verifying" << endl;
+      pic.forget_results ();
+      return -1;
+    }
+    if (isdata)
+      value &= 0xff;
+    if (value != img [i]) {
+      cerr << pic.port() << ':' << hex << setw (4) << setfill ('0') << addr + i
+	   << ": programmed=" << setw (4) << setfill ('0') << img [i]
+	   << ", read=" << setw (4) << setfill ('0') << value
+	   << dec << ":verification failed." << endl;
+      ++errors;
+    }
+  }
+  pic.forget_results ();
+  return errors;
+}
+
+// dspic30 instruction sequences sent with SIX.
+
+// Leave the reset vector before the first instruction that runs.
+static void
+exit_reset_vector30 (picport &pic)
+{
+  pic.command30 (picport::SIX, 0); // NOP
+  pic.command30 (picport::SIX, 0); // NOP
+  pic.command30 (picport::SIX, 0x040100); // GOTO 0x100
+  pic.command30 (picport::SIX, 0); // NOP
+}
+
+static inline void
+mov30 (picport &pic, unsigned long lit, int w)
+{
+  pic.command30 (picport::SIX, 0x200000 | (lit & 0xffff) << 4 | w); // MOV #lit, Ww
+}
+
+static void
+nvmcon30 (picport &pic, int value)
+{
+  mov30 (pic, value, 10);
+  pic.command30 (picport::SIX, 0x883B0A); // MOV W10, NVMCON
+}
+
+// Table page of the program space address a.
+static void
+tblpag30 (picport &pic, unsigned long a)
+{
+  mov30 (pic, a >> 16, 0);
+  pic.command30 (picport::SIX, 0x880190); // MOV W0, TBLPAG
+}
+
+// Unlock and run the operation set in NVMCON, and wait for it.
+static void
+nvm_start30 (picport &pic)
+{
+  pic.command30 (picport::SIX, 0x200558); // MOV #0x55, W8
+  pic.command30 (picport::SIX, 0x883B38); // MOV W8, NVMKEY
+  pic.command30 (picport::SIX, 0x200AA9); // MOV #0xAA, W9
+  pic.command30 (picport::SIX, 0x883B39); // MOV W9, NVMKEY
+  pic.command30 (picport::SIX, 0xA8E761); // BSET NVMCON, #WR
+  pic.command30 (picport::SIX, 0); // NOP
+  pic.command30 (picport::SIX, 0); // NOP
+  pic.delay (2000);
+  pic.command30 (picport::SIX, 0xA9E761); // BCLR NVMCON, #WR
+  pic.command30 (picport::SIX, 0); // NOP
+  pic.command30 (picport::SIX, 0); // NOP
+}
 
 void hexfile::reset_code_protection (picport& pic)
 {
   switch (deviceinfo [dev].prog_type) {
   case flash30: // dspic30f
     // Step 1
-    pic.command30 (picport::SIX, 0); // NOP
-    pic.command30 (picport::SIX, 0); // NOP
-    pic.command30 (picport::SIX, 0x040100); // GOTO 0x100
-    pic.command30 (picport::SIX, 0); // NOP
+    exit_reset_vector30 (pic);
     // Steps 2-7 only concern dspic30f601[0-4] mask 0 versions
     // What does that mean??
     if (0) {
@@ -1045,6 +1885,7 @@ void hexfile::reset_code_protection (picport& pic)
     pic.command30 (picport::SIX, 0xA9E761); // BCLR NVMCON, #WR
     pic.command30 (picport::SIX, 0); // NOP
     pic.command30 (picport::SIX, 0); // NOP
+    erased = region_pgm | region_data;
     break;
   case flash18: // pic18f
     // new series has different erase algorithm
@@ -1055,6 +1896,7 @@ void hexfile::reset_code_protection (picport& pic)
       pic.command18 (picport::twrite, 0x8787); // Write 8787 to 3c0004h
       pic.command18 (picport::instr, 0); // NOP
       pic.command18 (picport::nop_erase, 0); // NOP, delay
+      erased = region_pgm | region_data | region_ids;
       break;
     }
     // fallthrough for original pic18f series
@@ -1063,6 +1905,8 @@ void hexfile::reset_code_protection (picport& pic)
     pic.command18 (picport::twrite, 0x0080); // Write 80h to 3c0004h
     pic.command18 (picport::instr, 0); // NOP
     pic.command18 (picport::nop_erase, 0); // NOP, delay
+    if (flash18 == deviceinfo [dev].prog_type)
+      erased = region_pgm | region_data | region_ids;
     break;
   case flash2: // pic16f77, pic12f
     // pic12f508, pic12f509 do not have load_conf, but full erase
@@ -1073,17 +1917,20 @@ void hexfile::reset_code_protection (picport& pic)
     } else
       pic.command (picport::load_conf, 0x3fff);
     pic.command (picport::erase_prog);
+    erased = region_pgm;
     break;
   case flash3: // pic16f876a
   case flash5: // pic16f88
     pic.command (picport::load_conf, 0x3fff);
     pic.command (picport::chip_erase);
+    erased = region_pgm | region_data | region_ids;
     break;
   case flash4: // pic16f628a
     pic.command (picport::load_conf, 0x3fff);
     pic.command (picport::erase_prog);
     pic.delay (50000);
     pic.command (picport::erase_data);
+    erased = region_pgm | region_data;
     break;
   default: // eeprom, flash
     pic.command (picport::load_conf, 0x3fff);
@@ -1102,21 +1949,40 @@ void hexfile::reset_code_protection (picport& pic)
     pic.command (picport::data_for_data, 0x3fff);
     pic.command (picport::erase_data);
     pic.command (picport::beg_prog);
+    // Not sure the above always works, so data memory is still read.
+    erased = region_pgm;
   }
 
   pic.delay (50000);
   pic.reset (deviceinfo [dev].prog_bits == 12 ? 0xfff : 0);
 }
 
+// Only what the selection covers is programmed or verified.
+
 int
 hexfile::program (picport &pic, bool reset, bool nopreserve)
+{
+  restrict_image ();
+  int retval = program_selected (pic, reset, nopreserve);
+  unrestrict_image ();
+  return retval;
+}
+
+int
+hexfile::verify (picport &pic, bool nopreserve)
+{
+  restrict_image ();
+  int retval = verify_selected (pic, nopreserve);
+  unrestrict_image ();
+  return retval;
+}
+
+int
+hexfile::program_selected (picport &pic, bool reset, bool nopreserve)
 {
   int retval;
 
-  sig_type save_t, save_q, save_i;
-  save_t = signal (SIGTERM, term_handler);
-  save_q = signal (SIGQUIT, term_handler);
-  save_i = signal (SIGINT, term_handler);
+  term_signals catcher;
 
   cout << "Device " << deviceinfo [dev].name
        << ", program memory: " << deviceinfo [dev].prog_size
@@ -1128,6 +1994,27 @@ hexfile::program (picport &pic, bool reset, bool nopreserve)
     return EX_USAGE;
   }
 
+  if (skip_current && is_current (pic)) {
+    cout << "Id words and fuses match the image, device not programmed."
+	 << endl;
+    return EX_OK;
+  }
+  if (stamp_on && (selected & region_ids)) {
+    short stamp [8];
+    int n = stamp_ids (stamp);
+    bool overridden = false;
+    for (int i = 0; i < n; ++i) {
+      if (-1 != ids [i] && stamp [i] != ids [i])
+	overridden = true;
+      ids.set (i, stamp [i]);
+    }
+    cout << "Id words stamped with image hash 0x"
+	 << hex << setfill('0') << setw(16) << image_hash << dec;
+    if (overridden)
+      cout << " (values in input file ignored)";
+    cout << endl;
+  }
+
   // As PIC18 parts never have prog_preserved, it does not have to
   // be tested here.
 
@@ -1142,7 +2029,7 @@ hexfile::program (picport &pic, bool reset, bool nopreserve)
 	     << hex << setfill('0') << setw(4) << addr << dec
 	     << " not programmed";
 	if (-1 != pgm [addr]) {
-	  pgm [addr] = -1;
+	  pgm.set (addr, -1);
 	  cout << " (value in input file ignored)";
 	}
 	cout << endl;
@@ -1154,7 +2041,7 @@ hexfile::program (picport &pic, bool reset, bool nopreserve)
 	     << hex << setfill('0') << setw(4) << addr << dec
 	     << " not programmed";
 	if (-1 != ids [addr - deviceinfo [dev].prog_size]) {
-	  ids [addr - deviceinfo [dev].prog_size] = -1;
+	  ids.set (addr - deviceinfo [dev].prog_size, -1);
 	  cout << " (value in input file ignored)";
 	}
 	cout << endl;
@@ -1183,7 +2070,8 @@ hexfile::program (picport &pic, bool reset, bool nopreserve)
 	if (pic.address () >= deviceinfo [dev].prog_size - deviceinfo [dev].prog_preserved
 	    && pic.address () < deviceinfo [dev].prog_size) {
 
-		int value = pic.command (picport::data_from_prog,0, True);
+	  pic.preserve (pic.address (), 0x3fff);
+	  int value = pic.command (picport::data_from_prog,0, True);
 	  if (-1 == value) {
 	    cerr << pic.port() << ':'
 		 << hex << setfill ('0') << setw (4) << pic.address () << dec
@@ -1197,7 +2085,7 @@ hexfile::program (picport &pic, bool reset, bool nopreserve)
 	  if (-1 != pgm [pic.address ()])
 	    cout << " (value in input file ignored)";
 	  cout << endl;
-	  pgm [pic.address ()] = value;
+	  pgm.set (pic.address (), value);
 	}
 	if (pic.address () + 1 == deviceinfo [dev].prog_size)
 	  break;
@@ -1208,7 +2096,8 @@ hexfile::program (picport &pic, bool reset, bool nopreserve)
 	for (;;) {
 	  if (pic.address () == deviceinfo [dev].prog_size + 4) {
 
-		  int value = pic.command (picport::data_from_prog,0, True);
+	    pic.preserve (pic.address (), 0x3fff);
+	    int value = pic.command (picport::data_from_prog,0, True);
 	    if (-1 == value) {
 	      cerr << pic.port() << ':'
 		   << hex << setfill ('0') << setw (4) << pic.address () << dec
@@ -1222,7 +2111,7 @@ hexfile::program (picport &pic, bool reset, bool nopreserve)
 	    if (-1 != ids [pic.address () - deviceinfo [dev].prog_size])
 	      cout << " (value in input file ignored)";
 	    cout << endl;
-	    ids [pic.address () - deviceinfo [dev].prog_size] = value;
+	    ids.set (pic.address () - deviceinfo [dev].prog_size, value);
 	    break; // Only 1 backup word
 	  }
 	  pic.command (picport::inc_addr, addr_max);
@@ -1242,6 +2131,7 @@ hexfile::program (picport &pic, bool reset, bool nopreserve)
       assert (0x2007 == pic.address());
       int value;
 
+      pic.preserve (0x2007, deviceinfo [dev].config_mask);
       if (-1 == (value = pic.command (picport::data_from_prog,0, True))) {
 	cerr << pic.port() << ':' << hex << setfill ('0') << setw (4) << pic.address () << dec
 	     << ":unable to read pic calibration bits" << endl;
@@ -1252,9 +2142,8 @@ hexfile::program (picport &pic, bool reset, bool nopreserve)
 	   << hex << setfill('0') << setw(4) << deviceinfo [dev].config_mask
 	   << " in configuration word preserved as 0x"
 	   << setfill('0') << setw(4) << value << dec << endl;
-      if (-1 == conf [0])
-	conf [0] = 0x3fff;
-      conf [0] = (conf [0] & ~deviceinfo [dev].config_mask) | value;
+      int word = -1 == conf [0] ? 0x3fff : conf [0];
+      conf.set (0, (word & ~deviceinfo [dev].config_mask) | value);
     } else {
       cout << "Calibration bits 0x"
 	   << hex << setfill('0') << setw(4) << deviceinfo [dev].config_mask
@@ -1265,13 +2154,39 @@ hexfile::program (picport &pic, bool reset, bool nopreserve)
   if (reset) {
     if (rom == deviceinfo [dev].prog_type
 	|| prom == deviceinfo [dev].prog_type
-	|| eprom == deviceinfo [dev].prog_type) {
+	|| eprom == deviceinfo [dev].prog_type
+	|| eprom18 == deviceinfo [dev].prog_type) {
       cerr << "I do not know how to erase this device." << endl;
       return EX_UNAVAILABLE;
     }
+    if (known) {
+      delete known;
+      known = 0;
+    }
+    pic.phase (picport::ph_erase);
     reset_code_protection (pic);
+    pic.phase (picport::ph_setup);
     cout << "Erased and removed code protection." << endl;
   }
+
+  // If programming fails half way, the cached image is stale.
+  if (!cache_name.empty ())
+    unlink (cache_name.c_str ());
+
+  if (24 == deviceinfo [dev].prog_bits) {
+    retval = program30 (pic);
+    pic.phase (picport::ph_setup);
+    if (EX_OK == retval && got_signal) {
+      cerr << "Exiting." << endl;
+      return EX_UNAVAILABLE;
+    }
+    return retval;
+  }
+
+  // After the erase 14 bit parts are programmed in bulk without
+  // reading each word, and verified in a separate pass.
+  bool bulk = reset && !safe_mode && 14 == deviceinfo [dev].prog_bits;
+
   if (deviceinfo [dev].prog_bits == 12) {
     // 12f508/509 reset to configuration word.
     if (pic.address () != 0xfff && pic.address () != 0)
@@ -1284,11 +2199,17 @@ hexfile::program (picport &pic, bool reset, bool nopreserve)
       pic.reset (0);
   }
 
+  // 14 and 12 bit parts step through every word, so they stop after
+  // the last one to be programmed.
+  unsigned long pgm_end = 0;
+  unsigned long data_end = data.defined_end (0, deviceinfo [dev].data_size);
+
   int count;
   if (rom == deviceinfo [dev].prog_type || 0 == deviceinfo [dev].prog_size) {
     cout << "Skipped burning program memory," << endl;
   } else {
     cout << "Burning program memory,\n" << flush;
+    pic.phase (picport::ph_pgm);
     count = 0;
 
     if (16 == deviceinfo [dev].prog_bits) {
@@ -1314,15 +2235,39 @@ hexfile::program (picport &pic, bool reset, bool nopreserve)
     unsigned long panel_size = deviceinfo [dev].panel_size;
     if (!panel_size || panel_size > deviceinfo [dev].prog_size)
       panel_size = deviceinfo [dev].prog_size;
-    while (addr < panel_size) {
+    pgm_end = 16 == deviceinfo [dev].prog_bits
+      ? panel_size : pgm.defined_end (0, panel_size);
+    if (bulk) {
+      retval = program_bulk (pic, pgm, 0, pgm_end, false);
+      if (retval < 0)
+	return -retval;
+      count = retval;
+      addr = pgm_end;
+    }
+    while (addr < pgm_end) {
       if (16 == deviceinfo [dev].prog_bits) {
 	int len = deviceinfo [dev].write_size;
-	retval = program18 (pic, pgm + addr, addr, len, panel_size);
+	// Pass over blocks that are undefined in every panel.
+	unsigned long next = pgm_end;
+	for (unsigned long panel = 0;
+	     panel < deviceinfo [dev].prog_size;
+	     panel += panel_size)
+	  next = min (next, pgm.next_defined (panel + addr, panel + panel_size)
+		      - panel);
+	addr = next - next % len;
+	if (addr >= pgm_end)
+	  break;
+	retval = program18 (pic, pgm, addr, addr, len, panel_size);
 	if (retval >= 0)
 	  count += retval;
 	else
 	  return -retval;
 	addr += len;
+      } else if (-1 == pgm [addr]) {
+	// Step over undefined words with queued increments.
+	seek (pic, pgm.next_defined (addr, pgm_end));
+	addr = pic.address ();
+	continue;
       } else { // 12 bit and 14 bit
 	retval = program_location (pic, addr, pgm [addr], false);
 	if (EX_OK == retval)
@@ -1345,17 +2290,28 @@ hexfile::program (picport &pic, bool reset, bool nopreserve)
     cout << "skipped burning data memory," << endl;
   } else {
     cout << "burning data memory," << flush;
+    pic.phase (picport::ph_data);
     count = 0;
     if (16 == deviceinfo [dev].prog_bits) {
       // Direct access to data EEPROM.
       pic.command18 (picport::instr, 0x9ea6);
       pic.command18 (picport::instr, 0x9ca6);
+    } else if (14 == deviceinfo [dev].prog_bits)
+      // Data memory address runs along with the program counter.
+      while (pic.address () % deviceinfo [dev].data_size)
+	pic.command (picport::inc_addr);
+    if (bulk) {
+      retval = program_bulk (pic, data, 0x2100, data_end, true);
+      if (retval < 0)
+	return -retval;
+      count = retval;
     }
     for (unsigned long addr = 0;
-	 addr < deviceinfo [dev].data_size;
+	 !bulk && addr < data_end;
 	 ++addr) {
       if (16 == deviceinfo [dev].prog_bits) {
-	if (-1 == data [addr])
+	int word = known_value (0xf00000 + addr, true);
+	if (-1 == data [addr] || word == data [addr])
 	  retval = NOT_PROGRAMMED;
 	else {
 	  // Set the data EEPROM address pointer.
@@ -1363,14 +2319,16 @@ hexfile::program (picport &pic, bool reset, bool nopreserve)
 	  pic.command18 (picport::instr, 0x6ea9);
 	  pic.command18 (picport::instr, 0x0e00 | ((addr & 0xff00) >> 8));
 	  pic.command18 (picport::instr, 0x6eaa);
-	  // Initiate a memory read.
-	  pic.command18 (picport::instr, 0x80a6);
-	  // Load data into the serial data holding register.
-	  pic.command18 (picport::instr, 0x50a8);
-	  pic.command18 (picport::instr, 0x6ef5);
-	  pic.command18 (picport::instr, 0x0000);
-
-	  int word = pic.command18 (picport::shift_out);
+	  if (-1 == word) {
+	    // Initiate a memory read.
+	    pic.command18 (picport::instr, 0x80a6);
+	    // Load data into the serial data holding register.
+	    pic.command18 (picport::instr, 0x50a8);
+	    pic.command18 (picport::instr, 0x6ef5);
+	    pic.command18 (picport::instr, 0x0000);
+
+	    word = pic.command18 (picport::shift_out);
+	  }
 	  if (word == data [addr])
 	    retval = NOT_PROGRAMMED;
 	  else {
@@ -1386,7 +2344,10 @@ hexfile::program (picport &pic, bool reset, bool nopreserve)
 	    pic.command18 (picport::instr, 0x6ea7);
 	    // Initiate write.
 	    pic.command18 (picport::instr, 0x82a6);
-	    // Poll EECON1 WR bit, repeat until the bit is clear.
+	    // Poll EECON1 WR bit, repeat until the bit is clear.  A plan
+	    // cannot repeat the poll, it waits out the write first.
+	    if (pic.recording ())
+	      pic.delay (10000);
 	    do {
 	      if (got_signal) {
 		cerr << "Exiting." << endl;
@@ -1396,6 +2357,7 @@ hexfile::program (picport &pic, bool reset, bool nopreserve)
 	      pic.command18 (picport::instr, 0x6ef5);
 	      pic.command18 (picport::instr, 0x0000);
 
+	      pic.loose_read (2);
 	      word = pic.command18 (picport::shift_out);
 	    } while (word & 2);
 	    // Disable writes.
@@ -1440,7 +2402,42 @@ hexfile::program (picport &pic, bool reset, bool nopreserve)
     cout << " " << count << " location" << (count != 1 ? "s" : "") << "," << endl;
   }
 
+  if (bulk) {
+    // Verify before the fuses can enable code protection.
+    cout << "verifying," << flush;
+    pic.phase (picport::ph_pgm);
+    pic.reset (0);
+    int errors = 0;
+    if (rom != deviceinfo [dev].prog_type && deviceinfo [dev].prog_size)
+      errors = verify_bulk (pic, pgm, 0, pgm_end, false);
+    if (errors >= 0
+	&& rom != deviceinfo [dev].data_type && data_end) {
+      pic.phase (picport::ph_data);
+      // Data memory address runs along with the program counter.
+      while (pic.address () % deviceinfo [dev].data_size)
+	pic.command (picport::inc_addr);
+      int e = verify_bulk (pic, data, 0x2100, data_end, true);
+      errors = e < 0 ? e : errors + e;
+    }
+    if (errors) {
+      if (errors > 0)
+	cerr << errors << " location" << (errors != 1 ? "s" : "")
+	     << " failed verification." << endl;
+      return EX_IOERR;
+    }
+    cout << " ok," << endl;
+  }
+
+  // Read back what the cache kept from being written, before the
+  // fuses can enable code protection.
+  if (known && rom != deviceinfo [dev].prog_type && deviceinfo [dev].prog_size) {
+    retval = verify_cached (pic);
+    if (EX_OK != retval)
+      return retval;
+  }
+
   cout << "burning id words," << flush;
+  pic.phase (picport::ph_ids);
   count = 0;
   if (16 == deviceinfo [dev].prog_bits) {
     // Enable access to config memory
@@ -1453,7 +2450,7 @@ hexfile::program (picport &pic, bool reset, bool nopreserve)
     // Enable access to code memory.
     pic.command18 (picport::instr, 0x8ea6);
     pic.command18 (picport::instr, 0x9ca6);
-    retval = program18 (pic, ids, 0x200000, 8, 8);
+    retval = program18 (pic, ids, 0, 0x200000, 8, 8);
     if (retval >= 0)
       count += retval;
     else
@@ -1492,6 +2489,7 @@ hexfile::program (picport &pic, bool reset, bool nopreserve)
   cout << " " << count << " location" << (count != 1 ? "s" : "") << "," << endl;
 
   cout << "burning fuses," << flush;
+  pic.phase (picport::ph_conf);
   count = 0;
   if (16 == deviceinfo [dev].prog_bits) {
     // Enable access to config memory
@@ -1555,109 +2553,988 @@ hexfile::program (picport &pic, bool reset, bool nopreserve)
       else if (NOT_PROGRAMMED != retval)
 	return retval;
     }
-    // pic12f635 and friends need to reset write latches,
-    // but as this is the last operation on them, no need
-    // to do that.
-  } // 14 bit
-  cout << " " << count << " location" << (count != 1 ? "s" : "") << "," << endl;
-  cout << "done." << endl;
+    // pic12f635 and friends need to reset write latches,
+    // but as this is the last operation on them, no need
+    // to do that.
+  } // 14 bit
+  cout << " " << count << " location" << (count != 1 ? "s" : "") << "," << endl;
+  cout << "done." << endl;
+  pic.phase (picport::ph_setup);
+
+  if (!cache_name.empty () && EX_OK != save_cache (pic, reset))
+    cerr << cache_name << ": warning: image cache not updated" << endl;
+
+  if (got_signal) {
+    cerr << "Exiting." << endl;
+    return EX_UNAVAILABLE;
+  }
+
+  return EX_OK;
+}
+
+
+int
+hexfile::read_code (picport &pic, short *pgmp, unsigned long addr, unsigned long len, const image *want)
+{
+  // All reads are queued.  picport sends a frame when the next
+  // command or its reply would not fit, and the values are taken as
+  // their frames come back.  With want, locations it leaves undefined
+  // are not read and are set to -1.
+  if (24 == deviceinfo [dev].prog_bits)
+    return read30 (pic, pgmp, addr, len, want);
+
+  vector<int> tickets (len, -1);
+  unsigned long done = 0;
+  time_t tv1 = time(0);
+  // 14 bit and 12 bit parts must make sure the address
+  // is correct before calling this function.  With want, the address
+  // is left after the last location read.
+  if (16 == deviceinfo [dev].prog_bits)
+    pic.setaddress (addr);
+  for (unsigned long i = 0; i <= len; ++i) {
+    if (i < len) {
+      assert (pic.address () == addr + i);
+
+      time_t tv2 = time(0);
+      if (tv2 >= tv1 + 2) {
+	tv1 = tv2;
+	cerr << "\r" << hex << setfill('0') << setw(4) << pic.address () << dec
+	     << "                           \r";
+      }
+
+      if (want && !want->defined (i)) {
+	unsigned long gap = want->next_defined (i, len);
+	// PIC18 reads through gaps shorter than a table pointer load,
+	// 14 and 12 bit parts step over them.  Nothing is sent for a
+	// gap at the end.
+	if (gap == len)
+	  i = gap;
+	else if (16 != deviceinfo [dev].prog_bits)
+	  for (; i < gap; ++i)
+	    pic.command (picport::inc_addr,
+			 12 == deviceinfo [dev].prog_bits ? addr_max : 0, False);
+	else if (gap - i >= 8) {
+	  i = gap;
+	  pic.setaddress (addr + i);
+	}
+	if (i == gap) {
+	  --i;
+	  continue;
+	}
+      }
+
+      if (16 == deviceinfo [dev].prog_bits) {
+	tickets [i] = pic.command18 (picport::tread_inc,0, False);
+      }
+      else if (12 == deviceinfo [dev].prog_bits) {
+	tickets [i] = pic.command (picport::data_from_prog,0, False);
+	pic.command (picport::inc_addr, addr_max, False);
+      } else { // 14 bit
+	tickets [i] = pic.command (picport::data_from_prog,0, False);
+	pic.command (picport::inc_addr,0, False);
+      }
+    }
+
+    // After the last read, result () sends what is left.
+    for (; done < len && (i == len || (done <= i && (-1 == tickets [done]
+						     || pic.ready (tickets [done]))));
+	 ++done) {
+      if (-1 == tickets [done]) {
+	pgmp [done] = -1;
+	continue;
+      }
+      int value = pic.result (tickets [done]);
+      if (-1 == value) {
+	cerr << hex << setfill ('0') << setw (4) << addr + done << dec
+	     << ":unable to read pic" << endl;
+	pic.forget_results ();
+	return EX_IOERR;
+      }
+      if (12 == deviceinfo [dev].prog_bits)
+	pgmp [done] = value & 0xfff;
+      else
+	pgmp [done] = value;
+    }
+
+    if (got_signal) {
+      pic.forget_results ();
+      cerr << "Exiting." << endl;
+      return EX_UNAVAILABLE;
+    }
+  }
+  pic.forget_results ();
+  return EX_OK;
+}
+
+
+int
+hexfile::read (picport &pic)
+{
+
+  term_signals catcher;
+
+  cout << "Device " << deviceinfo [dev].name
+       << ", program memory: " << deviceinfo [dev].prog_size;
+  if (rom == deviceinfo [dev].prog_type && deviceinfo [dev].prog_size)
+    cout << " (rom)";
+  cout << ", data memory: " << deviceinfo [dev].data_size;
+  if (rom == deviceinfo [dev].data_type && deviceinfo [dev].data_size)
+    cout << " (rom)";
+  cout << "." << endl;
+
+  int e;
+  int bits = deviceinfo [dev].prog_bits;
+  unsigned long first, end, base;
+
+  if (deviceinfo [dev].prog_bits == 12) {
+    // 12f508/509 reset to configuration word.
+    if (pic.address () != 0xfff && pic.address () != 0)
+      pic.reset (0xfff);
+    // We need to step them to address 0.
+    if (pic.address () == 0xfff)
+      pic.command (picport::inc_addr, addr_max);
+  } else {
+    if (pic.address ())
+      pic.reset (0);
+  }
+  if (!span (region_pgm, first, end)) {
+    cout << "Skipped reading program memory," << endl;
+  } else {
+    cout << "Reading program memory," << endl;
+    pic.phase (picport::ph_pgm);
+    if (16 > bits)
+      seek (pic, first);
+    vector<short> rb (end - first);
+    e = read_code (pic, &rb [0], first, end - first);
+    if (EX_OK != e)
+      return e;
+    for (unsigned long i = first; i < end; ++i)
+      pgm.set (i, rb [i - first]);
+  }
+
+  if (!span (region_data, first, end)) {
+    cout << "skipped reading data memory," << endl;
+  } else {
+    cout << "reading data memory," << endl;
+    pic.phase (picport::ph_data);
+    // 14 bit data memory address runs along with the program counter.
+    if (14 == bits)
+      while (pic.address () % deviceinfo [dev].data_size)
+	pic.command (picport::inc_addr, 0, False);
+    image want;
+    want.assign (deviceinfo [dev].data_size, false);
+    for (unsigned long i = first; i < end; ++i)
+      want.set (i, 0);
+    vector<short> rb (deviceinfo [dev].data_size);
+    e = read_data (pic, &rb [0], &want);
+    if (EX_OK != e)
+      return e;
+    for (unsigned long i = 0; i < rb.size (); ++i)
+      data.set (i, rb [i]);
+  }
+
+  if (!span (region_ids, first, end)) {
+    cout << "skipped reading id words," << endl;
+  } else {
+    cout << "reading id words," << endl;
+    pic.phase (picport::ph_ids);
+    base = region_base (region_ids);
+    if (16 > bits)
+      seek (pic, base + first);
+    short rb [8];
+    e = read_code (pic, rb, base + first, end - first);
+    if (EX_OK != e)
+      return e;
+    for (unsigned long i = first; i < end; ++i)
+      ids.set (i, rb [i - first]);
+  }
+
+  if (!span (region_conf, first, end)) {
+    cout << "skipped reading fuses," << endl;
+  } else {
+    cout << "reading fuses," << endl;
+    pic.phase (picport::ph_conf);
+    base = region_base (region_conf);
+    if (12 == bits)
+      // Only reset allows us to access the config word.
+      pic.reset (0xfff);
+    else if (14 == bits)
+      seek (pic, base + first);
+    short rb [16];
+    e = read_code (pic, rb, base + first, end - first);
+    if (EX_OK != e)
+      return e;
+    for (unsigned long i = first; i < end; ++i)
+      conf.set (i, rb [i - first]);
+  }
+  cout << "done." << endl;
+  pic.phase (picport::ph_setup);
+
+  if (got_signal) {
+    cerr << "Exiting." << endl;
+    return EX_UNAVAILABLE;
+  }
+
+  return EX_OK;
+}
+
+// Read data memory into dst in one batch.  With want, only the
+// locations it defines are read.  A 14 bit part must be positioned
+// at the start of data memory.
+
+int
+hexfile::read_data (picport &pic, short *dst, const image *want)
+{
+  unsigned long len = deviceinfo [dev].data_size;
+  unsigned long end = want ? want->defined_end (0, len) : len;
+  vector<int> tickets (len, -1);
+
+  if (24 == deviceinfo [dev].prog_bits)
+    return read30 (pic, dst, region_base (region_data), len, want);
+  if (12 == deviceinfo [dev].prog_bits) {
+    cerr << "12 bit microcontroller data memory unimplemented." << endl;
+    return EX_UNAVAILABLE;
+  }
+  if (16 == deviceinfo [dev].prog_bits) {
+    // Direct access to data EEPROM.
+    pic.command18 (picport::instr, 0x9ea6);
+    pic.command18 (picport::instr, 0x9ca6);
+  } else
+    assert (0 == pic.address () % len);
+
+  for (unsigned long addr = 0; addr < end; ++addr) {
+    bool wanted = !want || want->defined (addr);
+    if (16 == deviceinfo [dev].prog_bits) {
+      if (!wanted)
+	continue;
+      // Set the data EEPROM address pointer.
+      pic.command18 (picport::instr, 0x0e00 | (addr & 0x00ff));
+      pic.command18 (picport::instr, 0x6ea9);
+      pic.command18 (picport::instr, 0x0e00 | ((addr & 0xff00) >> 8));
+      pic.command18 (picport::instr, 0x6eaa);
+      // Initiate a memory read.
+      pic.command18 (picport::instr, 0x80a6);
+      // Load data into the serial data holding register.
+      pic.command18 (picport::instr, 0x50a8);
+      pic.command18 (picport::instr, 0x6ef5);
+      tickets [addr] = pic.command18 (picport::shift_out, 0, False);
+    } else { // 14 bit
+      if (wanted)
+	tickets [addr] = pic.command (picport::data_from_data, 0, False);
+      pic.command (picport::inc_addr, 0, False);
+    }
+  }
+
+  for (unsigned long addr = 0; addr < len; ++addr) {
+    if (-1 == tickets [addr]) {
+      dst [addr] = -1;
+      continue;
+    }
+    int value = pic.result (tickets [addr]);
+    // The leftover bits of a 14 bit read are all 1's or all 0's,
+    // anything else means the programmer is not answering.
+    if (-1 == value
+	|| (16 != deviceinfo [dev].prog_bits
+	    && (value & 0x3f00) != 0x3f00 && (value & 0x3f00) != 0)) {
+      cerr << pic.port() << ':' << hex << setfill ('0') << setw (4)
+	   << addr << dec
+	   << ":unable to read pic data memory" << endl;
+      pic.forget_results ();
+      return EX_IOERR;
+    }
+    dst [addr] = value & 0xff;
+    if (got_signal) {
+      pic.forget_results ();
+      cerr << "Exiting." << endl;
+      return EX_UNAVAILABLE;
+    }
+  }
+  pic.forget_results ();
+  return EX_OK;
+}
+
+// Index of the first defined location of the image from i on that
+// differs from the readback rb under mask, or len if there is none.
+
+static unsigned long
+first_difference (const image &img, const short *rb, unsigned long i,
+		  unsigned long len, short mask)
+{
+  for (i = img.next_defined (i, len); i < len; i = img.next_defined (i + 1, len))
+    if ((img [i] ^ rb [i]) & mask)
+      break;
+  return i;
+}
+
+static void
+print_difference (const char *what, unsigned long base, const image &img,
+		  const short *rb, unsigned long first, unsigned long n)
+{
+  cerr << what << " 0x" << hex << setfill ('0') << setw (4) << base + first;
+  if (1 == n)
+    cerr << ": image 0x" << setw (4) << img [first]
+	 << ", chip 0x" << setw (4) << rb [first] << dec
+	 << endl;
+  else
+    cerr << "-0x" << setw (4) << base + first + n - 1 << dec
+	 << ": " << n << " words differ" << endl;
+}
+
+// Compare the readback rb with the image under mask, skipping what
+// the image leaves undefined, and report the ranges that differ.
+// Returns the number of differing words.
+
+static unsigned long
+compare_image (const char *what, unsigned long base, const image &img,
+	       const short *rb, unsigned long len, short mask)
+{
+  unsigned long count = 0;
+
+  for (unsigned long i = first_difference (img, rb, 0, len, mask); i < len;
+       i = first_difference (img, rb, i, len, mask)) {
+    // The run goes on over the following defined words that differ.
+    unsigned long first = i;
+    while (i < len && img.defined (i) && ((img [i] ^ rb [i]) & mask))
+      ++i;
+    print_difference (what, base, img, rb, first, i - first);
+    count += i - first;
+  }
+  return count;
+}
+
+// dspic30 memories are read by moving table reads to VISI and
+// shifting it out with REGOUT, and written a row of write latches at
+// a time.  Program memory images hold four bytes per instruction, the
+// last one the phantom byte that reads as zero, at twice the
+// instruction address.  Data memory and fuse images hold two bytes
+// per word at its address.
+
+// Read len image locations at image address addr.  All reads are
+// queued before the first value is taken.  With want, words it leaves
+// undefined are not read and are set to -1.
+
+int
+hexfile::read30 (picport &pic, short *pgmp, unsigned long addr, unsigned long len, const image *want) const
+{
+  const unsigned step = addr < region_size (region_pgm) || addr >= exec_base
+    ? 4 : 2;
+  const unsigned long first = addr - addr % step;
+  // Low and high word tickets of each word the range touches.
+  vector<int> tickets (2 * ((addr + len - first + step - 1) / step), -1);
+  unsigned long page = ~0UL, next = ~0UL;
+
+  exit_reset_vector30 (pic);
+  mov30 (pic, 0x784, 7); // MOV #VISI, W7
+  for (unsigned long w = first, k = 0; w < addr + len; w += step, k += 2) {
+    if (want) {
+      unsigned long i = max (w, addr) - addr, end = min (w + step, addr + len) - addr;
+      if (want->next_defined (i, end) == end)
+	continue;
+    }
+    unsigned long a = 4 == step ? w / 2 : w;
+    if (a >> 16 != page) {
+      page = a >> 16;
+      tblpag30 (pic, a);
+      next = ~0UL;
+    }
+    if (a != next)
+      mov30 (pic, a, 6);
+    if (4 == step)
+      pic.command30 (picport::SIX, 0xBA0B96); // TBLRDL [W6], [W7]
+    else
+      pic.command30 (picport::SIX, 0xBA0BB6); // TBLRDL [W6++], [W7]
+    pic.command30 (picport::SIX, 0); // NOP
+    pic.command30 (picport::SIX, 0); // NOP
+    tickets [k] = pic.command30 (picport::REGOUT, 0, False);
+    if (4 == step) {
+      pic.command30 (picport::SIX, 0xBA8BB6); // TBLRDH [W6++], [W7]
+      pic.command30 (picport::SIX, 0); // NOP
+      pic.command30 (picport::SIX, 0); // NOP
+      tickets [k + 1] = pic.command30 (picport::REGOUT, 0, False);
+    }
+    next = a + 2;
+  }
+
+  for (unsigned long i = 0; i < len; ++i) {
+    unsigned long k = 2 * ((addr + i - first) / step);
+    int b = (addr + i) % step;
+    if ((want && !want->defined (i)) || -1 == tickets [k]) {
+      pgmp [i] = -1;
+      continue;
+    }
+    if (3 == b) {
+      pgmp [i] = 0;
+      continue;
+    }
+    int value = pic.result (tickets [k + (2 == b)]);
+    if (-1 == value) {
+      cerr << hex << setfill ('0') << setw (6) << addr + i << dec
+	   << ":unable to read pic" << endl;
+      pic.forget_results ();
+      return EX_IOERR;
+    }
+    pgmp [i] = 1 == b ? value >> 8 : value & 0xff;
+  }
+  pic.forget_results ();
+  return EX_OK;
+}
+
+// Program the rows of program or data memory the image defines, len
+// image locations at image address addr.  Blank rows are written as
+// they are.  Otherwise a row is read first and left alone
+// if it already holds the image, or erased and written back with the
+// locations the image leaves undefined.  Returns the number of words
+// written, or minus the error code.
+
+// Two instructions from W registers into the program memory latches.
+static const unsigned long latch30 [4] = {
+  0xBB0BB6, // TBLWTL [W6++], [W7]
+  0xBBDBB6, // TBLWTH.B [W6++], [W7++]
+  0xBBEBB6, // TBLWTH.B [W6++], [++W7]
+  0xBB1BB6, // TBLWTL [W6++], [W7++]
+};
+
+int
+hexfile::program30_rows (picport &pic, const image &img, unsigned long addr, unsigned long len, bool isdata, bool blank) const
+{
+  // 32 instructions of program memory or 16 words of data memory.
+  const unsigned step = isdata ? 2 : 4, row = isdata ? 32 : 128;
+  short merged [128];
+  int count = 0;
+
+  for (unsigned long r = img.next_defined (0, len); r < len;
+       r = img.next_defined (r + row, len)) {
+    r -= r % row;
+    unsigned long n = min ((unsigned long) row, len - r);
+    if (blank)
+      fill (merged, merged + n, 0xff);
+    else {
+      int e = read30 (pic, merged, addr + r, n);
+      if (EX_OK != e)
+	return -e;
+    }
+    bool same = true;
+    int words = 0;
+    for (unsigned long w = 0; w < n; w += step) {
+      bool defined = false;
+      for (unsigned b = 0; b < 3 && b < step; ++b)
+	if (img.defined (r + w + b)) {
+	  defined = true;
+	  same = same && merged [w + b] == img [r + w + b];
+	  merged [w + b] = img [r + w + b];
+	}
+      words += defined;
+    }
+    if (same)
+      continue;
+
+    unsigned long a = isdata ? addr + r : (addr + r) / 2;
+    if (!blank) {
+      nvmcon30 (pic, isdata ? 0x4045 : 0x4041);
+      mov30 (pic, a >> 16, 0);
+      pic.command30 (picport::SIX, 0x883B20); // MOV W0, NVMADRU
+      mov30 (pic, a, 0);
+      pic.command30 (picport::SIX, 0x883B10); // MOV W0, NVMADR
+      nvm_start30 (pic);
+    }
+    nvmcon30 (pic, isdata ? 0x4005 : 0x4001);
+    tblpag30 (pic, a);
+    mov30 (pic, a, 7);
+    // Four words at a time into W0 to W5, and from there through W6
+    // into the write latches at W7.  Data memory words go in with
+    // TBLWTL [W6++], [W7++].
+    for (unsigned long w = 0; w < n; w += 4 * step) {
+      const short *m = merged + w;
+      if (isdata) {
+	for (int k = 0; k < 4; ++k)
+	  mov30 (pic, m [2 * k + 1] << 8 | m [2 * k], k);
+      } else {
+	mov30 (pic, m [1] << 8 | m [0], 0);
+	mov30 (pic, m [6] << 8 | m [2], 1);
+	mov30 (pic, m [5] << 8 | m [4], 2);
+	mov30 (pic, m [9] << 8 | m [8], 3);
+	mov30 (pic, m [14] << 8 | m [10], 4);
+	mov30 (pic, m [13] << 8 | m [12], 5);
+      }
+      pic.command30 (picport::SIX, 0xEB0300); // CLR W6
+      pic.command30 (picport::SIX, 0); // NOP
+      for (int k = 0; k < (isdata ? 4 : 8); ++k) {
+	pic.command30 (picport::SIX, isdata ? 0xBB1BB6 : latch30 [k % 4]);
+	pic.command30 (picport::SIX, 0); // NOP
+	pic.command30 (picport::SIX, 0); // NOP
+      }
+    }
+    nvm_start30 (pic);
+    count += words;
+
+    if (got_signal) {
+      cerr << "Exiting." << endl;
+      return -EX_UNAVAILABLE;
+    }
+    cout << count << "\r" << flush;
+  }
+  return count;
+}
+
+// Write the fuse words that differ from the image one at a time, and
+// read them all back.  Returns the number of words written, or minus
+// the error code.
+
+int
+hexfile::program30_conf (picport &pic) const
+{
+  const unsigned long base = region_base (region_conf);
+  const unsigned long len = region_size (region_conf);
+  short rb [16];
+  int count = 0;
+
+  int e = read30 (pic, rb, base, len);
+  if (EX_OK != e)
+    return -e;
+  for (unsigned long w = 0; w < len; w += 2) {
+    if (-1 == conf [w] && -1 == conf [w + 1])
+      continue;
+    int lo = -1 != conf [w] ? conf [w] : rb [w];
+    int hi = -1 != conf [w + 1] ? conf [w + 1] : rb [w + 1];
+    if (lo == rb [w] && hi == rb [w + 1])
+      continue;
+    nvmcon30 (pic, 0x4008);
+    tblpag30 (pic, base + w);
+    mov30 (pic, base + w, 7);
+    mov30 (pic, hi << 8 | lo, 0);
+    pic.command30 (picport::SIX, 0xBB0B80); // TBLWTL W0, [W7]
+    pic.command30 (picport::SIX, 0); // NOP
+    pic.command30 (picport::SIX, 0); // NOP
+    nvm_start30 (pic);
+    ++count;
+  }
+
+  if (count) {
+    e = read30 (pic, rb, base, len, &conf);
+    if (EX_OK != e)
+      return -e;
+    if (compare_image ("fuses", base, conf, rb, len, -1))
+      return -EX_IOERR;
+  }
+  return count;
+}
+
+// Check the answers of executive commands queued as tickets: the
+// image address of the row, and the tickets of the two answer words.
+// Returns the address of the first row not answered with ack, or -1.
+
+static long
+pe_failed (picport &pic, const vector<int> &tickets, int ack)
+{
+  long bad = -1;
+
+  for (unsigned k = 0; k < tickets.size () && bad < 0; k += 3)
+    if (ack != pic.result (tickets [k + 1]))
+      bad = tickets [k];
+  pic.forget_results ();
+  return bad;
+}
+
+// Program memory of an erased dspic30 part through the programming
+// executive: download it into executive memory unless it is there
+// already, start it, and send the rows with PROGP and read them back
+// with READP.  The answers are read in batches, each queued after its
+// command.  count is left -1 and the chip back in ICSP mode if the
+// programmer or the executive cannot do it.
+
+int
+hexfile::program30_pe (picport &pic, int &count)
+{
+  const unsigned long prog_len = region_size (region_pgm);
+  const unsigned row = 128;
+
+  if (!pic.executive ()) {
+    cout << "programmer has no executive commands, using ICSP," << endl;
+    return EX_OK;
+  }
+
+  cout << "Programming executive,\n" << flush;
+  exit_reset_vector30 (pic);
+  int e = program30_rows (pic, executive, exec_base, exec_len, false, false);
+  if (e < 0)
+    return -e;
+  vector<short> rb (max ((unsigned long) exec_len, prog_len), -1);
+  e = read30 (pic, &rb [0], exec_base, exec_len, &executive);
+  if (EX_OK != e)
+    return e;
+  if (compare_image ("programming executive", exec_base, executive,
+		     &rb [0], exec_len, -1))
+    return EX_IOERR;
+
+  pic.enter_executive ();
+  pic.pe_send (0xB001); // QVER
+  int ack = pic.pe_read ();
+  pic.pe_read ();
+  if (0x1B00 != (ack & 0xff00)) {
+    cout << "\r no answer, using ICSP," << endl;
+    pic.reset (0);
+    return EX_OK;
+  }
+  cout << "\r version " << (ack >> 4 & 15) << '.' << (ack & 15) << " running,"
+       << endl;
+
+  pic.pe_send (0xA003); // QBLANK
+  pic.pe_send (prog_len / 4);
+  pic.pe_send (erased & region_data ? region_size (region_data) / 2 : 0);
+  ack = pic.pe_read ();
+  pic.pe_read ();
+  if (0x1AF0 != ack) {
+    cerr << "Chip not blank after erase." << endl;
+    pic.reset (0);
+    return EX_IOERR;
+  }
+
+  // Two instructions go in three words: the low words, and the high
+  // bytes together.
+  vector<int> tickets;
+  int n = 0;
+  long bad = -1;
+  for (unsigned long r = pgm.next_defined (0, prog_len); r < prog_len && bad < 0;
+       r = pgm.next_defined (r + row, prog_len)) {
+    r -= r % row;
+    short m [128];
+    for (unsigned i = 0; i < row; ++i)
+      m [i] = r + i < prog_len && -1 != pgm [r + i] ? pgm [r + i] : 0xff;
+    tickets.push_back (r);
+    pic.pe_send (0x5033); // PROGP
+    pic.pe_send ((r / 2) >> 16);
+    pic.pe_send (r / 2);
+    for (unsigned i = 0; i < row; i += 8) {
+      pic.pe_send (m [i + 1] << 8 | m [i]);
+      pic.pe_send (m [i + 6] << 8 | m [i + 2]);
+      pic.pe_send (m [i + 5] << 8 | m [i + 4]);
+    }
+    tickets.push_back (pic.pe_read (False));
+    tickets.push_back (pic.pe_read (False));
+    for (unsigned i = 0; i < row && r + i < prog_len; i += 4)
+      n += -1 != pgm [r + i] || -1 != pgm [r + i + 1] || -1 != pgm [r + i + 2];
+
+    if (got_signal) {
+      cerr << "Exiting." << endl;
+      pic.reset (0);
+      return EX_UNAVAILABLE;
+    }
+    // Check the rows whose answers came with the frames sent so far.
+    if (pic.ready (tickets.back ())) {
+      bad = pe_failed (pic, tickets, 0x1500);
+      tickets.clear ();
+      cout << n << "\r" << flush;
+    }
+  }
+  if (bad < 0 && !tickets.empty ())
+    bad = pe_failed (pic, tickets, 0x1500);
+  tickets.clear ();
+  if (bad >= 0) {
+    cerr << "Programming executive failed to write 0x" << hex
+	 << setfill ('0') << setw (6) << bad / 2 << dec << endl;
+    pic.reset (0);
+    return EX_IOERR;
+  }
+
+  // Read the rows back with READP, the two answer words first.
+  fill (rb.begin (), rb.end (), -1);
+  for (unsigned long r = pgm.next_defined (0, prog_len); r < prog_len;
+       r = pgm.next_defined (r + row, prog_len)) {
+    r -= r % row;
+    pic.pe_send (0x2004); // READP
+    pic.pe_send (row / 4);
+    pic.pe_send ((r / 2) >> 16);
+    pic.pe_send (r / 2);
+    tickets.push_back (r);
+    for (int k = 0; k < 2 + 48; ++k)
+      tickets.push_back (pic.pe_read (False));
+  }
+  for (unsigned k = 0; k < tickets.size (); k += 51) {
+    unsigned long r = tickets [k];
+    const int *t = &tickets [k + 1];
+    if (0x1200 != pic.result (t [0])) {
+      cerr << "Programming executive failed to read 0x" << hex
+	   << setfill ('0') << setw (6) << r / 2 << dec << endl;
+      pic.forget_results ();
+      pic.reset (0);
+      return EX_IOERR;
+    }
+    for (unsigned i = 0, w = 2; i < row && r + i < prog_len; i += 8, w += 3) {
+      int lo0 = pic.result (t [w]), hi = pic.result (t [w + 1]);
+      int lo1 = pic.result (t [w + 2]);
+      short v [8] = { short (lo0 & 0xff), short (lo0 >> 8), short (hi & 0xff), 0,
+		      short (lo1 & 0xff), short (lo1 >> 8), short (hi >> 8), 0 };
+      copy (v, v + 8, rb.begin () + r + i);
+    }
+  }
+  pic.forget_results ();
+  pic.reset (0);
+
+  if (compare_image ("program memory", 0, pgm, &rb [0], prog_len, -1))
+    return EX_IOERR;
+  count = n;
+  return EX_OK;
+}
+
+// Program a dspic30 part: program and data memory a row at a time,
+// verified in one pass before the fuses can enable code protection,
+// and then the fuses.  With an executive program memory of an erased
+// part goes through it.
+
+int
+hexfile::program30 (picport &pic)
+{
+  const unsigned long prog_len = region_size (region_pgm);
+  const unsigned long data_len = region_size (region_data);
+  int count;
+  bool pe_done = false;
+
+  exit_reset_vector30 (pic);
+  if (rom == deviceinfo [dev].prog_type || 0 == prog_len) {
+    cout << "Skipped burning program memory," << endl;
+  } else {
+    cout << "Burning program memory,\n" << flush;
+    pic.phase (picport::ph_pgm);
+    count = -1;
+    if (executive.size () && (erased & region_pgm)) {
+      int e = program30_pe (pic, count);
+      if (EX_OK != e)
+	return e;
+      pe_done = count >= 0;
+    }
+    if (!pe_done) {
+      exit_reset_vector30 (pic);
+      count = program30_rows (pic, pgm, 0, prog_len, false,
+			      erased & region_pgm);
+    }
+    if (count < 0)
+      return -count;
+    cout << "\r " << count << " location" << (count != 1 ? "s" : "") << "," << endl;
+  }
 
-  signal (SIGTERM, save_t);
-  signal (SIGQUIT, save_q);
-  signal (SIGINT, save_i);
-  if (got_signal) {
-    cerr << "Exiting." << endl;
-    return EX_UNAVAILABLE;
+  if (rom == deviceinfo [dev].data_type || 0 == data_len) {
+    cout << "skipped burning data memory," << endl;
+  } else {
+    cout << "burning data memory," << flush;
+    pic.phase (picport::ph_data);
+    count = program30_rows (pic, data, region_base (region_data), data_len,
+			    true, erased & region_data);
+    if (count < 0)
+      return -count;
+    cout << "\r " << count << " location" << (count != 1 ? "s" : "") << "," << endl;
+  }
+
+  // The executive verified program memory already.
+  cout << "verifying," << flush;
+  unsigned long errors = 0;
+  if (!pe_done && pgm.defined_end (0, prog_len)) {
+    pic.phase (picport::ph_pgm);
+    vector<short> rb (prog_len);
+    int e = read30 (pic, &rb [0], 0, prog_len, &pgm);
+    if (EX_OK != e)
+      return e;
+    errors += compare_image ("program memory", 0, pgm, &rb [0], prog_len, -1);
   }
+  if (data_len && data.defined_end (0, data_len)) {
+    pic.phase (picport::ph_data);
+    vector<short> rb (data_len);
+    int e = read30 (pic, &rb [0], region_base (region_data), data_len, &data);
+    if (EX_OK != e)
+      return e;
+    errors += compare_image ("data memory", region_base (region_data),
+			     data, &rb [0], data_len, 0xff);
+  }
+  if (errors) {
+    cerr << errors << " location" << (errors != 1 ? "s" : "")
+	 << " failed verification." << endl;
+    return EX_IOERR;
+  }
+  cout << " ok," << endl;
 
+  cout << "burning fuses," << flush;
+  pic.phase (picport::ph_conf);
+  count = program30_conf (pic);
+  if (count < 0)
+    return -count;
+  cout << " " << count << " location" << (count != 1 ? "s" : "") << "," << endl;
+  cout << "done." << endl;
   return EX_OK;
 }
 
+// Read back the locations defined in the image and compare them with
+// it.  Nothing is written to the chip.  Calibration words are skipped
+// unless nopreserve is set.
 
 int
-hexfile::read_code (picport &pic, short *pgmp, unsigned long addr, unsigned long len)
+hexfile::verify_selected (picport &pic, bool nopreserve)
 {
-	int c=0,j;
-	uint16_t *pnt;
-  time_t tv1 = time(0);
-  // 14 bit and 12 bit parts must make sure the address
-  // is correct before calling this function.
-  if (16 == deviceinfo [dev].prog_bits)
-    pic.setaddress (addr);
-  unsigned long i = 0;
-  while(1) {
-    assert (pic.address () == addr + i);
+  term_signals catcher;
 
-    time_t tv2 = time(0);
-    if (tv2 >= tv1 + 2) {
-      tv1 = tv2;
-      cerr << "\r" << hex << setfill('0') << setw(4) << pic.address () << dec
-	   << "                           \r";
-    }
+  unsigned long prog_len = region_size (region_pgm);
+  unsigned ids_len = region_size (region_ids);
+  unsigned conf_len = deviceinfo [dev].conf_size;
+  image id_words = ids;
+  unsigned long errors = 0, base;
+  int e;
+
+  if (!nopreserve) {
+    prog_len -= deviceinfo [dev].prog_preserved;
+    // 12f508/12f509 backup osccal is read with the ids.
+    if (12 == deviceinfo [dev].prog_bits)
+      ids_len = 4;
+  }
+  if (stamp_on && (selected & region_ids)) {
+    short stamp [8];
+    int n = stamp_ids (stamp);
+    for (int i = 0; i < n; ++i)
+      id_words.set (i, stamp [i]);
+  }
+
+  if (deviceinfo [dev].prog_bits == 12) {
+    // 12f508/509 reset to configuration word.
+    if (pic.address () != 0xfff && pic.address () != 0)
+      pic.reset (0xfff);
+    // We need to step them to address 0.
+    if (pic.address () == 0xfff)
+      pic.command (picport::inc_addr, addr_max);
+  } else {
+    if (pic.address ())
+      pic.reset (0);
+  }
+
+  if (pgm.defined_end (0, prog_len)) {
+    cout << "Verifying program memory," << endl;
+    pic.phase (picport::ph_pgm);
+    vector<short> rb (prog_len, -1);
+    e = read_code (pic, &rb [0], 0, prog_len, &pgm);
+    if (EX_OK != e)
+      return e;
+    errors += compare_image ("program memory", 0, pgm, &rb [0], prog_len,
+			     -1);
+  }
+
+  if (region_size (region_data)
+      && data.defined_end (0, deviceinfo [dev].data_size)) {
+    cout << "verifying data memory," << endl;
+    pic.phase (picport::ph_data);
+    vector<short> rb (deviceinfo [dev].data_size, -1);
+    // 14 bit data memory address runs along with the program counter.
+    if (14 == deviceinfo [dev].prog_bits)
+      while (pic.address () % deviceinfo [dev].data_size)
+	pic.command (picport::inc_addr, 0, False);
+    e = read_data (pic, &rb [0], &data);
+    if (EX_OK != e)
+      return e;
+    errors += compare_image ("data memory", region_base (region_data),
+			     data, &rb [0], deviceinfo [dev].data_size, 0xff);
+  }
 
+  if (id_words.defined_end (0, ids_len)) {
+    cout << "verifying id words," << endl;
+    pic.phase (picport::ph_ids);
+    short rb_ids [8];
+    base = region_base (region_ids);
     if (16 == deviceinfo [dev].prog_bits) {
-    	pic.command18 (picport::tread_inc,0, False);
-//      pgmp [i] = *pic.execute();
-    }
-    else if (12 == deviceinfo [dev].prog_bits) {
-    	pic.command (picport::data_from_prog,0, False);
-//      pgmp [i] = *pic.execute() & 0xfff;
-      pic.command (picport::inc_addr, addr_max, False);
-    } else { // 14 bit
-    	pic.command (picport::data_from_prog,0, False);
-//     pgmp [i] = *pic.execute();
-      pic.command (picport::inc_addr,0, False);
-    }
-    c++;
+      // Enable access to program memory.
+      pic.command18 (picport::instr, 0x8ea6);
+      pic.command18 (picport::instr, 0x9ca6);
+    } else
+      seek (pic, base);
+    e = read_code (pic, rb_ids, base, ids_len, &id_words);
+    if (EX_OK != e)
+      return e;
+    errors += compare_image ("id words", base, id_words, rb_ids, ids_len, -1);
+  }
 
-    if(c==10 || i == (len-1)){
-    	pnt = pic.execute();
-    	for(j=i-(c-1);j<=i;j++){
-    		if (12 == deviceinfo [dev].prog_bits)
-    			pgmp [j] = *pnt & 0xfff;
-    		else
-    			pgmp [j] = *pnt;
-    		pnt++;
-    		if (-1 == pgmp [j]) {
-    			cerr << hex << setfill ('0') << setw (4) << addr + j << dec	<< ":unable to read pic" << endl;
-    			return EX_IOERR;
-    		}
+  if (conf.defined_end (0, conf_len)) {
+    cout << "verifying fuses," << endl;
+    pic.phase (picport::ph_conf);
+    short rb_conf [16];
+    base = region_base (region_conf);
+    if (12 == deviceinfo [dev].prog_bits)
+      // Only reset allows us to access the config word.
+      pic.reset (0xfff);
+    else if (14 == deviceinfo [dev].prog_bits)
+      seek (pic, base);
+    e = read_code (pic, rb_conf, base, conf_len, &conf);
+    if (EX_OK != e)
+      return e;
+    // Calibration bits are not part of the image.
+    if (deviceinfo [dev].config_mask && !nopreserve)
+      rb_conf [0] = (rb_conf [0] & ~deviceinfo [dev].config_mask)
+	| (conf [0] & deviceinfo [dev].config_mask);
+    unsigned long conf_errors =
+      compare_image ("fuses", base, conf, rb_conf, conf_len, -1);
+    if (conf_errors && 16 == deviceinfo [dev].prog_bits)
+      cerr << "Configuration bytes often have hardwired bits and do not" << endl
+	   << "verify, so these differences are ignored." << endl;
+    else
+      errors += conf_errors;
+  }
+  pic.phase (picport::ph_setup);
 
-    	}
-    	c=0;
-    }
+  if (got_signal) {
+    cerr << "Exiting." << endl;
+    return EX_UNAVAILABLE;
+  }
 
-    if (got_signal) {
-      cerr << "Exiting." << endl;
-      return EX_UNAVAILABLE;
-    }
-    i++;
-    if(i == len)
-    	break;
+  if (errors) {
+    cerr << errors << " location" << (errors != 1 ? "s" : "")
+	 << " failed verification." << endl;
+    return EX_DATAERR;
   }
+  cout << "done, chip matches the image." << endl;
   return EX_OK;
 }
 
+// Read len words at addr in chunks, and stop at the first one that is
+// not erased.  Used code usually starts at the reset vector, so the
+// first chunk is small, and they double up to several full frames.
 
 int
-hexfile::read (picport &pic)
+hexfile::blank_region (picport &pic, const char *what, unsigned long addr, unsigned long len)
 {
+  const unsigned long max_chunk = 1024;
+  image blank;
+  blank.assign (min (max_chunk, len), true);
+  for (unsigned long i = 0; i < blank.size (); ++i)
+    blank.set (i, erased_value (false));
+  vector<short> rb (blank.size ());
+
+  // dspic30 phantom bytes read as zero.
+  if (24 == deviceinfo [dev].prog_bits && addr < region_size (region_pgm))
+    for (unsigned long i = 3 - addr % 4; i < blank.size (); i += 4)
+      blank.set (i, 0);
+
+  for (unsigned long a = 0, chunk = 64; a < len;
+       a += chunk, chunk = min (2 * chunk, max_chunk)) {
+    unsigned long n = min (chunk, len - a);
+    int e = read_code (pic, &rb [0], addr + a, n);
+    if (EX_OK != e)
+      return e;
+    unsigned long i = first_difference (blank, &rb [0], 0, n, -1);
+    if (i < n) {
+      cout << what << " 0x" << hex << setfill ('0') << setw (4) << addr + a + i
+	   << " is 0x" << setw (4) << rb [i] << dec << ", device is not blank."
+	   << endl;
+      return EX_DATAERR;
+    }
+  }
+  return EX_OK;
+}
 
-  sig_type save_t, save_q, save_i;
-  save_t = signal (SIGTERM, term_handler);
-  save_q = signal (SIGQUIT, term_handler);
-  save_i = signal (SIGINT, term_handler);
+// Tell if the chip is erased: program memory, data memory, id words
+// and fuses, in this order, stopping at the first word that is not.
+// Calibration words are skipped.
 
-  cout << "Device " << deviceinfo [dev].name
-       << ", program memory: " << deviceinfo [dev].prog_size;
-  if (rom == deviceinfo [dev].prog_type && deviceinfo [dev].prog_size)
-    cout << " (rom)";
-  cout << ", data memory: " << deviceinfo [dev].data_size;
-  if (rom == deviceinfo [dev].data_type && deviceinfo [dev].data_size)
-    cout << " (rom)";
-  cout << "." << endl;
+int
+hexfile::blank_check (picport &pic)
+{
+  term_signals catcher;
 
   int e;
+  int bits = deviceinfo [dev].prog_bits;
+  unsigned long first, end, base;
 
   if (deviceinfo [dev].prog_bits == 12) {
     // 12f508/509 reset to configuration word.
@@ -1670,109 +3547,333 @@ hexfile::read (picport &pic)
     if (pic.address ())
       pic.reset (0);
   }
-  if (0 == deviceinfo [dev].prog_size) {
-    cout << "Skipped reading program memory," << endl;
-  } else {
-    cout << "Reading program memory," << endl;
-    e = read_code (pic, pgm, 0, deviceinfo [dev].prog_size);
+
+  if (rom != deviceinfo [dev].prog_type && span (region_pgm, first, end)) {
+    end = min (end, region_size (region_pgm) - deviceinfo [dev].prog_preserved);
+    cout << "Checking program memory," << endl;
+    pic.phase (picport::ph_pgm);
+    if (16 > bits)
+      seek (pic, first);
+    e = blank_region (pic, "program memory", first, end > first ? end - first : 0);
     if (EX_OK != e)
       return e;
   }
 
-  if (0 == deviceinfo [dev].data_size) {
-    cout << "skipped reading data memory," << endl;
-  } else {
-    cout << "reading data memory," << endl;
-    if (16 == deviceinfo [dev].prog_bits) {
-      // Direct access to data EEPROM.
-      pic.command18 (picport::instr, 0x9ea6);
+  if (rom != deviceinfo [dev].data_type && span (region_data, first, end)) {
+    cout << "checking data memory," << endl;
+    pic.phase (picport::ph_data);
+    image want;
+    want.assign (deviceinfo [dev].data_size, false);
+    for (unsigned long i = first; i < end; ++i)
+      want.set (i, 0xff);
+    vector<short> rb (want.size ());
+    // 14 bit data memory address runs along with the program counter.
+    if (14 == bits)
+      while (pic.address () % deviceinfo [dev].data_size)
+	pic.command (picport::inc_addr, 0, False);
+    e = read_data (pic, &rb [0], &want);
+    if (EX_OK != e)
+      return e;
+    unsigned long i = first_difference (want, &rb [0], 0, rb.size (), 0xff);
+    if (i < rb.size ()) {
+      cout << "data memory 0x" << hex << setfill ('0') << setw (4)
+	   << region_base (region_data) + i
+	   << " is 0x" << setw (2) << rb [i] << dec << ", device is not blank."
+	   << endl;
+      return EX_DATAERR;
+    }
+  }
+
+  if (span (region_ids, first, end)) {
+    // The 12 bit backup osccal word after the ids is not checked.
+    if (12 == bits)
+      end = min (end, 4UL);
+    cout << "checking id words," << endl;
+    pic.phase (picport::ph_ids);
+    base = region_base (region_ids);
+    if (16 == bits) {
+      // Enable access to program memory.
+      pic.command18 (picport::instr, 0x8ea6);
       pic.command18 (picport::instr, 0x9ca6);
+    } else
+      seek (pic, base + first);
+    e = blank_region (pic, "id word", base + first, end > first ? end - first : 0);
+    if (EX_OK != e)
+      return e;
+  }
+
+  // Erased PIC18 and dspic30 configuration bytes hold their default
+  // values, which vary from part to part.
+  if (16 <= bits)
+    cout << "fuses not checked," << endl;
+  else if (span (region_conf, first, end)) {
+    cout << "checking fuses," << endl;
+    pic.phase (picport::ph_conf);
+    short rb [16] = { 0 };
+    image blank;
+    blank.assign (16, true);
+    base = region_base (region_conf);
+    if (12 == bits)
+      // Only reset allows us to access the config word.
+      pic.reset (0xfff);
+    else
+      seek (pic, base + first);
+    e = read_code (pic, rb + first, base + first, end - first);
+    if (EX_OK != e)
+      return e;
+    for (unsigned long i = first; i < end; ++i)
+      blank.set (i, erased_value (false));
+    // Calibration bits stay programmed.
+    rb [0] |= deviceinfo [dev].config_mask;
+    unsigned long i = first_difference (blank, rb, 0, end, -1);
+    if (i < end) {
+      cout << "fuses 0x" << hex << setfill ('0') << setw (4) << base + i
+	   << " is 0x" << setw (4) << rb [i] << dec << ", device is not blank."
+	   << endl;
+      return EX_DATAERR;
     }
-    for (unsigned long addr = 0;
-	 addr < deviceinfo [dev].data_size;
-	 ++addr) {
-      if (16 == deviceinfo [dev].prog_bits) {
-	// Set the data EEPROM address pointer.
-	pic.command18 (picport::instr, 0x0e00 | (addr & 0x00ff));
-	pic.command18 (picport::instr, 0x6ea9);
-	pic.command18 (picport::instr, 0x0e00 | ((addr & 0xff00) >> 8));
-	pic.command18 (picport::instr, 0x6eaa);
-	// Initiate a memory read.
-	pic.command18 (picport::instr, 0x80a6);
-	// Load data into the serial data holding register.
-	pic.command18 (picport::instr, 0x50a8);
-	pic.command18 (picport::instr, 0x6ef5);
-
-	data [addr] = pic.command18 (picport::shift_out);
-      } else if (12 == deviceinfo [dev].prog_bits) {
-	cerr << "12 bit microcontroller data memory unimplemented." << endl;
-	got_signal = 1;
-      } else { // 14 bit
-	assert (addr == pic.address () % deviceinfo [dev].data_size);
+  }
+  pic.phase (picport::ph_setup);
 
-	data [addr] = pic.command (picport::data_from_data);
-	pic.command (picport::inc_addr);
-      }
-      if (-1 == data [addr]) {
-	cerr << pic.port() << ':' << hex << setfill ('0') << setw (4)
-	     << addr << dec
-	     << ":unable to read pic data memory" << endl;
-	return EX_IOERR;
+  if (got_signal) {
+    cerr << "Exiting." << endl;
+    return EX_UNAVAILABLE;
+  }
+
+  cout << "done, device is blank." << endl;
+  return EX_OK;
+}
+
+// Image cache for incremental reprogramming.  The cache holds the
+// last image written to a board, one file per device type and board
+// tag.  Before it is trusted, a few locations are read off the chip
+// and compared with it.  Data memory is always read, as the firmware
+// can change it.  The program words it keeps from being written are
+// read back before the fuses are burned.
+
+int
+hexfile::use_cache (picport &pic, const char *dir, const char *tag)
+{
+  if (dev < 0) {
+    cerr << "Internal error: no device defined" << endl;
+    return EX_SOFTWARE;
+  }
+  if (24 == deviceinfo [dev].prog_bits)
+    return EX_OK; // no image cache for dspic30
+
+  if (mkdir (dir, 0777) && EEXIST != errno) {
+    int e = errno;
+    cerr << dir << ":unable to create cache directory:" << strerror (e)
+	 << endl;
+    return EX_CANTCREAT;
+  }
+  cache_name = string (dir) + "/" + deviceinfo [dev].name + "-" + tag + ".hex";
+
+  if (known)
+    delete known;
+  known = 0;
+  if (access (cache_name.c_str (), R_OK))
+    return EX_OK;
+
+  hexfile *cached = new hexfile;
+  int d = dev;
+  if (EX_OK != cached->setdevice (pic, d)
+      || EX_OK != cached->load (cache_name.c_str ())) {
+    delete cached;
+    cout << "Cached image " << cache_name << " not usable." << endl;
+    return EX_OK;
+  }
+  known = cached;
+  if (!cache_matches (pic)) {
+    delete known;
+    known = 0;
+    cout << "Cached image " << cache_name
+	 << " does not match the chip, not used." << endl;
+    return EX_OK;
+  }
+  cout << "Cached image " << cache_name
+       << " matches the chip, writing only changes." << endl;
+  return EX_OK;
+}
+
+// Fingerprint check of the cached image: id words and a sample of
+// program memory are read in packed frames and compared with it.
+
+bool
+hexfile::cache_matches (picport &pic)
+{
+  const int samples = 16;
+  vector<int> tickets;
+  vector<short> expected;
+  unsigned long a;
+
+  if (16 == deviceinfo [dev].prog_bits) {
+    // Enable access to program memory.
+    pic.command18 (picport::instr, 0x8ea6);
+    pic.command18 (picport::instr, 0x9ca6);
+    pic.setaddress (0x200000);
+    for (a = 0; a < 8; ++a) {
+      int ticket = pic.command18 (picport::tread_inc, 0, False);
+      if (-1 != known->ids [a]) {
+	tickets.push_back (ticket);
+	expected.push_back (known->ids [a]);
       }
-      if (got_signal) {
-	cerr << "Exiting." << endl;
-	return EX_UNAVAILABLE;
+    }
+    // Samples spread over the whole program memory.
+    unsigned long step = deviceinfo [dev].prog_size / samples;
+    for (int k = 0; k < samples; ++k) {
+      for (a = k * step; a < (k + 1) * step; ++a)
+	if (-1 != known->pgm [a])
+	  break;
+      if (a == (k + 1) * step)
+	continue;
+      pic.setaddress (a);
+      tickets.push_back (pic.command18 (picport::tread, 0, False));
+      expected.push_back (known->pgm [a]);
+    }
+  } else {
+    if (14 == deviceinfo [dev].prog_bits) {
+      pic.command (picport::load_conf, 0);
+      for (a = 0; a < 4; ++a) {
+	if (-1 != known->ids [a]) {
+	  tickets.push_back (pic.command (picport::data_from_prog, 0, False));
+	  expected.push_back (known->ids [a]);
+	}
+	pic.command (picport::inc_addr);
       }
+      pic.reset (0);
+    } else {
+      // 12f508/509 reset to configuration word.
+      pic.reset (0xfff);
+      pic.command (picport::inc_addr, addr_max);
+    }
+    // Samples spread over the whole program memory, reached with
+    // queued increments.
+    unsigned long step = max (1UL, deviceinfo [dev].prog_size / samples);
+    for (unsigned long b = 0; b < deviceinfo [dev].prog_size; b += step) {
+      unsigned long end = min (b + step, deviceinfo [dev].prog_size);
+      a = known->pgm.next_defined (b, end);
+      if (a == end)
+	continue;
+      seek (pic, a);
+      tickets.push_back (pic.command (picport::data_from_prog, 0, False));
+      expected.push_back (known->pgm [a]);
     }
   }
 
-  cout << "reading id words," << endl;
-  if (24 == deviceinfo [dev].prog_bits) {
-    // no ids in dspic30
-    e = EX_OK;
-  } else if (16 == deviceinfo [dev].prog_bits) {
-    e = read_code (pic, ids, 0x200000, 8);
-  } else if (12 == deviceinfo [dev].prog_bits) {
-    while (pic.address () != deviceinfo [dev].prog_size)
-      pic.command (picport::inc_addr, addr_max);
-    // 12f508/12f509 backup osccal is included in ids
-    e = read_code (pic, ids, deviceinfo [dev].prog_size, 5);
-  } else {
-    pic.command (picport::load_conf, 0);
-    e = read_code (pic, ids, 0x2000, 4);
+  bool match = !expected.empty ();
+  for (unsigned long i = 0; match && i < expected.size (); ++i) {
+    int value = pic.result (tickets [i]);
+    if (12 == deviceinfo [dev].prog_bits)
+      value &= 0xfff;
+    match = value == expected [i];
   }
-  if (EX_OK != e)
-    return e;
+  pic.forget_results ();
+  return match;
+}
 
-  // fuses
-  cout << "reading fuses," << endl;
-  if (24 == deviceinfo [dev].prog_bits) {
-    e = read_code (pic, conf, 0xf80000, deviceinfo [dev].conf_size);
-  } else if (16 == deviceinfo [dev].prog_bits) {
-    e = read_code (pic, conf, 0x300000, deviceinfo [dev].conf_size);
+// Read back the program words that were not written because the
+// cache holds them, so that a stale cache that passed the sample in
+// cache_matches () does not leave a wrong chip.  The id words were
+// all read there.
+
+int
+hexfile::verify_cached (picport &pic)
+{
+  const unsigned long len = deviceinfo [dev].prog_size;
+  image skipped;
+
+  skipped.assign (len, 16 > deviceinfo [dev].prog_bits);
+  for (unsigned long i = pgm.next_defined (0, len); i < len;
+       i = pgm.next_defined (i + 1, len))
+    if (known->pgm [i] == pgm [i])
+      skipped.set (i, pgm [i]);
+  unsigned long end = skipped.defined_end (0, len);
+  if (!end)
+    return EX_OK;
+
+  cout << "verifying cached words," << flush;
+  pic.phase (picport::ph_pgm);
+  if (16 == deviceinfo [dev].prog_bits) {
+    // Enable access to program memory.
+    pic.command18 (picport::instr, 0x8ea6);
+    pic.command18 (picport::instr, 0x9ca6);
   } else if (12 == deviceinfo [dev].prog_bits) {
-    // Only reset allows us to access the config word.
+    // 12f508/509 reset to configuration word.
     pic.reset (0xfff);
-    e = read_code (pic, conf, 0xfff, deviceinfo [dev].conf_size);
-  } else {
-    pic.command (picport::inc_addr);
-    pic.command (picport::inc_addr);
-    pic.command (picport::inc_addr);
-    e = read_code (pic, conf, 0x2007, deviceinfo [dev].conf_size);
-  }
+    pic.command (picport::inc_addr, addr_max);
+  } else
+    pic.reset (0);
+  vector<short> rb (end, -1);
+  int e = read_code (pic, &rb [0], 0, end, &skipped);
   if (EX_OK != e)
     return e;
-  cout << "done." << endl;
+  unsigned long errors = compare_image ("program memory", 0, skipped,
+					&rb [0], end, -1);
+  if (errors) {
+    cerr << errors << " location" << (errors != 1 ? "s" : "")
+	 << " not as in the image cache " << cache_name
+	 << ", program with --erase." << endl;
+    return EX_IOERR;
+  }
+  cout << " ok," << endl;
+  return EX_OK;
+}
 
-  signal (SIGTERM, save_t);
-  signal (SIGQUIT, save_q);
-  signal (SIGINT, save_i);
-  if (got_signal) {
-    cerr << "Exiting." << endl;
-    return EX_UNAVAILABLE;
+// Store the image now on the chip.  Locations not in the input file
+// keep their cached values, unless the chip was erased.
+
+int
+hexfile::save_cache (picport &pic, bool reset)
+{
+  if (!known || reset) {
+    if (known)
+      delete known;
+    known = new hexfile;
+    int d = dev;
+    known->setdevice (pic, d);
   }
+  known->pgm.merge (pgm);
+  known->data.merge (data);
+  known->ids.merge (ids);
+  known->conf.merge (conf);
+  return known->save (cache_name.c_str (), unknown, false);
+}
 
-  return EX_OK;
+// Read the device id of the chip the way this device keeps it, and
+// start the chip over from reset.  -1 if it cannot be read.
+
+int
+hexfile::read_id (picport &pic)
+{
+  int value = -1;
+
+  switch (deviceinfo [dev].prog_bits) {
+  case 14:
+    pic.command (picport::load_conf, 0);
+    for (int i = 0; i < 6; ++i)
+      pic.command (picport::inc_addr);
+    value = pic.command (picport::data_from_prog);
+    break;
+  case 16: {
+    // Enable access to program memory.
+    pic.command18 (picport::instr, 0x8ea6);
+    pic.command18 (picport::instr, 0x9ca6);
+    pic.setaddress (0x3ffffe);
+    value = pic.command18 (picport::tread_inc, 0);
+    int v1 = pic.command18 (picport::tread, 0);
+    value = -1 == value || -1 == v1 ? -1 : value | v1 << 8;
+    break;
+  }
+  case 24: {
+    short b [2];
+    if (EX_OK == read30 (pic, b, 0xff0000, 2))
+      value = b [1] << 8 | b [0];
+    break;
+  }
+  }
+  pic.reset (0);
+  return value;
 }
 
 int
@@ -1913,40 +4014,16 @@ hexfile::setdevice (picport &pic, int& d)
     return EX_SOFTWARE;
   };
   dev = d;
+  erased = 0;
 
-  if (pgm)
-    delete [] pgm;
-  if (data)
-    delete [] data;
-  pgm = data = 0;
-  if (deviceinfo [dev].prog_size) {
-    pgm = new short [deviceinfo [dev].prog_size];
-    if (!pgm) {
-      cerr << "Out of memory, trying to allocate "
-	   << deviceinfo [dev].prog_size * sizeof (short)
-	   << " bytes" << endl;
-      return EX_UNAVAILABLE;
-    }
-  }
-  if (deviceinfo [dev].data_size) {
-    data = new short [deviceinfo [dev].data_size];
-    if (!data) {
-      cerr << "Out of memory, trying to allocate "
-	   << deviceinfo [dev].data_size * sizeof (short)
-	   << " bytes" << endl;
-      return EX_UNAVAILABLE;
-    }
-  }
-  unsigned long i;
-  for (i = 0; i < deviceinfo [dev].prog_size; ++i)
-    pgm [i] = -1;
-  for (i = 0; i < deviceinfo [dev].data_size; ++i)
-    data [i] = -1;
+  // PIC18 and dspic30 memories are bytes, 12 and 14 bit parts have
+  // words but for data memory.
+  bool wide = 16 > deviceinfo [dev].prog_bits;
+  pgm.assign (region_size (region_pgm), wide);
+  data.assign (deviceinfo [dev].data_size, false);
   assert (deviceinfo [dev].conf_size <= 16);
-  for (i = 0; i < 16; ++i)
-    conf [i] = -1;
-  for (i = 0; i < 8; ++i)
-    ids [i] = -1;
+  conf.assign (16, wide);
+  ids.assign (8, wide);
   if (deviceinfo [dev].prog_bits == 12) // 12f508 12f509
     addr_max = deviceinfo [dev].prog_size * 2;
   else
@@ -1955,6 +4032,24 @@ hexfile::setdevice (picport &pic, int& d)
   return EX_OK;
 }
 
+// Take the image loaded into src, for programming the same image
+// into several chips.  Both must be set to the same device.
+
+int
+hexfile::copy_image (const hexfile &src)
+{
+  if (dev < 0 || dev != src.dev) {
+    cerr << "Internal error: image is for a different device" << endl;
+    return EX_SOFTWARE;
+  }
+  pgm = src.pgm;
+  data = src.data;
+  conf = src.conf;
+  ids = src.ids;
+  image_hash = src.image_hash;
+  return EX_OK;
+}
+
 // Couple of statics in hexfile class.
 
 int
@@ -44,18 +44,73 @@ make sure your email passes my spam filtering.
 #define H_HEXFILE
 
 #include <fstream>
+#include <string>
+#include <vector>
 using namespace std;
 
 #include "picport.h"
 
+class output_text;
+
+// Memory image: a value for each location, and a bitmap of the
+// locations that are defined.  Memories of bytes keep their values in
+// bytes.  Runs of defined locations are found 64 at a time from the
+// bitmap.
+
+class image {
+  vector<unsigned char> bytes;
+  vector<unsigned short> words;
+  vector<unsigned long long> bits;
+  unsigned long len;
+  bool wide;
+
+public:
+  image () : len (0), wide (false) {}
+
+  // n undefined locations, of 16 bits if wide_values is set.
+  void assign (unsigned long n, bool wide_values);
+  unsigned long size () const { return len; }
+
+  bool defined (unsigned long i) const {
+    return bits [i / 64] >> (i % 64) & 1;
+  }
+  // The value at i, -1 if it is undefined.
+  int operator [] (unsigned long i) const {
+    return !defined (i) ? -1 : wide ? words [i] : bytes [i];
+  }
+  // Set the value at i, or make it undefined with -1.
+  void set (unsigned long i, int value);
+  // Make [begin, end) undefined.
+  void erase (unsigned long begin, unsigned long end);
+  // Take [begin, end) from src.
+  void copy (const image &src, unsigned long begin, unsigned long end);
+  // Take the locations src defines.
+  void merge (const image &src);
+
+  // First defined, or undefined, location from i on, before end.
+  // end if there is none.
+  unsigned long next_defined (unsigned long i, unsigned long end) const;
+  unsigned long next_undefined (unsigned long i, unsigned long end) const;
+  // One past the last defined location in [begin, end), begin if
+  // there is none.
+  unsigned long defined_end (unsigned long begin, unsigned long end) const;
+};
+
 class hexfile {
 
+  // The emulator simulates chips from the device table.
+  friend class emulator;
+  friend class emu_target;
+
   // pic16 family: program size is counted in words.
   // pic18 family: program memory size is counted in bytes.
-  short *pgm;
-  short *data;
-  short conf [16];
-  short ids  [8];
+  // dspic30 family: program memory size is counted in bytes, three
+  // per instruction.
+  // Data memory is counted in bytes.
+  image pgm;
+  image data;
+  image conf;
+  image ids;
 
   // Return code used in program_location () to indicate that the
   // location already was programmed to specified value.
@@ -63,8 +118,16 @@ class hexfile {
 
   void reset_code_protection (picport& pic);
   int program_location (picport& pic, unsigned long addr, short word, bool isdata) const;
-  bool verify18 (picport& pic, const short *pgmp, unsigned long addr, unsigned long len, unsigned long panel_size, bool verbose) const;
-  int program18 (picport& pic, const short *pgmp, unsigned long addr, unsigned long len, unsigned long panel_size) const;
+  int program_cycle (picport& pic, unsigned long addr) const;
+  int program_bulk (picport& pic, const image &img, unsigned long addr, unsigned long len, bool isdata) const;
+  int verify_bulk (picport& pic, const image &img, unsigned long addr, unsigned long len, bool isdata) const;
+  bool verify18 (picport& pic, const image &img, unsigned long first, unsigned long addr, unsigned long len, unsigned long panel_size, bool verbose) const;
+  int program18 (picport& pic, const image &img, unsigned long first, unsigned long addr, unsigned long len, unsigned long panel_size) const;
+  int read30 (picport& pic, short *pgmp, unsigned long addr, unsigned long len, const image *want = 0) const;
+  int program30_rows (picport& pic, const image &img, unsigned long addr, unsigned long len, bool isdata, bool blank) const;
+  int program30_conf (picport& pic) const;
+  int program30_pe (picport& pic, int &count);
+  int program30 (picport& pic);
 
 public:
   enum formats { unknown, ihx8m, ihx16, ihx32 };
@@ -73,13 +136,76 @@ public:
 		  flash30,
 		  eeprom, eprom, eprom18, prom, rom};
 
+  // Memory regions, for erase tracking and for selecting what is
+  // read and programmed.
+  enum regions { region_pgm = 1, region_data = 2, region_ids = 4, region_conf = 8,
+		 region_all = 15 };
+
 private:
   int dev;
   int addr_max; // Used in inc_addr command for 12f only
 
-  void save_line (ofstream& f, const short *pgmp, unsigned long begin, unsigned long len, enum formats format) const;
-  int save_region (ofstream& f, const short *pgmp, unsigned long addr0, unsigned long len0, enum formats format, bool skip_ones, unsigned long &addr32) const;
-  int read_code (picport &pic, short *pgmp, unsigned long addr, unsigned long len);
+  // Program word by word with read-before-write even after the
+  // chip has been erased, instead of bulk writes and a verify pass.
+  bool safe_mode;
+
+  // Memory regions known erased by reset_code_protection ().
+  int erased;
+
+  int region_of (unsigned long addr, bool isdata) const;
+  int erased_value (bool isdata) const;
+
+  // What select () limits reading and programming to: a mask of
+  // regions, and an inclusive range of device addresses.
+  int selected;
+  unsigned long range_lo, range_hi;
+
+  // Data bytes in each record save () writes.
+  unsigned record_len;
+
+  // dspic30 programming executive given with load_executive (), empty
+  // if none.  Its image is executive memory, 736 instructions at
+  // 0x800000, as they are in the hex file.  load () reads into it
+  // while loading_executive is set.
+  enum { exec_base = 0x1000000, exec_len = 736 * 4 };
+  image executive;
+  bool loading_executive;
+
+  unsigned long region_base (int region) const;
+  unsigned long region_size (int region) const;
+  bool span (int region, unsigned long &first, unsigned long &end) const;
+  void restrict_image ();
+  void unrestrict_image ();
+  image dropped [4];
+  int program_selected (picport &pic, bool erase, bool nopreserve);
+  int verify_selected (picport &pic, bool nopreserve);
+  void seek (picport &pic, unsigned long addr);
+
+  // Image last written to this board, read from the cache and
+  // trusted after a fingerprint check.  0 if there is none.
+  hexfile *known;
+  string cache_name;
+
+  // Hash of the loaded image, stamped into the id words on request
+  // to tell later whether the chip already holds this image.
+  unsigned long long image_hash;
+  bool stamp_on, skip_current;
+
+  void hash_image ();
+  int stamp_ids (short *dst) const;
+  bool is_current (picport &pic);
+
+  int location (unsigned long addr, bool isdata) const;
+  int known_value (unsigned long addr, bool isdata) const;
+  bool cache_matches (picport &pic);
+  int verify_cached (picport &pic);
+  int save_cache (picport &pic, bool reset);
+
+  void save_line (output_text &f, const image &img, unsigned long i, unsigned long begin, unsigned long len, enum formats format) const;
+  int save_region (output_text &f, const image &img, unsigned long addr0, unsigned long len0, enum formats format, bool skip_ones, unsigned long &addr32) const;
+  int read_code (picport &pic, short *pgmp, unsigned long addr, unsigned long len, const image *want = 0);
+  int read_data (picport &pic, short *dst, const image *want);
+  int blank_region (picport &pic, const char *what, unsigned long addr, unsigned long len);
 
   struct devinf {
     const char *name;
@@ -101,10 +227,9 @@ private:
     int panel_size;
 
     // How many bytes/words to write at one programming command (18f).
-    // 0 means unknown for 14 bit series, 1 byte writes work.
-    // In the future maybe for 14 bit series multiword programming
-    // will also be implemented.  In that case, fill this field
-    // for them too.
+    // For 14 bit flash parts the number of program memory write
+    // latches, used when programming an erased chip.  0 means
+    // unknown, single word writes work.
     int write_size;
 
     enum memtypes prog_type;
@@ -118,26 +243,56 @@ private:
 
 public:
 
-  hexfile () : pgm(0), data(0), dev(-1), addr_max(0) {};
+  hexfile () : dev(-1), addr_max(0), safe_mode(false), erased(0),
+    selected(region_all), range_lo(0), range_hi(~0UL), record_len(16),
+    loading_executive(false), known(0),
+    image_hash(0), stamp_on(false), skip_current(false) {};
   ~hexfile () {
-    if (pgm)
-      delete [] pgm;
-    if (data)
-      delete [] data;
+    if (known)
+      delete known;
   }
 
   int setdevice (picport &pic, int& d);
 
   int load (const char *name);
+  int load_executive (const char *name);
+  int copy_image (const hexfile &src);
   int save (const char *name, enum formats format, bool skip_ones) const;
 
   int program (picport &pic, bool erase, bool nopreserve);
+  void safe (bool s) { safe_mode = s; }
+  int use_cache (picport &pic, const char *dir, const char *tag);
+  void stamp (bool s) { stamp_on = s; }
+  void skip_if_current (bool s) { skip_current = s; }
+  void select (int regions, unsigned long lo, unsigned long hi) {
+    selected = regions;
+    range_lo = lo;
+    range_hi = hi;
+  }
+  void record_length (unsigned n) { record_len = n; }
+  const char *device_name () const { return deviceinfo [dev].name; }
+  int device_id () const { return deviceinfo [dev].device_id; }
+  int read_id (picport &pic);
+  // Whether device id id reads like this device, as setdevice ()
+  // detects it.
+  bool same_id (int id) const {
+    int mask = 24 == deviceinfo [dev].prog_bits ? 0xffff
+      : 0xffe0 | (0x0010 & deviceinfo [dev].device_id);
+    return (deviceinfo [dev].device_id & mask) == (id & mask);
+  }
   int read (picport &pic);
+  int verify (picport &pic, bool nopreserve);
+  int blank_check (picport &pic);
 
 
   // statics
 
   static int find_device (const char *name);
+  // Forget a signal an earlier job caught.
+  static void clear_signal ();
+  // Install the termination signal handlers once for threads that
+  // program in parallel, or put the old ones back.
+  static void hold_signals (bool hold);
   static void print_devices ();
 };
 
@@ -13,6 +13,18 @@
 #define STK_CMD_PREPARE_PROGMODE_ISCP           0x50
 #define STK_CMD_LEAVE_PROGMODE_ISCP             0x51
 #define STK_CMD_RUN_ISCP		            0x52
+#define STK_CMD_GET_CAPS_ISCP                   0x53
+
+// Reply to STK_CMD_GET_CAPS_ISCP, after the command and status bytes
+enum{
+cap_version=0,				//layout version, 1
+cap_cmd_max=1,				//+2 bytes (lo-hi) largest STK_CMD_RUN_ISCP message body
+cap_reply_max=3,			//+2 bytes (lo-hi) largest reply message body
+cap_clock_delay=5,			//p_param_clock_delay in use
+cap_clock_ns=6,				//+2 bytes (lo-hi) PGC period at clock delay 0
+cap_commands=8,				//+9 bytes, bit (c & 7) of byte c / 8 set if command c runs
+cap_size=17
+};
 
 
 //----------------list of commands--------------------
@@ -43,11 +55,14 @@ c_DelayUs=42,				//2a	+1 byte
 
 c_pic_send=50, 				//32	+1b(size bits) +1-4 bytes data (lo-hi)
 c_dspic_send_24=51,			//33	+3 bytes (lo -hi)
+c_pic_send_n=52,			//34	+1b(word count) +1b(bits per word) +1b(gap after each word, 5us units) +count*(1-4) bytes data (lo-hi)
+c_dspic_pe_send=53,			//35	+1b(word count) +count*2 bytes (lo-hi), each word clocked out MSB first to the dspic30 programming executive
 
 c_pic_read=60,				//3c
 c_pic_read_14_bits=61,		//3d
 c_pic_read_byte2=62,		//3e
 c_dspic_read_16_bits=63,	//3f
+c_dspic_pe_read=64,			//40	wait for the programming executive to pull PGD low, then clock in a word MSB first, 0xffff if it does not
 
 c_set_param=70				//46	+2 bytes - num param and value
 };
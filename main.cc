@@ -29,21 +29,30 @@ make sure your email passes my spam filtering.
 */
 
 #include <iostream>
+#include <fstream>
+#include <iomanip>
 #include <cstring>
 #include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <cerrno>
 
 #include <sysexits.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <pthread.h>
 
 #include "hexfile.h"
+#include "plan.h"
 #include "program.h"
+#include "daemon.h"
 
 using namespace std;
 
 program prog;
 
-char short_opts [] = "d:p:i:o:c:qh?";
+char short_opts [] = "d:p:i:o:c:b:K:s:D::C::S::O:R:L:P:E:X:qh?";
 
 static const char *
 getenv_default (const char *var, const char *def)
@@ -54,8 +63,418 @@ getenv_default (const char *var, const char *def)
   return def;
 }
 
-int
-main (int argc, char **argv)
+// How to burn the chip, set from the command line.
+struct burn_opts {
+  int erase;
+  int calibration;
+  int safe;
+  int stamp;
+  int skip_current;
+  const char *cache;
+  // dspic30 programming executive hex file, or NULL.
+  const char *executive;
+  // Memory regions and the address range the job is limited to.
+  int only;
+  unsigned long range_lo, range_hi;
+};
+
+// Print the protocol counters of the programmers to stderr, and
+// write them as JSON to file unless it is empty.  "-" is stdout.
+// Several programmers are written as a JSON array.
+
+static int
+report_stats (const vector<picport *> &pics, const char *file)
+{
+  for (unsigned i = 0; i < pics.size (); ++i) {
+    cerr << endl << pics [i]->port () << " statistics:" << endl;
+    pics [i]->print_stats (cerr);
+  }
+  if (!*file)
+    return EX_OK;
+
+  ofstream f;
+  ostream *o = &cout;
+  if (strcmp (file, "-")) {
+    f.open (file);
+    if (!f) {
+      cerr << file << ": " << strerror (errno) << endl;
+      return EX_CANTCREAT;
+    }
+    o = &f;
+  }
+  if (pics.size () > 1)
+    *o << "[";
+  for (unsigned i = 0; i < pics.size (); ++i) {
+    if (i)
+      *o << ",";
+    pics [i]->print_stats_json (*o);
+  }
+  if (pics.size () > 1)
+    *o << "]" << endl;
+  return EX_OK;
+}
+
+// Parse --only=code,eeprom,id,config into a mask of memory regions.
+// Returns -1 on an unknown name.
+
+static int
+parse_regions (const char *list)
+{
+  static const struct {
+    const char *name;
+    int region;
+  } names [] = {
+    {"code", hexfile::region_pgm},
+    {"eeprom", hexfile::region_data},
+    {"id", hexfile::region_ids},
+    {"config", hexfile::region_conf},
+  };
+  int mask = 0;
+
+  while (*list) {
+    size_t n = strcspn (list, ",");
+    unsigned i;
+    for (i = 0; i < sizeof (names) / sizeof (names [0]); ++i)
+      if (n == strlen (names [i].name) && !strncmp (list, names [i].name, n))
+	break;
+    if (i == sizeof (names) / sizeof (names [0])) {
+      cerr << "Unknown memory region in --only: " << list << endl;
+      return -1;
+    }
+    mask |= names [i].region;
+    list += n;
+    if (*list)
+      ++list;
+  }
+  return mask;
+}
+
+// Parse --range=first-last, inclusive device addresses in C syntax.
+
+static bool
+parse_range (const char *arg, unsigned long &lo, unsigned long &hi)
+{
+  char *end;
+
+  lo = strtoul (arg, &end, 0);
+  if (end == arg || '-' != *end)
+    return false;
+  arg = end + 1;
+  hi = strtoul (arg, &end, 0);
+  return end != arg && !*end && lo <= hi;
+}
+
+// Program the loaded image into the chip, using the image cache
+// under the given board tag if it is not NULL.
+
+static int
+burn (hexfile &mem, picport &pic, const burn_opts &o, const char *board)
+{
+  int retval;
+
+  mem.safe (o.safe);
+  mem.stamp (o.stamp);
+  mem.skip_if_current (o.skip_current);
+  mem.select (o.only, o.range_lo, o.range_hi);
+  if (o.executive
+      && EX_OK != (retval = mem.load_executive (o.executive)))
+    return retval;
+  if (board
+      && EX_OK != (retval = mem.use_cache (pic, o.cache, board)))
+    return retval;
+  return mem.program (pic, o.erase, o.calibration);
+}
+
+// Gang programming: one worker thread per programmer, each burning
+// its own copy of the image that was loaded once.
+
+struct gang_slot {
+  picport *pic;
+  string serial;
+  const hexfile *image;
+  int device;
+  const burn_opts *opts;
+  const char *board;
+  int retval;
+  pthread_t thread;
+};
+
+static void *
+gang_worker (void *arg)
+{
+  gang_slot *slot = (gang_slot *) arg;
+  hexfile mem;
+  int d = slot->device;
+  string tag;
+
+  // A programmer that fails fails its own slot only.
+  try {
+    if (EX_OK != (slot->retval = mem.setdevice (*slot->pic, d))
+	|| EX_OK != (slot->retval = mem.copy_image (*slot->image)))
+      return NULL;
+    if (slot->board)
+      tag = string (slot->board) + "-" + slot->serial;
+    slot->retval = burn (mem, *slot->pic, *slot->opts,
+			 slot->board ? tag.c_str () : NULL);
+  } catch (const avrdoper_error &e) {
+    cerr << slot->pic->port () << ": " << e.what () << endl;
+    slot->retval = EX_IOERR;
+  }
+  return NULL;
+}
+
+static int
+gang (bool slow, int device, const char *input, const burn_opts &o,
+      const char *board, const char *stats)
+{
+  vector<string> serials;
+  int retval;
+
+  if (!avrdoper::avrdoper_list (serials)) {
+    cerr << "No programmers found." << endl;
+    return EX_UNAVAILABLE;
+  }
+
+  // Slots open their programmers by serial number.  Without one, or
+  // with one another programmer has too, two slots would program the
+  // same chip.
+  bool unique = true;
+  for (unsigned i = 0; i < serials.size (); ++i) {
+    if (serials [i].empty ()) {
+      cerr << "slot " << i + 1 << ": programmer has no serial number" << endl;
+      unique = false;
+      continue;
+    }
+    for (unsigned j = 0; j < i; ++j)
+      if (serials [j] == serials [i]) {
+	cerr << "slots " << j + 1 << " and " << i + 1
+	     << ": same serial number " << serials [i] << endl;
+	unique = false;
+	break;
+      }
+  }
+  if (!unique) {
+    cerr << "Gang programming needs a different serial number on "
+      "every programmer." << endl;
+    return EX_CONFIG;
+  }
+
+  // Opening the programmers is not thread safe in libusb, do it here.
+  vector<gang_slot> slots (serials.size ());
+  unsigned first = slots.size ();
+  for (unsigned i = 0; i < slots.size (); ++i) {
+    slots [i].serial = serials [i];
+    slots [i].retval = EX_OSERR;
+    try {
+      slots [i].pic = new picport (slow, serials [i].c_str ());
+      if (first == slots.size ())
+	first = i;
+    } catch (const avrdoper_error &e) {
+      cerr << serials [i] << ": " << e.what () << endl;
+      slots [i].pic = 0;
+      slots [i].retval = EX_IOERR;
+    }
+  }
+
+  // The chip on the first programmer decides the device when it is
+  // detected, the others must match it.
+  hexfile image;
+  retval = EX_IOERR;
+  try {
+    if (first < slots.size ()
+	&& EX_OK == (retval = image.setdevice (*slots [first].pic, device)))
+      retval = image.load (input);
+  } catch (const avrdoper_error &e) {
+    cerr << slots [first].pic->port () << ": " << e.what () << endl;
+    retval = EX_IOERR;
+  }
+  if (EX_OK != retval) {
+    for (unsigned i = 0; i < slots.size (); ++i)
+      delete slots [i].pic;
+    return retval;
+  }
+
+  // The workers share the handlers, program () must not swap them
+  // from several threads.
+  hexfile::hold_signals (true);
+  for (unsigned i = 0; i < slots.size (); ++i) {
+    slots [i].image = &image;
+    slots [i].device = device;
+    slots [i].opts = &o;
+    slots [i].board = board;
+    if (!slots [i].pic)
+      continue;
+    if (pthread_create (&slots [i].thread, NULL, gang_worker, &slots [i])) {
+      cerr << slots [i].pic->port () << ": unable to start worker" << endl;
+      delete slots [i].pic;
+      slots [i].pic = 0;
+    }
+  }
+
+  retval = EX_OK;
+  vector<picport *> joined;
+  cout << endl << "Gang results:" << endl;
+  for (unsigned i = 0; i < slots.size (); ++i) {
+    if (slots [i].pic) {
+      pthread_join (slots [i].thread, NULL);
+      joined.push_back (slots [i].pic);
+    }
+    cout << "  slot " << i + 1 << "  " << slots [i].serial << ": ";
+    if (EX_OK == slots [i].retval)
+      cout << "ok" << endl;
+    else
+      cout << "FAILED (exit code " << slots [i].retval << ")" << endl;
+    if (EX_OK == retval)
+      retval = slots [i].retval;
+  }
+  hexfile::hold_signals (false);
+  if (stats)
+    report_stats (joined, stats);
+  for (unsigned i = 0; i < joined.size (); ++i)
+    delete joined [i];
+  return retval;
+}
+
+// What to do with one chip, set from the command line.
+struct job_opts {
+  int device;
+  const char *input;
+  const char *output;
+  const char *cc;
+  const char *board;
+  int format;
+  int record_len;
+  int skip;
+  int burn;
+  int verify;
+  int blank;
+  const char *plan_out;
+  const char *plan_in;
+  burn_opts b;
+};
+
+// if both input and output files are specified, first program the device
+// and then read it.  --verify compares the chip with the input file
+// after any programming.  --blank-check comes first of all, and stops
+// the job if the chip is not blank.  --compile-plan records the
+// programming and verifying, --run-plan sends a recorded plan and
+// does nothing else.
+
+static int
+job (picport &pic, const job_opts &o)
+{
+  int device = o.device;
+
+  if (o.plan_in) {
+    plan p;
+    int retval;
+
+    if (EX_OK != (retval = p.load (o.plan_in)))
+      return retval;
+    if (-1 != device && device != hexfile::find_device (p.device ())) {
+      cerr << o.plan_in << ": plan is for " << p.device () << "." << endl;
+      return EX_USAGE;
+    }
+    // Nothing is sent to a chip the plan is not for.
+    if (-1 != p.device_id ()) {
+      hexfile mem;
+      int d = hexfile::find_device (p.device ()), id;
+      if (-1 == d) {
+	cerr << o.plan_in << ": unknown device " << p.device () << "." << endl;
+	return EX_DATAERR;
+      }
+      if (EX_OK != (retval = mem.setdevice (pic, d)))
+	return retval;
+      if (-1 == (id = mem.read_id (pic)) || !mem.same_id (id)) {
+	cerr << pic.port () << ": device id 0x" << hex << setfill ('0')
+	     << setw (4) << id << dec << " is not " << p.device ()
+	     << ", plan not run." << endl;
+	return EX_USAGE;
+      }
+    } else
+      cout << p.device () << " has no device id, chip not checked." << endl;
+    return p.run (pic);
+  }
+
+  if (o.blank) {
+    hexfile mem;
+    int retval;
+
+    if (EX_OK != (retval = mem.setdevice (pic, device)))
+      return retval;
+
+    mem.select (o.b.only, o.b.range_lo, o.b.range_hi);
+    if (EX_OK != (retval = mem.blank_check (pic)))
+      return retval;
+  }
+
+  if (o.input || o.b.erase) {
+
+    hexfile mem;
+    int retval;
+
+    if (EX_OK != (retval = mem.setdevice (pic, device)))
+      return retval;
+
+    if (o.input && EX_OK != (retval = mem.load (o.input)))
+      return retval;
+
+    plan rec;
+    if (o.plan_out)
+      pic.record (&rec);
+    retval = EX_OK;
+    if (o.burn)
+      retval = burn (mem, pic, o.b, o.board);
+    else if (!o.verify)
+      cout << "No --burn option specified, device not programmed.\n";
+
+    if (EX_OK == retval && o.verify) {
+      mem.select (o.b.only, o.b.range_lo, o.b.range_hi);
+      mem.stamp (o.b.stamp);
+      retval = mem.verify (pic, o.b.calibration);
+    }
+    pic.record (0);
+    if (EX_OK != retval)
+      return retval;
+    if (o.plan_out
+	&& EX_OK != (retval = rec.save (o.plan_out, mem.device_name (),
+				       mem.device_id (), pic)))
+      return retval;
+
+    mem.record_length (o.record_len);
+    if (o.input && o.cc)
+      if (EX_OK != (retval = mem.save (o.cc,
+				       hexfile::formats (o.format),
+				       o.skip)))
+	return retval;
+  }
+
+  if (o.output) {
+    hexfile mem;
+    int retval;
+
+    if (EX_OK != (retval = mem.setdevice (pic, device)))
+      return retval;
+
+    mem.select (o.b.only, o.b.range_lo, o.b.range_hi);
+    if (EX_OK != (retval = mem.read (pic)))
+      return retval;
+
+    mem.record_length (o.record_len);
+    if (EX_OK != (retval = mem.save (o.output,
+				     hexfile::formats (o.format),
+				     o.skip)))
+      return retval;
+  }
+
+  return EX_OK;
+}
+
+// Parse a command line and run it.  picprogd calls this again for
+// every job it gets, with the programmer it holds open in held.
+
+static int
+run (int argc, char **argv, picport *held)
 {
   int opt_warranty = 0;
   int opt_copying = 0;
@@ -63,15 +482,33 @@ main (int argc, char **argv)
   int opt_usage = 0;
 
   int opt_format = hexfile::unknown;
+  int opt_record_len = 16;
 //  const char *opt_port = getenv_default ("PIC_PORT", "/dev/ttyS0");
   const char *opt_input = NULL;
   const char *opt_output = NULL;
   const char *opt_cc = NULL;
+  const char *opt_board = NULL;
+  const char *opt_cache = NULL;
+  const char *opt_serial = NULL;
   int opt_skip = 0;
   int opt_erase = 0;
   int opt_burn = 0;
+  int opt_verify = 0;
+  int opt_blank = 0;
   int opt_calibration = 0;
   int opt_slow = 0;
+  int opt_safe = 0;
+  int opt_stamp = 0;
+  int opt_skip_current = 0;
+  int opt_gang = 0;
+  const char *opt_daemon = NULL;
+  const char *opt_connect = NULL;
+  const char *opt_stats = NULL;
+  const char *opt_plan_out = NULL;
+  const char *opt_plan_in = NULL;
+  const char *opt_executive = NULL;
+  int opt_only = hexfile::region_all;
+  unsigned long opt_range_lo = 0, opt_range_hi = ~0UL;
 
 //  int opt_hardware = (int)(picport::jdm);
 
@@ -90,12 +527,30 @@ main (int argc, char **argv)
     {"ihx32", no_argument, &opt_format, hexfile::ihx32},
     {"ihx16", no_argument, &opt_format, hexfile::ihx16},
     {"ihx8m", no_argument, &opt_format, hexfile::ihx8m},
+    {"record-length", required_argument, NULL, 'L'},
     {"cc-hexfile", required_argument, NULL, 'c'},
+    {"board", required_argument, NULL, 'b'},
+    {"cache-dir", required_argument, NULL, 'K'},
     {"skip-ones", no_argument, &opt_skip, 1},
     {"erase", no_argument, &opt_erase, 1},
     {"burn", no_argument, &opt_burn, 1},
+    {"verify", no_argument, &opt_verify, 1},
+    {"blank-check", no_argument, &opt_blank, 1},
     {"force-calibration", no_argument, &opt_calibration, 1},
     {"slow", no_argument, &opt_slow, 1},
+    {"safe", no_argument, &opt_safe, 1},
+    {"stamp-id", no_argument, &opt_stamp, 1},
+    {"skip-if-current", no_argument, &opt_skip_current, 1},
+    {"serial", required_argument, NULL, 's'},
+    {"gang", no_argument, &opt_gang, 1},
+    {"daemon", optional_argument, NULL, 'D'},
+    {"connect", optional_argument, NULL, 'C'},
+    {"stats", optional_argument, NULL, 'S'},
+    {"only", required_argument, NULL, 'O'},
+    {"range", required_argument, NULL, 'R'},
+    {"compile-plan", required_argument, NULL, 'P'},
+    {"run-plan", required_argument, NULL, 'E'},
+    {"executive", required_argument, NULL, 'X'},
 //    {"jdm", no_argument, &opt_hardware, (int)(picport::jdm)},
 //    {"k8048", no_argument, &opt_hardware, (int)(picport::k8048)},
     {0, 0, 0, 0}
@@ -103,8 +558,11 @@ main (int argc, char **argv)
 
   int optc;
 
-  prog.init (argv);
+  if (!held && prog.name && !strcmp (prog.name, "picprogd"))
+    opt_daemon = "";
 
+  // Start getopt over for every daemon job.
+  optind = 0;
   while (0 <= (optc = getopt_long (argc, argv, short_opts, long_opts, NULL)))
     switch (optc) {
     case 0:
@@ -124,6 +582,51 @@ main (int argc, char **argv)
     case 'c':
       opt_cc = optarg;
       break;
+    case 'b':
+      opt_board = optarg;
+      break;
+    case 'K':
+      opt_cache = optarg;
+      break;
+    case 's':
+      opt_serial = optarg;
+      break;
+    case 'D':
+      opt_daemon = optarg ? optarg : "";
+      break;
+    case 'C':
+      opt_connect = optarg ? optarg : "";
+      break;
+    case 'S':
+      opt_stats = optarg ? optarg : "";
+      break;
+    case 'O':
+      if (0 >= (opt_only = parse_regions (optarg)))
+	opt_usage = 1;
+      break;
+    case 'R':
+      if (!parse_range (optarg, opt_range_lo, opt_range_hi)) {
+	cerr << "Bad --range, use first-last, for example 0x2100-0x21ff."
+	     << endl;
+	opt_usage = 1;
+      }
+      break;
+    case 'P':
+      opt_plan_out = optarg;
+      break;
+    case 'E':
+      opt_plan_in = optarg;
+      break;
+    case 'X':
+      opt_executive = optarg;
+      break;
+    case 'L':
+      opt_record_len = strtol (optarg, NULL, 0);
+      if (opt_record_len < 1 || opt_record_len > 255) {
+	cerr << "Bad --record-length, give 1 to 255 data bytes." << endl;
+	opt_usage = 1;
+      }
+      break;
     case 'q':
       opt_quiet = 1;
       break;
@@ -131,6 +634,20 @@ main (int argc, char **argv)
       opt_usage = 1;
     }
 
+  // An earlier job of picprogd may have been interrupted.
+  hexfile::clear_signal ();
+
+  string socket_name = default_socket ();
+  if (opt_daemon && !*opt_daemon)
+    opt_daemon = getenv_default ("PIC_SOCKET", socket_name.c_str ());
+  if (opt_connect && !*opt_connect)
+    opt_connect = getenv_default ("PIC_SOCKET", socket_name.c_str ());
+
+  // The daemon runs jobs that come with --connect, it is not
+  // forwarded again.
+  if (opt_connect && !held && !opt_usage)
+    return forward (opt_connect, argc, argv);
+
   if (!opt_quiet || opt_warranty || opt_copying || opt_usage)
     // Locale charset should be respected here.
     cerr << "Picprog version 1.9.1, Copyright © 2010 Jaakko Hyvätti <Jaakko.Hyvatti@iki.fi>\n"
@@ -158,69 +675,146 @@ main (int argc, char **argv)
     cerr << endl;
 
     prog.usage (long_opts, short_opts);
+    return EX_USAGE;
   }
 
-  if (opt_warranty || opt_copying || opt_usage)
+  if (opt_warranty || opt_copying)
     return EX_OK;
 
-  if (!opt_input && !opt_output && !opt_erase) {
-    cerr << "Please specify either input or output hexfile or --erase option."
-	 << endl;
-    prog.usage (long_opts, short_opts);
+  if (held && (opt_daemon || opt_gang)) {
+    cerr << "The daemon runs jobs on its own programmer only." << endl;
+    return EX_USAGE;
   }
 
-  if (opt_cc && !opt_input) {
-    cerr << "Carbon copy does not make sense without input file." << endl;
-    prog.usage (long_opts, short_opts);
+  if (opt_daemon) {
+    try {
+      picport pic (opt_slow, opt_serial);
+      return serve (opt_daemon, pic, run);
+    } catch (const avrdoper_error &e) {
+      cerr << e.what () << endl;
+      return EX_IOERR;
+    }
   }
 
-  picport pic (opt_slow);
-//	       picport::hardware_types(opt_hardware));
-
-  // if both input and output files are specified, first program the device
-  // and then read it.
-
-  if (opt_input || opt_erase) {
-
-    hexfile mem;
-    int retval;
-
-    if (EX_OK != (retval = mem.setdevice (pic, opt_device)))
-      return retval;
+  if (opt_plan_in && (opt_input || opt_output || opt_erase || opt_burn
+		      || opt_verify || opt_blank || opt_plan_out || opt_gang)) {
+    cerr << "--run-plan does all of the job, it takes no other job "
+      "options." << endl;
+    prog.usage (long_opts, short_opts);
+    return EX_USAGE;
+  }
 
-    if (opt_input && EX_OK != (retval = mem.load (opt_input)))
-      return retval;
+  if (opt_plan_out && (!opt_input || !opt_burn || !opt_erase || opt_output
+		       || opt_blank || opt_board || opt_skip_current
+		       || opt_gang)) {
+    cerr << "Compiling a plan needs --input-hexfile, --burn and --erase, "
+      "and does not read chips or use the cache." << endl;
+    prog.usage (long_opts, short_opts);
+    return EX_USAGE;
+  }
 
-    if (opt_burn) {
-      if (EX_OK != (retval = mem.program (pic, opt_erase, opt_calibration)))
-    	  return retval;
-    } else
-      cout << "No --burn option specified, device not programmed.\n";
+  if (!opt_input && !opt_output && !opt_erase && !opt_blank && !opt_plan_in) {
+    cerr << "Please specify either input or output hexfile, --erase, "
+      "--blank-check or --run-plan option." << endl;
+    prog.usage (long_opts, short_opts);
+    return EX_USAGE;
+  }
 
+  if (opt_cc && !opt_input) {
+    cerr << "Carbon copy does not make sense without input file." << endl;
+    prog.usage (long_opts, short_opts);
+    return EX_USAGE;
+  }
 
+  // The bulk erase clears every region, whatever is selected.
+  if (opt_erase && (hexfile::region_all != opt_only
+		    || 0 != opt_range_lo || ~0UL != opt_range_hi)) {
+    cerr << "--erase clears the whole chip, it cannot be limited with "
+      "--only or --range." << endl;
+    prog.usage (long_opts, short_opts);
+    return EX_USAGE;
+  }
 
-    if (opt_input && opt_cc)
-      if (EX_OK != (retval = mem.save (opt_cc,
-				       hexfile::formats (opt_format),
-				       opt_skip)))
-	return retval;
+  if (opt_executive && !opt_burn) {
+    cerr << "The programming executive is only used with --burn." << endl;
+    prog.usage (long_opts, short_opts);
+    return EX_USAGE;
   }
 
-  if (opt_output) {
-    hexfile mem;
-    int retval;
+  if (opt_verify && !opt_input) {
+    cerr << "Verifying needs the image in --input-hexfile." << endl;
+    prog.usage (long_opts, short_opts);
+    return EX_USAGE;
+  }
 
-    if (EX_OK != (retval = mem.setdevice (pic, opt_device)))
-      return retval;
+  if (opt_board && !opt_cache) {
+    static string cache_dir;
+    cache_dir = string (getenv_default ("HOME", ".")) + "/.picprog";
+    opt_cache = getenv_default ("PIC_CACHE", cache_dir.c_str ());
+  }
 
-    if (EX_OK != (retval = mem.read (pic)))
-      return retval;
+  if (opt_gang && (!opt_input || !opt_burn || opt_output || opt_cc
+		   || opt_serial || opt_verify || opt_blank)) {
+    cerr << "Gang programming needs --input-hexfile and --burn, and does not "
+      "read chips." << endl;
+    prog.usage (long_opts, short_opts);
+    return EX_USAGE;
+  }
 
-    if (EX_OK != (retval = mem.save (opt_output,
-				     hexfile::formats (opt_format),
-				     opt_skip)))
-      return retval;
+  job_opts jopts;
+  jopts.device = opt_device;
+  jopts.input = opt_input;
+  jopts.output = opt_output;
+  jopts.cc = opt_cc;
+  jopts.board = opt_board;
+  jopts.format = opt_format;
+  jopts.record_len = opt_record_len;
+  jopts.skip = opt_skip;
+  jopts.burn = opt_burn;
+  jopts.verify = opt_verify;
+  jopts.blank = opt_blank;
+  jopts.plan_out = opt_plan_out;
+  jopts.plan_in = opt_plan_in;
+  jopts.b.erase = opt_erase;
+  jopts.b.calibration = opt_calibration;
+  jopts.b.safe = opt_safe;
+  jopts.b.stamp = opt_stamp;
+  jopts.b.skip_current = opt_skip_current;
+  jopts.b.cache = opt_cache;
+  jopts.b.executive = opt_executive;
+  jopts.b.only = opt_only;
+  jopts.b.range_lo = opt_range_lo;
+  jopts.b.range_hi = opt_range_hi;
+
+  if (opt_gang)
+    return gang (opt_slow, opt_device, opt_input, jopts.b, opt_board,
+		 opt_stats);
+
+  if (held)
+    held->clear_stats ();
+  picport *pic = held;
+  int retval;
+  try {
+    if (!pic)
+      pic = new picport (opt_slow, opt_serial);
+//	       picport::hardware_types(opt_hardware));
+    retval = job (*pic, jopts);
+  } catch (const avrdoper_error &e) {
+    if (pic)
+      cerr << pic->port () << ": ";
+    cerr << e.what () << endl;
+    retval = EX_IOERR;
   }
+  if (opt_stats && pic)
+    report_stats (vector<picport *> (1, pic), opt_stats);
+  if (!held)
+    delete pic;
+  return retval;
+}
 
-  return EX_OK;
+int
+main (int argc, char **argv)
+{
+  prog.init (argv);
+  return run (argc, argv, NULL);
 }
@@ -86,6 +86,7 @@ make sure your email passes my spam filtering.
 #include "stk500v2_private.h"
 
 #include "picport.h"
+#include "plan.h"
 
 using namespace std;
 
@@ -102,6 +103,22 @@ using namespace std;
 // Timeout (in seconds) for waiting for serial response
 #define SERIAL_TIMEOUT 2
 
+static double
+now ()
+{
+  struct timeval tv;
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Adds the time until the end of the scope to a counter.
+struct stopwatch {
+  double &total;
+  double start;
+  stopwatch (double &t) : total (t), start (now ()) {}
+  ~stopwatch () { total += now () - start; }
+};
+
 int picport::stk500v2_getsync()
 {
   int tries = 0;
@@ -109,7 +126,8 @@ int picport::stk500v2_getsync()
   int status;
 
 retry:
-  tries++;
+  if (tries++)
+    stat [cur_phase].retries++;
 
   // send the sync command and see if we can get there
   buf[0] = CMD_SIGN_ON;
@@ -170,13 +188,17 @@ int picport::stk500v2_command( unsigned char * buf,size_t len, size_t maxlen)
   int i;
   int tries = 0;
   int status;
+  stopwatch w (stat [cur_phase].wait);
+
+  stat [cur_phase].commands++;
 
   PDEBUGS("STK500V2: command(");
   for (i=0;i<len;i++) PDEBUGS("0x%02x ",buf[i]);
   PDEBUGS(", %d)\n",len);
 
 retry:
-  tries++;
+  if (tries++)
+    stat [cur_phase].retries++;
 
   // send the command to the programmer
   stk500v2_send(buf,len);
@@ -260,6 +282,7 @@ retry:
   }
 
   // otherwise try to sync up again
+  stat [cur_phase].resyncs++;
   status = stk500v2_getsync();
   if (status != 0) {
     if (tries > RETRIES) {
@@ -294,10 +317,11 @@ int picport::stk500v2_send( unsigned char * data, size_t len)
   for (i=0;i<len+6;i++) PDEBUGS("0x%02x ",buf[i]);
   PDEBUGS(", %d)\n",len+6);
 
-  if (HwPort.avrdoper_send(buf, len+6) != 0) {
-    fprintf(stderr,"stk500_send(): failed to send command to serial port\n");
-    exit(1);
-  }
+  stat [cur_phase].round_trips++;
+  stat [cur_phase].bytes_out += len + 6;
+
+  if (HwPort.avrdoper_send(buf, len+6) != 0)
+    throw avrdoper_error("stk500_send(): failed to send command to serial port");
 
   return 0;
 }
@@ -324,6 +348,7 @@ int picport::stk500v2_recv( unsigned char *msg, size_t maxsize) {
   while ( (state != sDONE ) && (!timeout) ) {
     if (HwPort.avrdoper_recv(&c, 1) < 0)
       goto timedout;
+    stat [cur_phase].bytes_in++;
     PDEBUGS("0x%02x ",c);
     checksum ^= c;
 
@@ -412,21 +437,28 @@ int picport::stk500v2_recv( unsigned char *msg, size_t maxsize) {
 }
 
 //*************************************+++++++++++++++++++++++++++++++++++******************************
-picport::picport (bool slow)  : addr (0), debug_on (0)
+picport::picport (bool slow, const char *serial)  : addr (0), debug_on (0), packed (false),
+				  recorder (0),
+				  frame_max (LBUFCMDMAX), reads_max (LBUFREADMAX),
+				  results_base (0)
 {
 	int ret,i;
 
   command_sequence = 1;
+  cmd_buf.reads = 0;
+  clear_stats ();
 
   for (i = 0; i < 16; ++i)
     W [i] = 0;
 //  portname = new char [strlen (tty) + 1];
 //  strcpy (portname, tty);
 
-  if ((ret = HwPort.avrdoper_open()) > 0) {
-    cerr << "Unable to open HW :" << strerror (ret) << endl;
-    exit (EX_IOERR);
-  }
+  name = "Multiprog";
+  if (serial)
+    name = name + " " + serial;
+
+  if ((ret = HwPort.avrdoper_open(serial)) > 0)
+    throw avrdoper_error(string("Unable to open HW :") + strerror (ret));
 
   HwPort.avrdoper_drain();
 
@@ -435,6 +467,8 @@ picport::picport (bool slow)  : addr (0), debug_on (0)
 
   HwPort.avrdoper_drain();
 
+  get_caps();
+
   /*cmd_buf.buf[0] = STK_CMD_LEAVE_PROGMODE_ISCP;
   ret = stk500v2_command( cmd_buf.buf, 1, sizeof(cmd_buf.buf));
   usleep (500000);*/
@@ -450,6 +484,9 @@ picport::picport (bool slow)  : addr (0), debug_on (0)
   buf_send();//init
 
   if(ret > 0){//ok
+	  // Older firmware may skip an unknown command and still answer
+	  // OK, so packed words are only sent when the firmware lists them.
+	  packed = caps.queried && has_command(c_pic_send_n);
 	  inPrgMode = 1;
 	  //setup
 	  add_to_buf(c_VDDon, IS_CMD);
@@ -515,19 +552,47 @@ picport::~picport ()
 //	usleep (1);
 //  delete [] portname;
 	buf[0] = STK_CMD_LEAVE_PROGMODE_ISCP;
-	stk500v2_command(buf, 1, sizeof(buf));
+	// A programmer that failed is left as it is.
+	try {
+		stk500v2_command(buf, 1, sizeof(buf));
+	} catch (const avrdoper_error &) {
+	}
 }
 
 int picport::buf_send(void)
 {
-	int ret = ERR(ERROR_NO_DATA);
+	int ret = ERR(ERROR_NO_DATA), i;
+	unsigned char sent[LBUFCMDSIZE];
+
+	peephole(cmd_buf.count);
 
 	if(cmd_buf.count > 1){
 		cmd_buf.buf[cmd_buf.count] = 0;//nop
 		cmd_buf.count++;
+		stat [cur_phase].frames++;
+		stat [cur_phase].fill += cmd_buf.count;
+		// The reply overwrites the frame.
+		if(recorder)
+			memcpy(sent, cmd_buf.buf, cmd_buf.count);
+		HwPort.avrdoper_expect(6 + 2 + 2 * cmd_buf.reads);
 		ret = stk500v2_command( cmd_buf.buf, cmd_buf.count, sizeof(cmd_buf.buf));
 
 	}
+	int first = results.size();
+
+	// Hand out the values of the reads queued in this frame.  The
+	// reply has 6 bytes of framing and 2 bytes of command and status.
+	for(i = 0; i < cmd_buf.reads; i++){
+		if(ret >= 6 + 2 + 2 * (i + 1))
+			results.push_back(cmd_buf.buf[3 + 2 * i]<<8 | cmd_buf.buf[2 + 2 * i]);
+		else
+			results.push_back(-1);
+	}
+	if(recorder && cmd_buf.count > 1)
+		recorder->frame(sent, cmd_buf.count, cur_phase,
+				results_base + first, cmd_buf.reads,
+				cmd_buf.reads ? &results[first] : NULL);
+	cmd_buf.reads = 0;
 
 	cmd_buf.last_cmd_ind = 1;
 	cmd_buf.count = 1;
@@ -542,7 +607,11 @@ int picport::add_to_buf(unsigned char byte, Bool IsData, Bool AutoSend)
 {
 	int ret = NO_ERROR, len,i;
 
-	if(cmd_buf.count >= (LBUFCMDMAX - 1)){
+	// Compact the complete commands before giving up on the frame.
+	if(cmd_buf.count >= (frame_max - 1) && AutoSend)
+		peephole(IsData ? cmd_buf.last_cmd_ind : cmd_buf.count);
+
+	if(cmd_buf.count >= (frame_max - 1)){
 		PDEBUG("Buf ovf, byte:0x%02x count:%d AutoSend:%d",byte,cmd_buf.count,AutoSend);
 		if(AutoSend){
 			if(IsData){
@@ -573,6 +642,146 @@ int picport::add_to_buf(unsigned char byte, Bool IsData, Bool AutoSend)
 	return ret;
 }
 
+// Length of the command at p with its parameters, 0 if it is not
+// known or runs past end.
+static int
+cmd_length(const unsigned char *p, const unsigned char *end)
+{
+	int n;
+
+	switch(p[0]){
+	case c_DelayMs:
+	case c_DelayUs:
+		n = 2;
+		break;
+	case c_pic_send:
+		if(p + 1 >= end)
+			return 0;
+		n = 2 + (p[1] + 7) / 8;
+		break;
+	case c_pic_send_n:
+		if(p + 3 >= end)
+			return 0;
+		n = 4 + p[1] * ((p[2] + 7) / 8);
+		break;
+	case c_dspic_send_24:
+		n = 4;
+		break;
+	case c_dspic_pe_send:
+		if(p + 1 >= end)
+			return 0;
+		n = 2 + p[1] * 2;
+		break;
+	case c_set_param:
+		n = 3;
+		break;
+	default:
+		n = 1;
+	}
+	return p + n <= end ? n : 0;
+}
+
+// Pin commands that only set a pin, grouped by the pin.  -1 for
+// other commands.
+static int
+pin_group(unsigned char c)
+{
+	switch(c){
+	case c_PGClow:
+	case c_PGChigh:
+		return 0;
+	case c_PGDlow:
+	case c_PGDhigh:
+		return 1;
+	case c_VDDon:
+	case c_VDDoff:
+		return 2;
+	case c_HVReset_OFF:
+	case c_HVReset_TO_RESET:
+	case c_HVReset_TO_HV:
+		return 3;
+	}
+	return -1;
+}
+
+// Peephole pass over the complete commands in cmd_buf.buf[1..end).
+// Adjacent delays of the same unit are added together, since the
+// delays are minimums only their sum matters.  A pin command that
+// repeats the state the pin already has in this frame is dropped,
+// sends and reads leave PGC and PGD unknown.  Adjacent c_pic_send
+// commands are joined into one up to 32 bits.  Whatever follows end
+// is moved down after the compacted commands.
+void picport::peephole(int end)
+{
+	unsigned char *buf = cmd_buf.buf;
+	int pin[4] = { -1, -1, -1, -1 };
+	int r, w = 1, last = -1, n, g;
+
+	// Nothing queued, as when the buffer is sent empty.
+	if(end <= w)
+		return;
+
+	for(r = 1; r < end; r += n){
+		unsigned char c = buf[r];
+
+		if(!(n = cmd_length(buf + r, buf + end))){
+			// Not understood, keep the rest as it is.
+			memmove(buf + w, buf + r, end - r);
+			w += end - r;
+			break;
+		}
+
+		if((g = pin_group(c)) >= 0){
+			if(pin[g] == c)
+				continue;
+			pin[g] = c;
+		}else if(c == c_DelayUs || c == c_DelayMs){
+			if(last >= 0 && buf[last] == c
+			   && buf[last + 1] + buf[r + 1] <= (c == c_DelayMs ? 250 : 255)){
+				buf[last + 1] += buf[r + 1];
+				continue;
+			}
+		}else if(c == c_pic_send){
+			pin[0] = pin[1] = -1;
+			if(last >= 0 && buf[last] == c_pic_send
+			   && buf[last + 1] + buf[r + 1] <= 32){
+				int n1 = buf[last + 1], n2 = buf[r + 1], k;
+				unsigned long v1 = 0, v2 = 0;
+
+				for(k = 0; k < (n1 + 7) / 8; k++)
+					v1 |= (unsigned long)buf[last + 2 + k] << (8 * k);
+				for(k = 0; k < (n2 + 7) / 8; k++)
+					v2 |= (unsigned long)buf[r + 2 + k] << (8 * k);
+				v1 = (v1 & ((1UL << n1) - 1)) | v2 << n1;
+				buf[last + 1] = n1 + n2;
+				for(k = 0; k < (n1 + n2 + 7) / 8; k++)
+					buf[last + 2 + k] = (v1 >> (8 * k)) & 0xff;
+				w = last + 2 + k;
+				continue;
+			}
+		}else if(c >= c_pic_send && c <= c_dspic_read_16_bits){
+			pin[0] = pin[1] = -1;
+		}else if(c != c_nop){
+			pin[0] = pin[1] = pin[2] = pin[3] = -1;
+		}
+
+		memmove(buf + w, buf + r, n);
+		last = w;
+		w += n;
+	}
+
+	if(w == end)
+		return;
+
+	stat[cur_phase].peephole += end - w;
+	memmove(buf + w, buf + end, cmd_buf.count - end);
+	cmd_buf.count -= end - w;
+	if(cmd_buf.count > w)
+		cmd_buf.last_cmd_ind = w;
+	else
+		cmd_buf.last_cmd_ind = last > 0 ? last : 1;
+}
+
 void picport::reset (unsigned long reset_address)
 {
   set_clock_data (0, 0);
@@ -608,30 +817,201 @@ int picport::send_n_bits(unsigned char cnt, unsigned int var)
 	return NO_ERROR;//TODO
 }
 
+// Clock out a word of cnt bits and wait gap * 5 us after it.  Words
+// of the same size and gap that follow each other share one
+// c_pic_send_n command.  Only for firmware that has it.
+void picport::send_word(unsigned char cnt, unsigned int var, unsigned char gap)
+{
+	int i, n = (cnt + 7) / 8, h = cmd_buf.last_cmd_ind;
+	unsigned char *p = cmd_buf.buf + h;
+
+	if(!(cmd_buf.count > h && p[0] == c_pic_send_n && p[1] < 255
+	     && p[2] == cnt && p[3] == gap
+	     && cmd_buf.count == h + 4 + p[1] * n
+	     && cmd_buf.count + n < frame_max - 1)){
+		add_to_buf(c_pic_send_n, IS_CMD);
+		add_to_buf(0, IS_DATA);
+		add_to_buf(cnt, IS_DATA);
+		add_to_buf(gap, IS_DATA);
+	}
+	for(i = 0; i < n; i++)
+		add_to_buf((var >> (8 * i)) & 0xff, IS_DATA);
+
+	// add_to_buf() may have moved the command to a new frame.
+	cmd_buf.buf[cmd_buf.last_cmd_ind + 1]++;
+	stat[cur_phase].delay_us += gap * 5;
+}
+
+// Ask the firmware for its limits and commands, and size the frames
+// from them.  Older firmware does not know the query and gets the
+// limits it always had.  Sent without stk500v2_command() so that
+// it fails quietly.
+bool picport::get_caps()
+{
+	static const unsigned char original[] = {
+		c_nop, c_enablePGC_D, c_PGDlow, c_PGDhigh, c_PGClow, c_PGChigh,
+		c_VDDon, c_VDDoff, c_HVReset_ENABLE, c_HVReset_OFF,
+		c_HVReset_TO_RESET, c_HVReset_TO_HV, c_clock_delay, c_DelayMs,
+		c_DelayUs, c_pic_send, c_dspic_send_24, c_pic_read,
+		c_pic_read_14_bits, c_pic_read_byte2, c_dspic_read_16_bits,
+		c_set_param
+	};
+	unsigned char buf[LBUFCMDSIZE];
+	const unsigned char *r = buf + 2;
+	unsigned int i;
+
+	caps.queried = false;
+	caps.cmd_max = LBUFCMDMAX;
+	caps.reply_max = LBUFCMDMAX;
+	caps.clock_delay = 0;
+	caps.clock_ns = 0;
+	memset(caps.commands, 0, sizeof(caps.commands));
+	for(i = 0; i < sizeof(original); i++)
+		caps.commands[original[i] / 8] |= 1 << (original[i] & 7);
+
+	buf[0] = STK_CMD_GET_CAPS_ISCP;
+	stk500v2_send(buf, 1);
+	if(stk500v2_recv(buf, sizeof(buf)) >= 6 + 2 + cap_size
+	   && buf[0] == STK_CMD_GET_CAPS_ISCP && buf[1] == STATUS_CMD_OK
+	   && r[cap_version] >= 1){
+		caps.queried = true;
+		caps.cmd_max = r[cap_cmd_max] | r[cap_cmd_max + 1] << 8;
+		caps.reply_max = r[cap_reply_max] | r[cap_reply_max + 1] << 8;
+		caps.clock_delay = r[cap_clock_delay];
+		caps.clock_ns = r[cap_clock_ns] | r[cap_clock_ns + 1] << 8;
+		memcpy(caps.commands, r + cap_commands, sizeof(caps.commands));
+	}
+
+	// A frame must hold at least the longest command and the nop.
+	frame_max = caps.cmd_max < LBUFCMDSIZE ? caps.cmd_max : LBUFCMDSIZE;
+	if(frame_max < 16)
+		frame_max = 16;
+	reads_max = ((caps.reply_max < LBUFCMDSIZE ? caps.reply_max : LBUFCMDSIZE) - 2) / 2;
+	if(reads_max < 1)
+		reads_max = 1;
+	return caps.queried;
+}
+
 int picport::read_n_bits(unsigned char mode, Bool exec)
 {
 	int ret=NO_ERROR;
 //usleep(100000);
 	switch(mode){
 	case 8:
-		add_to_buf(c_pic_read_byte2, IS_CMD);
+		ret = read_cmd(c_pic_read_byte2, 0xff, exec);
 		break;
 	case 14:
-		add_to_buf(c_pic_read_14_bits, IS_CMD);
+		ret = read_cmd(c_pic_read_14_bits, 0x3fff, exec);
 		break;
 	case 16:
-		add_to_buf(c_dspic_read_16_bits, IS_CMD);
+		ret = read_cmd(c_dspic_read_16_bits, 0xffff, exec);
 		break;
 	}
 
-	if(exec){
+	PDEBUG("--Read %d mode, ret=%X",mode,ret);
+	return ret;
+
+}
+
+// Queue the read command c, mask is what its value can hold.
+int picport::read_cmd(unsigned char c, int mask, Bool exec)
+{
+	int ret;
+
+	// The reply must have room for the value.
+	if(cmd_buf.reads >= reads_max)
 		buf_send();
-		ret = cmd_buf.buf[3]<<8 |cmd_buf.buf[2];//(int)((uint16_t *)&lbuf.buf[2]);
-	}
 
-	PDEBUG("--Read %d mode, ret=%X",mode,ret);
+	add_to_buf(c, IS_CMD);
+
+	// add_to_buf() may have sent the previous frame, so the ticket
+	// is counted only after the read command is in the buffer.
+	ret = results_base + results.size() + cmd_buf.reads;
+	cmd_buf.reads++;
+	if(recorder)
+		recorder->read_queued(ret, mask);
+
+	if(exec)
+		ret = result(ret);
 	return ret;
+}
 
+// dspic30 programming executive.  It is started by raising MCLR with
+// PGD high, and talks in 16 bit words sent MSB first.  It pulls PGD
+// low when it has an answer, which c_dspic_pe_read waits for.
+
+bool picport::executive() const
+{
+	return has_command(c_dspic_pe_send) && has_command(c_dspic_pe_read);
+}
+
+void picport::enter_executive()
+{
+	set_clock_data(0, 1);
+	delay(100);
+	set_vpp(0);
+	delay(50);
+	set_vpp(1);
+	// Let the executive start up.
+	delay(25000);
+	addr = 0;
+	buf_send();
+}
+
+// Words that follow each other share one c_dspic_pe_send command.
+void picport::pe_send(int word)
+{
+	int h = cmd_buf.last_cmd_ind;
+	unsigned char *p = cmd_buf.buf + h;
+
+	if(!(cmd_buf.count > h && p[0] == c_dspic_pe_send && p[1] < 255
+	     && cmd_buf.count == h + 2 + p[1] * 2
+	     && cmd_buf.count + 2 < frame_max - 1)){
+		add_to_buf(c_dspic_pe_send, IS_CMD);
+		add_to_buf(0, IS_DATA);
+	}
+	add_to_buf(word & 0xff, IS_DATA);
+	add_to_buf((word >> 8) & 0xff, IS_DATA);
+
+	// add_to_buf() may have moved the command to a new frame.
+	cmd_buf.buf[cmd_buf.last_cmd_ind + 1]++;
+}
+
+int picport::pe_read(Bool exec)
+{
+	return read_cmd(c_dspic_pe_read, 0xffff, exec);
+}
+
+void picport::preserve(unsigned long a, int mask)
+{
+	if(recorder)
+		recorder->preserve(a, mask);
+}
+
+bool picport::preserving(unsigned long a) const
+{
+	return recorder && recorder->preserved(a);
+}
+
+void picport::loose_read(int mask)
+{
+	if(recorder)
+		recorder->read_mask(mask);
+}
+
+int picport::result(int ticket)
+{
+	if(ticket - results_base >= (int)results.size())
+		buf_send();
+	if(ticket < results_base || ticket - results_base >= (int)results.size())
+		return -1;
+	return results[ticket - results_base];
+}
+
+void picport::forget_results()
+{
+	results_base += results.size();
+	results.clear();
 }
 
 uint16_t *picport::execute() //TODO
@@ -676,18 +1056,24 @@ void picport::delay (unsigned int us)
 
 	return;
 */
+	unsigned int n;
+
 	if(us < 600){
 		if(us<5) us = 5;
+		n = (us+3) / 5;
 		add_to_buf(c_DelayUs, IS_CMD);
-		add_to_buf((us+3) / 5, IS_DATA);
+		add_to_buf(n, IS_DATA);
+		stat[cur_phase].delay_us += n * 5;
 	}else{
-		add_to_buf(c_DelayMs, IS_CMD);
 		if(us <= 1000)
-			add_to_buf(1, IS_DATA);
+			n = 1;
 		else if(us < (250*1000))
-			add_to_buf((us+500)/1000, IS_DATA);
+			n = (us+500)/1000;
 		else
-			add_to_buf(250, IS_DATA);
+			n = 250;
+		add_to_buf(c_DelayMs, IS_CMD);
+		add_to_buf(n, IS_DATA);
+		stat[cur_phase].delay_us += n * 1000;
 	}
 
 }
@@ -695,6 +1081,9 @@ void picport::delay (unsigned int us)
 int picport::command18 (enum commands18 comm, int data, Bool exec)
 {
 	int i, shift = comm;
+	// Writes go out as one 20 bit word when the firmware packs them.
+	bool pack = packed && (instr == comm
+			       || (twrite <= comm && comm <= twrite_prog));
 
 	if (nop_prog == comm) {
     // A programming command must leave the last bit clock pulse up
@@ -710,7 +1099,7 @@ int picport::command18 (enum commands18 comm, int data, Bool exec)
     // P10 >5 µs high voltage discharge time
     // Later models listed as > 100 µs
 		delay (100);
-	} else {
+	} else if (!pack) {
 //		for (i = 0; i < 4; i++)
 //			p_out ((shift >> i) & 1);
 		send_n_bits(4,shift);
@@ -752,6 +1141,10 @@ int picport::command18 (enum commands18 comm, int data, Bool exec)
 //    for (i = 0; i < 16; i++)
 //      p_out ((data >> i) & 1);
 //    set_clock_data (0, 0); // set data down
+		if (pack) {
+			send_word(20, comm | (data & 0xffff) << 4, 1);
+			return 0;
+		}
 		send_n_bits(16,data);
 		break;
 
@@ -791,8 +1184,6 @@ int picport::command30 (enum commands30 comm, int data, Bool exec)
   switch (comm) {
   case SIX:
 
-	send_n_bits(4,SIX);
-
     if (0x200000 == (data & 0xff0000))
       W[data & 15] = (data & 0x0ffff0) >> 4;
     else if (0xEB0000 == (data & 0xfff87f))
@@ -811,7 +1202,12 @@ int picport::command30 (enum commands30 comm, int data, Bool exec)
 
 //    for (i = 0; i < 24; i++)
 //      p_out ((data >> i) & 1);
-    send_n_bits(24,data);
+    if (packed)
+      send_word(28, SIX | (data & 0xffffff) << 4, 0);
+    else {
+      send_n_bits(4,SIX);
+      send_n_bits(24,data);
+    }
     break;
 
   case REGOUT:
@@ -859,10 +1255,17 @@ int picport::command (enum commands comm, int data, Bool exec)
   // first, send out the command, 6 bits
 
   int i, shift;
+  // Commands without data go out as packed 6 bit words.
+  bool pack = packed && load_conf != comm && data_for_prog != comm
+    && data_for_data != comm && data_from_prog != comm
+    && data_from_data != comm;
 //  for (i = 0; i < 6; i++)
 //    p_out ((shift >> i) & 1);
 //  set_clock_data (0, 0); // set data down
-  send_n_bits(6,comm);
+  if (pack)
+    send_word(6, comm, 1);
+  else
+    send_n_bits(6,comm);
 
   shift = 0; // default return value
 
@@ -882,6 +1285,12 @@ int picport::command (enum commands comm, int data, Bool exec)
   case data_from_prog:
   case data_from_data:
     delay (1);
+    if (recorder) {
+      if (data_from_prog == comm)
+	recorder->read_at (addr, 0x3fff);
+      else
+	recorder->read_mask (0xff);
+    }
     shift = read_n_bits(14,exec);
 /*    tmp1 = p_in ();
     for (i = 0; i < 14; i++)
@@ -900,7 +1309,7 @@ int picport::command (enum commands comm, int data, Bool exec)
     }
 #endif
 
-    if (data_from_data == comm) {
+    if (data_from_data == comm && exec) {
 
       // Check that the leftover bits were valid, all 1's.
       // This detects if the programmer is not connected to the port.
@@ -935,14 +1344,149 @@ int picport::command (enum commands comm, int data, Bool exec)
     set_clock_data (0, 0); // set data down
 */
     tmp1 = (data&0b11111111111111) << 1;
-    send_n_bits(16,tmp1);
+    // A preserved word starts a frame, where the plan can patch it.
+    if (recorder && data_for_prog == comm && recorder->write_at (addr, data)) {
+      buf_send ();
+      send_n_bits(16,tmp1);
+      recorder->patch (cmd_buf.count - 2);
+    } else
+      send_n_bits(16,tmp1);
     break;
 
   default:
     ;
   }
 
-  delay (1);
+  // The gap of a packed command is this delay.
+  if (!pack)
+    delay (1);
   return shift;
 }
 
+
+void picport::clear_stats ()
+{
+  memset (stat, 0, sizeof (stat));
+  cur_phase = ph_setup;
+  phase_start = now ();
+}
+
+void picport::phase (enum phases p)
+{
+  double t = now ();
+
+  stat [cur_phase].seconds += t - phase_start;
+  phase_start = t;
+  cur_phase = p;
+}
+
+picport::counters picport::stats (enum phases p) const
+{
+  counters c = stat [p];
+
+  if (p == cur_phase)
+    c.seconds += now () - phase_start;
+  return c;
+}
+
+static const char *const phase_names [picport::ph_max] = {
+  "setup", "erase", "program", "data", "ids", "fuses"
+};
+
+static void
+add_counters (picport::counters &sum, const picport::counters &c)
+{
+  sum.seconds += c.seconds;
+  sum.wait += c.wait;
+  sum.commands += c.commands;
+  sum.round_trips += c.round_trips;
+  sum.frames += c.frames;
+  sum.fill += c.fill;
+  sum.bytes_out += c.bytes_out;
+  sum.bytes_in += c.bytes_in;
+  sum.delay_us += c.delay_us;
+  sum.retries += c.retries;
+  sum.resyncs += c.resyncs;
+  sum.peephole += c.peephole;
+}
+
+// Average fill of the command frames in percent of their size.
+static double
+fill_ratio (const picport::counters &c, int size)
+{
+  return c.frames ? 100.0 * c.fill / (c.frames * size) : 0;
+}
+
+static void
+print_row (ostream &o, const char *name, const picport::counters &c, int size)
+{
+  o << setfill (' ') << left << setw (8) << name << right << fixed
+    << setprecision (3) << setw (9) << c.seconds
+    << setw (9) << c.wait
+    << setw (8) << c.round_trips
+    << setw (8) << c.frames
+    << setprecision (1) << setw (7) << fill_ratio (c, size)
+    << setw (9) << c.bytes_out
+    << setw (9) << c.bytes_in
+    << setprecision (3) << setw (10) << c.delay_us / 1000.0
+    << setw (6) << c.retries
+    << setw (6) << c.resyncs << endl;
+}
+
+void picport::print_stats (ostream &o) const
+{
+  counters total;
+
+  memset (&total, 0, sizeof (total));
+  o << "phase       time s   wait s   trips  frames  fill%"
+    "    out B     in B  delay ms retry resync" << endl;
+  for (int p = 0; p < ph_max; p++) {
+    counters c = stats (phases (p));
+    add_counters (total, c);
+    if (c.round_trips || c.frames || c.delay_us)
+      print_row (o, phase_names [p], c, frame_max);
+  }
+  print_row (o, "total", total, frame_max);
+  o.unsetf (ios::floatfield);
+  o << setprecision (6);
+}
+
+static void
+print_json (ostream &o, const picport::counters &c, int size)
+{
+  o << "{\"seconds\": " << c.seconds
+    << ", \"wait_seconds\": " << c.wait
+    << ", \"commands\": " << c.commands
+    << ", \"round_trips\": " << c.round_trips
+    << ", \"frames\": " << c.frames
+    << ", \"frame_bytes\": " << c.fill
+    << ", \"frame_fill\": " << fill_ratio (c, size) / 100
+    << ", \"bytes_out\": " << c.bytes_out
+    << ", \"bytes_in\": " << c.bytes_in
+    << ", \"delay_us\": " << c.delay_us
+    << ", \"retries\": " << c.retries
+    << ", \"resyncs\": " << c.resyncs
+    << ", \"peephole_bytes\": " << c.peephole << "}";
+}
+
+void picport::print_stats_json (ostream &o) const
+{
+  counters total;
+
+  memset (&total, 0, sizeof (total));
+  o << "{\"programmer\": \"" << name << "\", \"frame_size\": "
+    << frame_max << ", \"reads_per_frame\": " << reads_max
+    << ", \"capabilities\": " << (caps.queried ? "true" : "false")
+    << ", \"packed_send\": " << (packed ? "true" : "false")
+    << ", \"clock_ns\": " << caps.clock_ns
+    << ", \"phases\": {";
+  for (int p = 0; p < ph_max; p++) {
+    counters c = stats (phases (p));
+    add_counters (total, c);
+    o << (p ? ",\n  \"" : "\n  \"") << phase_names [p] << "\": ";
+    print_json (o, c, frame_max);
+  }
+  o << "},\n \"total\": ";
+  print_json (o, total, frame_max);
+  o << "}" << endl;
+}
@@ -33,12 +33,22 @@ make sure your email passes my spam filtering.
 #define H_PICPORT
 
 #include <ctime>
+#include <iosfwd>
+#include <string>
+#include <vector>
 
 //#include <termios.h>
 #include <sys/ioctl.h>
 #include "ser_avrdoper.h"
 
+// Frame size of firmware that does not answer STK_CMD_GET_CAPS_ISCP.
 #define LBUFCMDMAX 250
+// Every read returns two bytes after the command and status bytes
+// of the reply, and the reply is received into the command buffer.
+#define LBUFREADMAX ((LBUFCMDMAX - 2) / 2)
+// Largest message body stk500v2_send() takes, the frame buffers
+// are this big.
+#define LBUFCMDSIZE 275
 
 #define ERR(X)	-X
 
@@ -51,8 +61,11 @@ typedef enum {
 #define	IS_DATA	True
 #define	AUTOSEND	True
 
+class plan;
+
 class picport {
 
+  friend class plan;
 
 public:
 
@@ -100,7 +113,9 @@ public:
   };
 
 
-  picport ( bool slow);
+  // serial selects one of several programmers by its USB serial
+  // number, NULL takes the first one found.
+  picport ( bool slow, const char *serial = NULL);
 
   ~picport ();
 
@@ -110,15 +125,72 @@ public:
   void setaddress (unsigned long a);
   void setaddress30 (unsigned long a);
 
+  // dspic30 programming executive, see picport.cc.  executive () tells
+  // if the firmware can talk to one.  reset () goes back to ICSP.
+  bool executive () const;
+  void enter_executive ();
+  void pe_send (int word);
+  int pe_read (Bool exec = True);
+
   unsigned long address () { return addr; }
 
   void force ();
   void reset (unsigned long reset_address);
-  const char *port () { return "Multiprog"; }
+  const char *port () { return name.c_str (); }
   uint16_t *execute();
 
+  // Deferred reads.  A read command given with exec == False is
+  // queued into the current frame and returns a ticket instead of
+  // the value.  result () returns the value of a ticket, sending the
+  // frame first if the read is still pending, or -1 if the frame
+  // failed.  Tickets stay valid until forget_results ().  Deferred
+  // data memory reads return the raw word, the caller masks it.
+  int result (int ticket);
+  void forget_results ();
+  // Whether the frame of a ticket has been sent, so that result ()
+  // does not have to send it.
+  bool ready (int ticket) const
+  { return ticket - results_base < (int) results.size (); }
+
   void debug (int d) { debug_on = d; }
 
+  // Programming plans, see plan.h.  While one is recorded, every
+  // frame sent goes into it.  preserve () tells that the word at a
+  // is read off the chip and written back with the bits of mask
+  // kept, loose_read () that only the bits of mask of the next read
+  // matter when the plan is run.  preserving () tells if the word at
+  // a is such, it must then be written even when erased.
+  void record (plan *p) { recorder = p; }
+  bool recording () const { return recorder; }
+  void preserve (unsigned long a, int mask);
+  bool preserving (unsigned long a) const;
+  void loose_read (int mask);
+
+  // Protocol counters for --stats.  They are charged to the phase
+  // of the job set last with phase (), time to the phase that was
+  // running when phase () is called again.
+  enum phases { ph_setup, ph_erase, ph_pgm, ph_data, ph_ids, ph_conf,
+		ph_max };
+  struct counters {
+    double seconds;		// wall clock time
+    double wait;		// time spent in stk500v2_command ()
+    unsigned long commands;	// stk500v2_command () calls
+    unsigned long round_trips;	// frames sent, each gets a reply
+    unsigned long frames;	// command buffers sent by buf_send ()
+    unsigned long fill;		// bytes in those command buffers
+    unsigned long bytes_out;
+    unsigned long bytes_in;
+    unsigned long long delay_us; // device side delay from delay ()
+    unsigned long retries;
+    unsigned long resyncs;
+    unsigned long peephole;	// bytes removed by peephole ()
+  };
+  void phase (enum phases p);
+  void clear_stats ();
+  counters stats (enum phases p) const;
+  void print_stats (std::ostream &o) const;
+  void print_stats_json (std::ostream &o) const;
+
 private:
 //  int fd;
 //  struct termios saved, termstate;
@@ -128,6 +200,27 @@ private:
   unsigned char inPrgMode;
   unsigned char command_sequence;
   avrdoper HwPort;
+  std::string name;
+  bool packed;		// firmware has c_pic_send_n
+  plan *recorder;
+
+  // What the firmware told in reply to STK_CMD_GET_CAPS_ISCP, or
+  // the limits of the original firmware if it did not answer.
+  struct caps_s {
+    bool queried;
+    int cmd_max;
+    int reply_max;
+    int clock_delay;
+    int clock_ns;		// 0 if not known
+    unsigned char commands[9];
+  };
+  struct caps_s caps;
+  // Frame size and reads per frame used, from caps.
+  int frame_max;
+  int reads_max;
+
+  bool get_caps();
+  bool has_command(int c) const { return caps.commands[c / 8] & (1 << (c & 7)); }
 
   void set_clock_data (int rts, int dtr);
   void set_vpp (int vpp);
@@ -142,18 +235,30 @@ private:
 
   int buf_send(void);
   int add_to_buf(unsigned char byte, Bool IsCmd, Bool AutoSend=AUTOSEND);
+  void peephole(int end);
   int send_n_bits(unsigned char cnt, unsigned int var);
+  void send_word(unsigned char cnt, unsigned int var, unsigned char gap);
   int read_n_bits(unsigned char mode, Bool exec);
+  int read_cmd(unsigned char c, int mask, Bool exec);
 
   struct lbuf_s{
-	  unsigned char count;
-	  unsigned char last_cmd_ind;
-	  unsigned char buf[LBUFCMDMAX];
-	  unsigned char temp_buf[LBUFCMDMAX];
+	  int count;
+	  int last_cmd_ind;
+	  int reads;		// reads queued in this frame
+	  unsigned char buf[LBUFCMDSIZE];
+	  unsigned char temp_buf[LBUFCMDSIZE];
   };
 
   struct lbuf_s cmd_buf;
 
+  // Values of the reads sent so far, first one has ticket results_base.
+  std::vector<int> results;
+  int results_base;
+
+  counters stat [ph_max];
+  enum phases cur_phase;
+  double phase_start;
+
 };
 
 #if 0
@@ -0,0 +1,380 @@
+/* -*- c++ -*-
+
+This is Picprog, Microchip PIC programmer software for the serial port device.
+Copyright © 2010 Jaakko Hyvätti
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see http://www.gnu.org/licenses/ .
+
+The author may be contacted at:
+
+Email: Jaakko.Hyvatti@iki.fi
+URL:   http://www.iki.fi/hyvatti/
+Phone: +358 40 5011222
+
+Please send any suggestions, bug reports, success stories etc. to the
+Email address above.  Include word 'picprog' in the subject line to
+make sure your email passes my spam filtering.
+
+*/
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <cstring>
+#include <cerrno>
+
+#include <sysexits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "hw_defs.h"
+#include "plan.h"
+
+using namespace std;
+
+static const char magic [8] = { 'P', 'I', 'C', 'P', 'L', 'A', 'N', 0 };
+#define PLAN_VERSION 2
+#define HEADER_SIZE 46
+#define DEVICE_SIZE 24
+
+static void
+put16 (vector<unsigned char> &v, unsigned x)
+{
+  v.push_back (x & 0xff);
+  v.push_back ((x >> 8) & 0xff);
+}
+
+static unsigned
+get16 (const unsigned char *p)
+{
+  return p [0] | p [1] << 8;
+}
+
+static unsigned long
+get32 (const unsigned char *p)
+{
+  return get16 (p) | (unsigned long) get16 (p + 2) << 16;
+}
+
+plan::plan () : write_slot (-1), write_value (0), patch_count (0),
+		frame_count (0), dev_id (-1), frame_max (0), reads_max (0),
+		packed (false),
+		mapped (0), map_len (0), body (0)
+{
+  next.mask = 0;
+  next.kind = check;
+  next.slot = 0;
+}
+
+plan::~plan ()
+{
+  if (mapped)
+    munmap ((void *) mapped, map_len);
+}
+
+// The word at addr is read from the chip before the erase and written
+// back with the bits of mask kept.
+
+void
+plan::preserve (unsigned long addr, int mask)
+{
+  if (slot_of.count (addr))
+    return;
+  slot_of [addr] = slot_mask.size ();
+  slot_mask.push_back (mask);
+  slot_addr.push_back (addr);
+  captured.push_back (false);
+  written.push_back (false);
+}
+
+// The next read is a program memory read at addr.  The first one of a
+// slot captures it, the ones after it is written are checked against
+// the patched value.
+
+void
+plan::read_at (unsigned long addr, int mask)
+{
+  map<unsigned long, int>::const_iterator i = slot_of.find (addr);
+
+  next.mask = mask;
+  if (slot_of.end () == i)
+    return;
+  next.slot = i->second;
+  if (!captured [next.slot]) {
+    next.kind = capture;
+    captured [next.slot] = true;
+  } else if (written [next.slot])
+    next.kind = expect;
+}
+
+// Only the bits of mask of the next read are checked.
+
+void
+plan::read_mask (int mask)
+{
+  next.mask = mask;
+}
+
+// The next read got ticket.  mask is what the read returns.
+
+void
+plan::read_queued (int ticket, int mask)
+{
+  if (!next.mask)
+    next.mask = mask;
+  tags [ticket] = next;
+  next.mask = 0;
+  next.kind = check;
+  next.slot = 0;
+}
+
+// A program memory word is written at addr.  Returns whether it is a
+// slot, the word must then start a frame of its own for patch ().
+
+bool
+plan::write_at (unsigned long addr, int data)
+{
+  map<unsigned long, int>::const_iterator i = slot_of.find (addr);
+
+  if (slot_of.end () == i || !captured [i->second])
+    return false;
+  write_slot = i->second;
+  write_value = data & 0x3fff;
+  written [write_slot] = true;
+  return true;
+}
+
+// The word of write_at () went into the next frame at offset.
+
+void
+plan::patch (int offset)
+{
+  put16 (patches, offset);
+  put16 (patches, write_value);
+  patches.push_back (write_slot);
+  patches.push_back (0);
+  ++patch_count;
+}
+
+// A frame was sent.  values are the reads in its reply, first_ticket
+// the ticket of the first one.
+
+void
+plan::frame (const unsigned char *buf, int len, int phase,
+	     int first_ticket, int reads, const int *values)
+{
+  frames.push_back (phase);
+  frames.push_back (reads);
+  frames.push_back (patch_count);
+  frames.push_back (0);
+  put16 (frames, len);
+  frames.insert (frames.end (), buf, buf + len);
+  for (int i = 0; i < reads; ++i) {
+    read_tag t = tags [first_ticket + i];
+    tags.erase (first_ticket + i);
+    put16 (frames, values [i]);
+    put16 (frames, t.mask);
+    frames.push_back (t.kind);
+    frames.push_back (t.slot);
+  }
+  frames.insert (frames.end (), patches.begin (), patches.end ());
+  patches.clear ();
+  patch_count = 0;
+  ++frame_count;
+}
+
+int
+plan::save (const char *name, const char *device, int id,
+	    const picport &pic) const
+{
+  vector<unsigned char> h (magic, magic + sizeof (magic));
+
+  put16 (h, PLAN_VERSION);
+  put16 (h, pic.frame_max);
+  put16 (h, pic.reads_max);
+  h.push_back (pic.packed);
+  h.push_back (slot_mask.size ());
+  for (int i = 0; i < DEVICE_SIZE; ++i)
+    h.push_back (i < (int) strlen (device) ? device [i] : 0);
+  put16 (h, frame_count & 0xffff);
+  put16 (h, frame_count >> 16);
+  put16 (h, id);
+  for (unsigned i = 0; i < slot_mask.size (); ++i) {
+    put16 (h, slot_mask [i]);
+    put16 (h, slot_addr [i]);
+  }
+
+  ofstream f (name, ios::binary);
+  f.write ((const char *) &h [0], h.size ());
+  f.write ((const char *) &frames [0], frames.size ());
+  f.close ();
+  if (!f) {
+    int e = errno;
+    cerr << name << ":unable to write plan:" << strerror (e) << endl;
+    return EX_CANTCREAT;
+  }
+  cout << "Plan of " << frame_count << " frames for " << device
+       << " written to " << name << "." << endl;
+  return EX_OK;
+}
+
+// Map the plan and check that all of it is there.
+
+int
+plan::load (const char *name)
+{
+  int fd = open (name, O_RDONLY);
+  struct stat st;
+
+  if (fd < 0 || fstat (fd, &st)) {
+    int e = errno;
+    cerr << name << ":unable to load plan:" << strerror (e) << endl;
+    if (fd >= 0)
+      close (fd);
+    return EX_NOINPUT;
+  }
+  map_len = st.st_size;
+  void *p = map_len ? mmap (0, map_len, PROT_READ, MAP_PRIVATE, fd, 0)
+    : MAP_FAILED;
+  close (fd);
+  if (MAP_FAILED == p) {
+    map_len = 0;
+    cerr << name << ":not a programming plan" << endl;
+    return EX_DATAERR;
+  }
+  mapped = (const unsigned char *) p;
+
+  const unsigned char *end = mapped + map_len;
+  if (map_len < HEADER_SIZE || memcmp (mapped, magic, sizeof (magic))
+      || PLAN_VERSION != get16 (mapped + 8)) {
+    cerr << name << ":not a programming plan" << endl;
+    return EX_DATAERR;
+  }
+  frame_max = get16 (mapped + 10);
+  reads_max = get16 (mapped + 12);
+  packed = mapped [14];
+  int slots = mapped [15];
+  dev.assign ((const char *) mapped + 16,
+	      strnlen ((const char *) mapped + 16, DEVICE_SIZE));
+  frame_count = get32 (mapped + 40);
+  dev_id = 0xffff == get16 (mapped + 44) ? -1 : (int) get16 (mapped + 44);
+
+  body = mapped + HEADER_SIZE;
+  for (int i = 0; i < slots && body + 4 <= end; ++i, body += 4) {
+    slot_mask.push_back (get16 (body));
+    slot_addr.push_back (get16 (body + 2));
+  }
+  const unsigned char *q = body;
+  unsigned long n;
+  for (n = 0; n < frame_count && q + 6 <= end; ++n) {
+    int len = get16 (q + 4);
+    const unsigned char *r = q + 6 + len;
+    const unsigned char *next_frame = r + 6 * q [1] + 6 * q [2];
+    if (len > LBUFCMDSIZE || next_frame > end)
+      break;
+    for (int i = 0; i < q [1]; ++i)
+      if (r [6 * i + 4] != check && r [6 * i + 5] >= slots)
+	goto bad;
+    for (int i = 0; i < q [2]; ++i) {
+      const unsigned char *t = r + 6 * q [1] + 6 * i;
+      if ((int) get16 (t) + 2 > len || t [4] >= slots)
+	goto bad;
+    }
+    q = next_frame;
+  }
+  if (n == frame_count && (int) slot_mask.size () == slots)
+    return EX_OK;
+ bad:
+  cerr << name << ":programming plan is damaged" << endl;
+  return EX_DATAERR;
+}
+
+// Send the frames of a loaded plan and check the reads.
+
+int
+plan::run (picport &pic)
+{
+  unsigned char buf [LBUFCMDSIZE];
+  vector<int> slot (slot_mask.size (), -1);
+  const unsigned char *q = body;
+
+  if (frame_max > pic.frame_max || reads_max > pic.reads_max
+      || (packed && !pic.packed)) {
+    cerr << pic.port () << ": plan needs a programmer with frames of "
+	 << frame_max << " bytes and " << reads_max << " reads"
+	 << (packed ? " and packed sends" : "") << "." << endl;
+    return EX_UNAVAILABLE;
+  }
+  cout << "Running plan for " << dev << ", " << frame_count << " frames."
+       << endl;
+
+  for (unsigned long n = 0; n < frame_count; ++n) {
+    int phase = q [0], reads = q [1], patches = q [2], len = get16 (q + 4);
+    const unsigned char *r = q + 6 + len;
+    const unsigned char *t = r + 6 * reads;
+
+    if (phase != pic.cur_phase && phase < picport::ph_max)
+      pic.phase (picport::phases (phase));
+    memcpy (buf, q + 6, len);
+    for (int i = 0; i < patches; ++i, t += 6) {
+      int s = t [4];
+      int v = (get16 (t + 2) & ~slot_mask [s]) | (slot [s] & slot_mask [s]);
+      v = (v & 0x3fff) << 1;
+      buf [get16 (t)] = v & 0xff;
+      buf [get16 (t) + 1] = v >> 8;
+    }
+    q = t;
+
+    pic.stat [pic.cur_phase].frames++;
+    pic.stat [pic.cur_phase].fill += len;
+    pic.HwPort.avrdoper_expect (6 + 2 + 2 * reads);
+    int ret = pic.stk500v2_command (buf, len, sizeof (buf));
+    if (ret < 6 + 2 + 2 * reads) {
+      cerr << pic.port () << ": frame " << n
+	   << ": no reply from programmer, plan stopped." << endl;
+      return EX_IOERR;
+    }
+
+    for (int i = 0; i < reads; ++i, r += 6) {
+      int value = buf [3 + 2 * i] << 8 | buf [2 + 2 * i];
+      int want = get16 (r), mask = get16 (r + 2), s = r [5];
+
+      if (capture == r [4]) {
+	slot [s] = value;
+	if (0x3fff == slot_mask [s])
+	  cout << "Calibration word at 0x" << hex << setfill ('0') << setw (4)
+	       << slot_addr [s];
+	else
+	  cout << "Calibration bits 0x" << hex << setfill ('0') << setw (4)
+	       << slot_mask [s] << " at 0x" << setw (4) << slot_addr [s];
+	cout << " preserved as 0x" << setw (4) << (value & slot_mask [s])
+	     << dec << endl;
+	continue;
+      }
+      if (expect == r [4])
+	want = (want & ~slot_mask [s]) | (slot [s] & slot_mask [s]);
+      if ((value ^ want) & mask) {
+	cerr << pic.port () << ": frame " << n << ": read 0x"
+	     << hex << setfill ('0') << setw (4) << (value & mask)
+	     << ", should be 0x" << setw (4) << (want & mask) << dec
+	     << ", plan stopped." << endl;
+	return EX_DATAERR;
+      }
+    }
+  }
+  cout << "done, plan ran through." << endl;
+  return EX_OK;
+}
@@ -0,0 +1,128 @@
+/* -*- c++ -*-
+
+This is Picprog, Microchip PIC programmer software for the serial port device.
+Copyright © 2010 Jaakko Hyvätti
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see http://www.gnu.org/licenses/ .
+
+The author may be contacted at:
+
+Email: Jaakko.Hyvatti@iki.fi
+URL:   http://www.iki.fi/hyvatti/
+Phone: +358 40 5011222
+
+Please send any suggestions, bug reports, success stories etc. to the
+Email address above.  Include word 'picprog' in the subject line to
+make sure your email passes my spam filtering.
+
+*/
+
+#ifndef H_PLAN
+#define H_PLAN
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "picport.h"
+
+/*
+
+  A programming plan is the exact stream of STK500v2 frames that
+  programming one device with one image sends, recorded from a real
+  run with --compile-plan and sent again with --run-plan.  Running a
+  plan does not parse hex files or walk the image, it only sends the
+  frames and checks the reads in their replies.
+
+  Reads that programming checked are checked against the value seen
+  when the plan was recorded.  Calibration words and configuration
+  bits that are preserved over the erase differ from chip to chip:
+  their first read captures a slot, the frames that write them get
+  the slot patched in, and reads after the write are checked against
+  the patched value.
+
+  The file is little endian:
+
+  "PICPLAN" 0, u16 version, u16 frame_max, u16 reads_max,
+  u8 packed, u8 slots, char device [24], u32 frames, u16 device id
+  (0xffff if the device has none),
+  { u16 mask, u16 address } for each slot, and then each frame:
+
+  u8 phase, u8 reads, u8 patches, u8 0, u16 length, length bytes,
+  reads * { u16 value, u16 mask, u8 kind, u8 slot },
+  patches * { u16 offset, u16 value, u8 slot, u8 0 }
+
+ */
+
+class plan {
+public:
+  plan ();
+  ~plan ();
+
+  // Recording, called by picport.
+  void preserve (unsigned long addr, int mask);
+  bool preserved (unsigned long addr) const { return slot_of.count (addr); }
+  void read_at (unsigned long addr, int mask);
+  void read_mask (int mask);
+  void read_queued (int ticket, int mask);
+  bool write_at (unsigned long addr, int data);
+  void patch (int offset);
+  void frame (const unsigned char *buf, int len, int phase,
+	      int first_ticket, int reads, const int *values);
+
+  int save (const char *name, const char *device, int id,
+	    const picport &pic) const;
+
+  int load (const char *name);
+  const char *device () const { return dev.c_str (); }
+  // Device id of the plan, -1 if the device has none.
+  int device_id () const { return dev_id; }
+  int run (picport &pic);
+
+private:
+  enum kinds { check, capture, expect };
+  struct read_tag {
+    int mask;
+    enum kinds kind;
+    int slot;
+  };
+
+  // Slots by device address, and their masks and addresses.
+  std::map<unsigned long, int> slot_of;
+  std::vector<int> slot_mask;
+  std::vector<unsigned long> slot_addr;
+  std::vector<bool> captured, written;
+
+  // What the next read is, and the tags of reads not yet sent.
+  read_tag next;
+  std::map<int, read_tag> tags;
+  // Slot of the word written last, and the patches of the next frame.
+  int write_slot, write_value;
+  std::vector<unsigned char> patches;
+  int patch_count;
+
+  std::vector<unsigned char> frames;
+  unsigned long frame_count;
+
+  // A loaded plan, mapped.
+  std::string dev;
+  int dev_id;
+  int frame_max, reads_max;
+  bool packed;
+  const unsigned char *mapped;
+  size_t map_len;
+  const unsigned char *body;
+};
+
+#endif // H_PLAN
@@ -798,6 +798,5 @@ void program::usage (struct option *long_opts, char *short_opts)
     cerr << " [ -" << charops << " ]";
   }
   cerr << endl;
-  exit (EX_USAGE);
 }
 
@@ -0,0 +1,411 @@
+#!/bin/sh
+# Regression run of picprog against the built-in programmer emulator.
+# No hardware is needed: PIC_EMULATE selects the simulated chip and
+# PIC_EMULATE_STATE keeps its memory between runs.
+#
+# Usage: sh regress.sh [picprog]
+
+PICPROG=${1:-./picprog}
+case $PICPROG in
+  /*) ;;
+  *) PICPROG=`pwd`/$PICPROG ;;
+esac
+if [ ! -x "$PICPROG" ]; then
+  echo "$PICPROG: not found, build it first." >&2
+  exit 2
+fi
+
+T=`mktemp -d ${TMPDIR:-/tmp}/picprog-regress.XXXXXX` || exit 2
+trap 'rm -rf "$T"' 0
+cd "$T" || exit 2
+unset PIC_EMULATE_BASIC PIC_EMULATE_LATENCY PIC_EMULATE_REALTIME \
+  PIC_EMULATE_SERIALS
+
+failed=0
+
+# Intel hex data records for count bytes from byte address base, with
+# pseudo random contents shaped by kind:
+#   w14   14 bit words        e14   data memory of 14 bit parts
+#   b8    bytes               ds    dspic30 instructions, phantom byte 0
+hexdata () {
+  awk -v base=$1 -v n=$2 -v kind=$3 -v x=$4 '
+    function emit (len, type, addr, data,   sum, s, i) {
+      sum = len + int (addr / 256) + addr % 256 + type
+      s = sprintf (":%02X%04X%02X", len, addr, type)
+      for (i = 0; i < len; i++) {
+	s = s sprintf ("%02X", data [i])
+	sum += data [i]
+      }
+      print s sprintf ("%02X", (256 - sum % 256) % 256)
+    }
+    BEGIN {
+      seg = -1
+      for (i = 0; i < n; i += len) {
+	a = base + i
+	if (int (a / 65536) != seg) {
+	  seg = int (a / 65536)
+	  d [0] = int (seg / 256); d [1] = seg % 256
+	  emit(2, 4, 0, d)
+	}
+	len = n - i < 16 ? n - i : 16
+	for (k = 0; k < len; k++) {
+	  x = (x * 69069 + 1) % 4294967296
+	  v = int (x / 65536) % 256
+	  j = i + k
+	  if (kind == "w14" && j % 2) v %= 64
+	  if (kind == "e14" && j % 2) v = 0
+	  if (kind == "ds" && j % 4 == 3) v = 0
+	  d [k] = v
+	}
+	emit(len, 0, a % 65536, d)
+      }
+    }'
+}
+
+pass () {
+  echo "PASS $1"
+}
+
+fail () {
+  echo "FAIL $1"
+  failed=1
+}
+
+# run name device state expect-rc expect-text picprog-args...
+run () {
+  name=$1 dev=$2 state=$3 rc=$4 text=$5
+  shift 5
+  PIC_EMULATE=$dev PIC_EMULATE_STATE=$state \
+    "$PICPROG" -q "$@" > out.txt 2>&1
+  got=$?
+  if [ $got != $rc ]; then
+    fail "$name (exit $got, expected $rc)"
+    sed 's/^/	/' out.txt | tail -5
+  elif [ -n "$text" ] && ! grep -q "$text" out.txt; then
+    fail "$name (no \"$text\" in output)"
+    sed 's/^/	/' out.txt | tail -5
+  else
+    pass "$name"
+  fi
+}
+
+# The images.
+
+{ hexdata 0 2048 w14 1
+  hexdata 16384 8 w14 10
+  hexdata 16896 128 e14 2
+  echo ":02400E00723FFF"
+  echo ":00000001FF"; } > 877a.hex
+{ hexdata 0 2046 w14 3
+  hexdata 16896 256 e14 4
+  echo ":02400E008431FB"
+  echo ":00000001FF"; } > 675.hex
+{ hexdata 0 4096 b8 5
+  hexdata 2097152 8 b8 11
+  hexdata 15728640 256 b8 6
+  echo ":020000040030CA"
+  echo ":0100010022DC"
+  echo ":010003000EEE"
+  echo ":00000001FF"; } > 452.hex
+{ hexdata 0 3072 ds 7
+  hexdata 8387584 1024 b8 8
+  echo ":0200000400F802"
+  echo ":0800000007C33F80B3870F0026"
+  echo ":00000001FF"; } > 4011.hex
+
+for t in pic16f877a:877a pic12f675:675 pic18f452:452 dspic30f4011:4011; do
+  dev=${t%:*} img=${t#*:}.hex st=$dev.state
+  rm -f $st
+  run "$dev burn" $dev $st 0 "chip matches the image" \
+    -d $dev -i $img --burn --erase --verify
+  run "$dev read back" $dev $st 0 "" -d $dev -o read.hex
+  run "$dev verify read back" $dev $st 0 "chip matches the image" \
+    -d $dev -i read.hex --verify
+  run "$dev reburn" $dev $st 0 "chip matches the image" \
+    -d $dev -i $img --burn --verify
+
+  rm -f plan.st
+  run "$dev compile plan" $dev plan.st 0 "" \
+    -d $dev -i $img --burn --erase --compile-plan=$dev.plan
+  rm -f plan.st
+  run "$dev run plan" $dev plan.st 0 "" --run-plan=$dev.plan
+  run "$dev verify plan" $dev plan.st 0 "chip matches the image" \
+    -d $dev -i $img --verify
+done
+
+# Firmware without the command extensions gets plain commands.
+PIC_EMULATE_BASIC=1
+export PIC_EMULATE_BASIC
+for t in pic16f877a:877a pic18f452:452; do
+  dev=${t%:*} img=${t#*:}.hex
+  rm -f basic.st
+  run "$dev basic firmware" $dev basic.st 0 "chip matches the image" \
+    -d $dev -i $img --burn --erase --verify
+done
+unset PIC_EMULATE_BASIC
+
+# A plan is refused on a chip with another device id.
+rm -f other.st
+run "plan on wrong chip" pic16f628a other.st 64 "plan not run" \
+  --run-plan=pic16f877a.plan
+
+# OSCCAL at the end of 12f675 program memory survives erase and burn.
+echo "3ff 3444" > osccal.st
+run "12f675 osccal burn" pic12f675 osccal.st 0 "chip matches the image" \
+  -d pic12f675 -i 675.hex --burn --erase --verify
+if grep -q "^3ff 3444$" osccal.st; then
+  pass "12f675 osccal kept"
+else
+  fail "12f675 osccal kept"
+fi
+
+# The erase of the older eeprom and flash parts may leave data memory
+# alone, so data bytes of 0xff are still written.
+{ echo ":040000008316003033"
+  echo ":06420000FF00FF00330087"
+  echo ":02400E00F13F80"
+  echo ":00000001FF"; } > 84.hex
+printf '2100 55\n2101 77\n' > 84.st
+run "16f84 erased data written" pic16f84 84.st 0 "data memory, 3 locations" \
+  -d pic16f84 -i 84.hex --burn --erase --verify
+
+# Id stamps: a stamped chip is left alone.  A partial selection is
+# stamped with the hash of what it writes, so the whole image is not
+# taken to be on the chip afterwards.
+for dev in pic16f877a pic18f452; do
+  case $dev in
+    pic16f877a) img=877a.hex ;;
+    *) img=452.hex ;;
+  esac
+  rm -f stamp.st
+  run "$dev stamp" $dev stamp.st 0 "chip matches the image" \
+    -d $dev -i $img --burn --erase --stamp-id --verify
+  run "$dev skip if current" $dev stamp.st 0 "device not programmed" \
+    -d $dev -i $img --burn --stamp-id --skip-if-current
+  run "$dev verify stamp" $dev stamp.st 0 "chip matches the image" \
+    -d $dev -i $img --verify --stamp-id
+  rm -f stamp.st
+  run "$dev partial stamp" $dev stamp.st 0 "" \
+    -d $dev -i $img --burn --only code,id,config --stamp-id
+  run "$dev verify partial stamp" $dev stamp.st 0 "chip matches the image" \
+    -d $dev -i $img --verify --only code,id,config --stamp-id
+  run "$dev partial stamp not current" $dev stamp.st 0 \
+    "chip matches the image" \
+    -d $dev -i $img --burn --erase --stamp-id --skip-if-current --verify
+done
+
+# The programming cache writes only what changed.
+rm -f cache.st
+mkdir cache
+run "cache first burn" pic16f877a cache.st 0 "chip matches the image" \
+  -d pic16f877a -i 877a.hex --burn --erase --verify -K cache -b board
+run "cache second burn" pic16f877a cache.st 0 "chip matches the image" \
+  -d pic16f877a -i 877a.hex --burn --verify -K cache -b board
+# A word changed behind the cache's back, outside the sampled ones, is
+# found when the words the cache kept from being written are read back.
+sed 's/^10 .*/10 0/' cache.st > stale.st
+mv stale.st cache.st
+run "stale cache" pic16f877a cache.st 74 "not as in the image cache" \
+  -d pic16f877a -i 877a.hex --burn -K cache -b board
+
+# picprogd runs jobs sent with --connect, over a socket only this
+# user can open.
+sock=$T/picprogd.socket
+PIC_EMULATE=pic16f877a PIC_EMULATE_STATE=daemon.st \
+  "$PICPROG" -q --daemon=$sock > daemon.log 2>&1 &
+daemon=$!
+for i in 1 2 3 4 5 6 7 8 9 10; do
+  [ -S $sock ] && break
+  sleep 1
+done
+case `ls -l $sock` in
+  srw-------*) pass "daemon socket mode" ;;
+  *) fail "daemon socket mode" ;;
+esac
+run "daemon job" pic16f877a daemon.st 0 "chip matches the image" \
+  --connect=$sock -d pic16f877a -i 877a.hex --burn --erase --verify
+run "daemon second job" pic16f877a daemon.st 0 "chip matches the image" \
+  --connect=$sock -d pic16f877a -i 877a.hex --verify
+kill $daemon
+wait $daemon 2>/dev/null
+
+# Gang programming: every programmer gets its own chip, and serial
+# numbers that do not tell the programmers apart are refused.
+rm -f gang.st-a gang.st-b
+PIC_EMULATE_SERIALS=a,b
+export PIC_EMULATE_SERIALS
+run "gang" pic16f877a gang.st 0 "slot 2  b: ok" \
+  --gang -d pic16f877a -i 877a.hex --burn --erase
+PIC_EMULATE_SERIALS=a,a
+run "gang same serial" pic16f877a gang.st 78 "slots 1 and 2" \
+  --gang -d pic16f877a -i 877a.hex --burn --erase
+PIC_EMULATE_SERIALS=a,
+run "gang no serial" pic16f877a gang.st 78 "slot 2: programmer has no" \
+  --gang -d pic16f877a -i 877a.hex --burn --erase
+unset PIC_EMULATE_SERIALS
+for slot in a b; do
+  run "gang chip $slot" pic16f877a gang.st-$slot 0 "chip matches the image" \
+    -d pic16f877a -i 877a.hex --verify
+done
+
+# A carbon copy holds the whole input file even when only part of it
+# is programmed.
+rm -f cc.st
+run "cc with --only" pic16f877a cc.st 0 "" \
+  -d pic16f877a -i 877a.hex --burn --only code -c cc.hex
+rm -f cc.st
+run "cc burn" pic16f877a cc.st 0 "" \
+  -d pic16f877a -i cc.hex --burn --erase
+run "cc is the input" pic16f877a cc.st 0 "chip matches the image" \
+  -d pic16f877a -i 877a.hex --verify
+
+# --record-length sets the data bytes per saved record, two in each
+# 12 or 14 bit word, and the records saved read back the same.
+for t in pic16f877a:--ihx16 pic16f877a:--ihx8m pic18f452:--ihx32; do
+  dev=${t%:*} fmt=${t#*:}
+  for n in 32 255 7; do
+    run "$dev $fmt record length $n" $dev $dev.state 0 "" \
+      -d $dev -o rl.hex -L $n $fmt
+    # A full record of b bytes is 11 + 2 b characters long.  Words do
+    # not split, so 14 bit parts round n down to even.
+    b=$n
+    [ $dev = pic16f877a ] && b=`expr $n - $n % 2`
+    max=`expr 11 + 2 \* $b`
+    if awk -v max=$max 'length > max { bad = 1 } length == max { full = 1 }
+	END { exit bad || !full }' rl.hex; then
+      pass "$dev $fmt record length $n records"
+    else
+      fail "$dev $fmt record length $n records"
+    fi
+    run "$dev $fmt record length $n verify" $dev $dev.state 0 \
+      "chip matches the image" -d $dev -i rl.hex --verify
+  done
+done
+run "bad record length" pic16f877a rl.st 64 "Bad --record-length" \
+  -d pic16f877a -o rl.hex -L 0
+
+# Hex file errors are reported with the line, and the file is
+# refused.  Carriage returns and empty lines are fine, and so is an
+# input that cannot be mapped.
+hexerr () {
+  name=$1 text=$2
+  shift 2
+  printf "$@" > bad.hex
+  run "$name" pic16f877a hexerr.st 65 "$text" -d pic16f877a -i bad.hex
+}
+hexerr "hex checksum" "bad.hex:2:checksum mismatch, checksum is 0xff, should be 0xfe" \
+  ':020000000000FE\n:020000000000FF\n:00000001FF\n'
+hexerr "hex odd length" "bad.hex:1:odd address or number of words" \
+  ':0100000012ED\n:00000001FF\n'
+hexerr "hex record type" "bad.hex:1:invalid input line" \
+  ':020000021000EC\n:00000001FF\n'
+hexerr "hex line length" "bad.hex:2:line length mismatch:ihx8m 15 != 19" \
+  ':020000000000FE\n:0200020000000000FC\n:00000001FF\n'
+hexerr "hex address" "bad.hex:1:invalid address 0x4000" \
+  ':0280000000007E\n:00000001FF\n'
+hexerr "hex digit" "bad.hex:1:invalid input line" \
+  ':02000000000GFE\n:00000001FF\n'
+hexerr "hex no colon" "bad.hex:1:invalid input line" \
+  '020000000000FE\n:00000001FF\n'
+printf ':020000000000FE\n' > bad.hex
+run "hex no eof" pic16f877a hexerr.st 0 "bad.hex:1:warning:unexpected eof" \
+  -d pic16f877a -i bad.hex
+sed 's/$/\r/; 3s/^/\r\n/' 877a.hex > crlf.hex
+run "hex crlf" pic16f877a pic16f877a.state 0 "chip matches the image" \
+  -d pic16f877a -i crlf.hex --verify
+cat 877a.hex | PIC_EMULATE=pic16f877a PIC_EMULATE_STATE=pic16f877a.state \
+  "$PICPROG" -q -d pic16f877a -i /dev/stdin --verify > out.txt 2>&1
+if grep -q "chip matches the image" out.txt; then
+  pass "hex from a pipe"
+else
+  fail "hex from a pipe"
+  sed 's/^/	/' out.txt | tail -5
+fi
+
+# --range and --only limit what is written, verified and read.
+rm -f range.st
+run "range burn" pic16f877a range.st 0 "" \
+  -d pic16f877a -i 877a.hex --burn --range=0x100-0x1ff
+if [ "`wc -l < range.st`" = 256 ] \
+   && [ "`sort range.st | sed -n '1s/ .*//p;$s/ .*//p' | tr '\n' ' '`" \
+	= "100 1ff " ]; then
+  pass "range burn writes the range"
+else
+  fail "range burn writes the range"
+fi
+run "range verify" pic16f877a range.st 0 "chip matches the image" \
+  -d pic16f877a -i 877a.hex --verify --range=0x100-0x1ff
+run "range verify all" pic16f877a range.st 65 "failed verification" \
+  -d pic16f877a -i 877a.hex --verify
+run "range read" pic16f877a range.st 0 "skipped reading data memory" \
+  -d pic16f877a -o range.hex --range=0x100-0x10f
+if [ "`grep -c '^:0801[01]' range.hex`" = 2 ] \
+   && [ "`wc -l < range.hex`" = 3 ]; then
+  pass "range read saves the range"
+else
+  fail "range read saves the range"
+  sed 's/^/	/' range.hex
+fi
+rm -f range.st
+run "only eeprom burn" pic18f452 range.st 0 "chip matches the image" \
+  -d pic18f452 -i 452.hex --burn --verify --only eeprom
+run "only eeprom leaves code" pic18f452 range.st 0 "device is blank" \
+  -d pic18f452 --blank-check --only code,id
+run "bad range" pic16f877a range.st 64 "Bad --range" \
+  -d pic16f877a -o range.hex --range=0x200-0x100
+run "bad region" pic16f877a range.st 64 "Unknown memory region" \
+  -d pic16f877a -o range.hex --only foo
+
+# --blank-check stops at the first word that is not erased.  Data
+# memory of 14 bit parts is kept from 0x10000 on in the state file,
+# and calibration words do not count.
+for dev in pic16f877a pic18f452 dspic30f4011; do
+  rm -f blank.st
+  run "$dev blank" $dev blank.st 0 "device is blank" -d $dev --blank-check
+done
+echo "3ff 3444" > blank.st
+run "12f675 blank with osccal" pic12f675 blank.st 0 "device is blank" \
+  -d pic12f675 --blank-check
+echo "1234 0" > blank.st
+run "program word not blank" pic16f877a blank.st 65 \
+  "program memory 0x1234 is 0x0000" -d pic16f877a --blank-check
+run "blank below range" pic16f877a blank.st 0 "device is blank" \
+  -d pic16f877a --blank-check --range=0-0x1000
+echo "10005 12" > blank.st
+run "data not blank" pic16f877a blank.st 65 "data memory 0x2105 is 0x12" \
+  -d pic16f877a --blank-check
+run "blank without data" pic16f877a blank.st 0 "device is blank" \
+  -d pic16f877a --blank-check --only code,id,config
+echo "2007 3f72" > blank.st
+run "fuses not blank" pic16f877a blank.st 65 "fuses 0x2007 is 0x3f72" \
+  -d pic16f877a --blank-check
+echo "100 12" > blank.st
+run "18f452 not blank" pic18f452 blank.st 65 "program memory 0x0100" \
+  -d pic18f452 --blank-check
+
+# --stats prints a line per phase, and the totals add them up.
+rm -f stats.st
+run "stats" pic16f877a stats.st 0 "Multiprog statistics" \
+  -d pic16f877a -i 877a.hex --burn --erase --verify --stats
+if awk '/^(setup|erase|program|data|ids|fuses) / { t += $4; o += $7; p++ }
+	/^total / { tt = $4; to = $7 }
+	END { exit !(p >= 4 && t == tt && o == to && tt > 0) }' out.txt; then
+  pass "stats totals"
+else
+  fail "stats totals"
+  sed 's/^/	/' out.txt | tail -9
+fi
+
+# Option checks.
+run "erase with only" pic16f877a cache.st 64 "" \
+  -d pic16f877a -i 877a.hex --burn --erase --only code
+{ hexdata 0 64 b8 9
+  echo ":00000001FF"; } > 18c.hex
+run "erase eprom18" pic18f452 e18.st 69 "do not know how to erase" \
+  -d pic18c452 -i 18c.hex --burn --erase
+
+if [ $failed != 0 ]; then
+  echo "Some tests failed."
+  exit 1
+fi
+echo "All tests passed."
@@ -36,6 +36,7 @@ unsigned char verbose = 0;
 #include <stdlib.h>
 
 #include "ser_avrdoper.h"
+#include "emulator.h"
 
 
 /* ------------------------------------------------------------------------ */
@@ -240,6 +241,238 @@ static int usbGetReport(union filedescriptor *fdp, int reportType, int reportNum
 /* ------------------------------------------------------------------------ */
 /* ------------------------------------------------------------------------ */
 
+#elif defined(HAVE_LIBUSB_1_0)
+
+/* ------------------------------------------------------------------------ */
+/* ------------------------------------------------------------------------ */
+/* ------------------------------------------------------------------------ */
+
+/*
+ * libusb-1.0 transport.  Feature reports carrying a frame are submitted
+ * asynchronously, up to MAX_INFLIGHT at a time, so the host does not
+ * wait for each report to complete before queuing the next one.  The
+ * GET_REPORT for the reply is queued behind them.  Frames themselves
+ * are not overlapped: picport reads each reply before sending the next
+ * command.
+ *
+ * Experimental and built only with make USB=libusb-1.0.  It has not been
+ * run against hardware, and no gain over libusb-0.1 has been measured.
+ */
+
+#define USBRQ_HID_GET_REPORT    0x01
+#define USBRQ_HID_SET_REPORT    0x09
+
+#define MAX_INFLIGHT    8
+
+const int  avrdoper::reportDataSizes[4] = {13, 29, 61, 125};
+
+/* ------------------------------------------------------------------------- */
+avrdoper::avrdoper()
+{
+	avrdoperRxLength = 0;
+	avrdoperRxPosition = 0;
+	rxExpect = 0;
+
+	ctx = NULL;
+	pfd = NULL;
+	emu = NULL;
+	inflight = 0;
+	xferError = 0;
+}
+
+avrdoper::~avrdoper()
+{
+	if(pfd != NULL || emu != NULL)
+		avrdoper_close();
+	if(ctx != NULL)
+		libusb_exit(ctx);
+}
+
+int avrdoper::usbOpenDevice(int vendor, const char *vendorName,
+			 int product, const char *productName, int doReportIDs,
+			 const char *serial, std::vector<std::string> *found)
+{
+    libusb_device       **list;
+    libusb_device_handle *handle = NULL;
+    int                 errorCode = USB_ERROR_NOTFOUND;
+    ssize_t             n, i;
+
+    if(ctx == NULL && libusb_init(&ctx) != 0){
+        fprintf(stderr, "Warning: cannot initialize libusb\n");
+        return USB_ERROR_IO;
+    }
+    n = libusb_get_device_list(ctx, &list);
+    for(i = 0; i < n; i++){
+        struct libusb_device_descriptor descriptor;
+        unsigned char string[256];
+        int len;
+
+        if(libusb_get_device_descriptor(list[i], &descriptor) != 0)
+            continue;
+        if(descriptor.idVendor != vendor || descriptor.idProduct != product)
+            continue;
+        if(libusb_open(list[i], &handle) != 0){
+            errorCode = USB_ERROR_ACCESS;
+            fprintf(stderr, "Warning: cannot open USB device\n");
+            handle = NULL;
+            continue;
+        }
+        if(vendorName == NULL && productName == NULL)  /* name does not matter */
+            break;
+        /* now check whether the names match: */
+        len = libusb_get_string_descriptor_ascii(handle, descriptor.iManufacturer,
+						 string, sizeof(string));
+        if(len < 0){
+            errorCode = USB_ERROR_IO;
+            fprintf(stderr, "Warning: cannot query manufacturer for device: %s\n",
+		    libusb_error_name(len));
+        }else{
+            errorCode = USB_ERROR_NOTFOUND;
+            if(strcmp((char *)string, vendorName) == 0){
+                len = libusb_get_string_descriptor_ascii(handle, descriptor.iProduct,
+							 string, sizeof(string));
+                if(len < 0){
+                    errorCode = USB_ERROR_IO;
+                    fprintf(stderr, "Warning: cannot query product for device: %s\n",
+			    libusb_error_name(len));
+                }else{
+                    errorCode = USB_ERROR_NOTFOUND;
+                    if(strcmp((char *)string, productName) == 0){
+                        if(serial == NULL && found == NULL)
+                            break;
+                        len = libusb_get_string_descriptor_ascii(handle, descriptor.iSerialNumber,
+								 string, sizeof(string));
+                        if(len < 0)
+                            string[0] = 0;
+                        if(found != NULL)
+                            found->push_back((char *)string);
+                        else if(strcmp((char *)string, serial) == 0)
+                            break;
+                    }
+                }
+            }
+        }
+        libusb_close(handle);
+        handle = NULL;
+    }
+    if(n >= 0)
+        libusb_free_device_list(list, 1);
+    if(handle != NULL){
+        int rval;
+        libusb_set_auto_detach_kernel_driver(handle, 1);
+        if((rval = libusb_claim_interface(handle, 0)) != 0)
+            fprintf(stderr, "Warning: could not claim interface: %s\n",
+		    libusb_error_name(rval));
+/* Continue anyway, even if we could not claim the interface. Control transfers
+ * should still work.
+ */
+        errorCode = 0;
+        pfd = handle;
+        usesReportIDs = doReportIDs;
+    }
+    return errorCode;
+}
+
+/* ------------------------------------------------------------------------- */
+
+void LIBUSB_CALL avrdoper::sendDone(struct libusb_transfer *xfer)
+{
+    avrdoper *self = (avrdoper *)xfer->user_data;
+
+    if(xfer->status != LIBUSB_TRANSFER_COMPLETED
+       || xfer->actual_length != xfer->length - LIBUSB_CONTROL_SETUP_SIZE){
+        fprintf(stderr, "Error sending message: transfer status %d\n", xfer->status);
+        self->xferError = 1;
+    }
+    self->inflight--;
+    free(xfer->buffer);
+    libusb_free_transfer(xfer);
+}
+
+/* Wait until at most maxInflight reports are still being sent. */
+int avrdoper::usbWaitSent(int maxInflight)
+{
+    while(inflight > maxInflight){
+        if(libusb_handle_events(ctx) != 0){
+            xferError = 1;
+            break;
+        }
+    }
+    if(xferError){
+        xferError = 0;
+        return USB_ERROR_IO;
+    }
+    return 0;
+}
+
+int avrdoper::usbSetReport( int reportType, char *buffer, int len)
+{
+    struct libusb_transfer *xfer;
+    unsigned char *setup;
+    int rval;
+
+    if(!usesReportIDs){
+        buffer++;   /* skip dummy report ID */
+        len--;
+    }
+    if((rval = usbWaitSent(MAX_INFLIGHT - 1)) != 0)
+        return rval;
+    xfer = libusb_alloc_transfer(0);
+    setup = (unsigned char *)malloc(LIBUSB_CONTROL_SETUP_SIZE + len);
+    if(xfer == NULL || setup == NULL){
+        libusb_free_transfer(xfer);
+        free(setup);
+        return USB_ERROR_IO;
+    }
+    libusb_fill_control_setup(setup, LIBUSB_REQUEST_TYPE_CLASS |
+			      LIBUSB_RECIPIENT_INTERFACE | LIBUSB_ENDPOINT_OUT,
+			      USBRQ_HID_SET_REPORT,
+			      reportType << 8 | (unsigned char)buffer[0], 0, len);
+    memcpy(setup + LIBUSB_CONTROL_SETUP_SIZE, buffer, len);
+    libusb_fill_control_transfer(xfer, pfd, setup, sendDone, this, 5000);
+    if((rval = libusb_submit_transfer(xfer)) != 0){
+        fprintf(stderr, "Error sending message: %s\n", libusb_error_name(rval));
+        free(setup);
+        libusb_free_transfer(xfer);
+        return USB_ERROR_IO;
+    }
+    inflight++;
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
+int avrdoper::usbGetReport( int reportType, int reportNumber,
+			char *buffer, int *len)
+{
+    int bytesReceived, maxLen = *len;
+
+    if(!usesReportIDs){
+        buffer++;   /* make room for dummy report ID */
+        maxLen--;
+    }
+    /* Control transfers on endpoint 0 complete in order, so the request
+     * queues behind the reports still in flight instead of waiting for them.
+     */
+    bytesReceived = libusb_control_transfer(pfd, LIBUSB_REQUEST_TYPE_CLASS |
+				    LIBUSB_RECIPIENT_INTERFACE | LIBUSB_ENDPOINT_IN,
+				    USBRQ_HID_GET_REPORT,
+				    reportType << 8 | reportNumber, 0,
+				    (unsigned char *)buffer, maxLen, 5000);
+    if(usbWaitSent(0) != 0)
+        return USB_ERROR_IO;
+    if(bytesReceived < 0){
+        fprintf(stderr, "Error sending message: %s\n", libusb_error_name(bytesReceived));
+        return USB_ERROR_IO;
+    }
+    *len = bytesReceived;
+    if(!usesReportIDs){
+        buffer[-1] = reportNumber;  /* add dummy report ID */
+        (*len)++;
+    }
+    return 0;
+}
+
 #else /* !(WIN32NATIVE && HAVE_LIBHID) */
 
 /* ------------------------------------------------------------------------ */
@@ -268,13 +501,15 @@ avrdoper::avrdoper()
 {
 	avrdoperRxLength = 0;
 	avrdoperRxPosition = 0;
+	rxExpect = 0;
 
 	pfd = NULL;
+	emu = NULL;
 }
 
 avrdoper::~avrdoper()
 {
-	if(pfd != NULL)
+	if(pfd != NULL || emu != NULL)
 		avrdoper_close();
 }
 
@@ -305,7 +540,8 @@ int  avrdoper::usbGetStringAscii(usb_dev_handle *dev, int index, int langid, cha
 }
 
 int avrdoper::usbOpenDevice(int vendor, const char *vendorName,
-			 int product, const char *productName, int doReportIDs)
+			 int product, const char *productName, int doReportIDs,
+			 const char *serial, std::vector<std::string> *found)
 {
     struct usb_bus      *bus;
     struct usb_device   *dev;
@@ -353,10 +589,16 @@ int avrdoper::usbOpenDevice(int vendor, const char *vendorName,
                             errorCode = USB_ERROR_NOTFOUND;
                             // fprintf(stderr, "seen product ->%s<-\n", string);
                             if(strcmp(string, productName) == 0){
-/*                            	len = usbGetStringAscii(handle, dev->descriptor.iSerialNumber, 0x0409, string, sizeof(string));
-       	                        if(len > 0)
-       	                        	fprintf(stderr,"Serial(%d): %c%c%c%c%c%c\n",len, string[0], string[1], string[2], string[3], string[4], string[5]);
-*/                            	break;
+                                if(serial == NULL && found == NULL)
+                                    break;
+                                len = usbGetStringAscii(handle, dev->descriptor.iSerialNumber,
+							0x0409, string, sizeof(string));
+                                if(len < 0)
+                                    string[0] = 0;
+                                if(found != NULL)
+                                    found->push_back(string);
+                                else if(strcmp(string, serial) == 0)
+                                    break;
                             }
                         }
                     }
@@ -439,7 +681,7 @@ int avrdoper::usbGetReport( int reportType, int reportNumber,
     *len = bytesReceived;
     if(!usesReportIDs){
         buffer[-1] = reportNumber;  /* add dummy report ID */
-        len++;
+        (*len)++;
     }
     return 0;
 }
@@ -519,27 +761,74 @@ const char *avrdoper::usbErrorText(int usbErrno)
 
 void avrdoper::avrdoper_close()
 {
+	if(emu != NULL){
+		delete emu;
+		emu = NULL;
+		return;
+	}
+#ifdef HAVE_LIBUSB_1_0
+	usbWaitSent(0);
+	libusb_release_interface(pfd, 0);
+	libusb_close(pfd);
+#else
 	usb_close(pfd);
+#endif
 	pfd = NULL;
 }
 
 /* ------------------------------------------------------------------------- */
 
-int avrdoper::avrdoper_open()
+int avrdoper::avrdoper_open(const char *serial)
 {
     int rval;
     const char *vname = "obdev.at";
     const char *devname = "AVR-Doper";
+    const char *emulate = getenv("PIC_EMULATE");
 
-    rval = usbOpenDevice(USB_VENDOR_ID, vname, USB_PRODUCT_ID, devname, 1);
+    if(emulate != NULL && *emulate){
+        emu = new emulator(emulate, serial);
+        if(!emu->ok())
+            throw avrdoper_error(std::string("avrdoper_open(): cannot emulate ") + emulate);
+        return 0;
+    }
+    rval = usbOpenDevice(USB_VENDOR_ID, vname, USB_PRODUCT_ID, devname, 1, serial);
     if(rval != 0){
-        fprintf(stderr, "avrdoper_open(): %s\n", usbErrorText(rval));
-        exit(1);
-	//return -1;
+        if(serial != NULL)
+            throw avrdoper_error(std::string("avrdoper_open(") + serial + "): "
+                                 + usbErrorText(rval));
+        throw avrdoper_error(std::string("avrdoper_open(): ") + usbErrorText(rval));
     }
     return 0;
 }
 
+/* Collect the serial numbers of all connected programmers. */
+int avrdoper::avrdoper_list(std::vector<std::string> &serials)
+{
+    avrdoper probe;
+
+    serials.clear();
+    if(getenv("PIC_EMULATE") != NULL && *getenv("PIC_EMULATE")){
+        const char *list = getenv("PIC_EMULATE_SERIALS");
+        if(list == NULL){
+            serials.push_back("emulator");
+            return 1;
+        }
+        for(;;){
+            const char *comma = strchr(list, ',');
+            if(comma == NULL){
+                serials.push_back(list);
+                break;
+            }
+            serials.push_back(std::string(list, comma - list));
+            list = comma + 1;
+        }
+        return serials.size();
+    }
+    probe.usbOpenDevice(USB_VENDOR_ID, "obdev.at", USB_PRODUCT_ID, "AVR-Doper", 1,
+			NULL, &serials);
+    return serials.size();
+}
+
 /* ------------------------------------------------------------------------- */
 
 
@@ -558,6 +847,8 @@ int avrdoper::avrdoper_send( unsigned char *buf, size_t buflen)
 {
     if(verbose > 3)
         dumpBlock("Send", buf, buflen);
+    if(emu != NULL)
+        return emu->send(buf, buflen);
     while(buflen > 0){
         unsigned char buffer[256];
         int rval, lenIndex = chooseDataSize(buflen);
@@ -569,10 +860,8 @@ int avrdoper::avrdoper_send( unsigned char *buf, size_t buflen)
             fprintf(stderr, "Sending %d bytes data chunk\n", thisLen);
         rval = usbSetReport(USB_HID_REPORT_TYPE_FEATURE, (char *)buffer,
 			    reportDataSizes[lenIndex] + 2);
-        if(rval != 0){
-            fprintf(stderr, "avrdoper_send(): %s\n", usbErrorText(rval));
-            exit(1);
-        }
+        if(rval != 0)
+            throw avrdoper_error(std::string("avrdoper_send(): ") + usbErrorText(rval));
         buflen -= thisLen;
         buf += thisLen;
     }
@@ -583,8 +872,10 @@ int avrdoper::avrdoper_send( unsigned char *buf, size_t buflen)
 
 void avrdoper::avrdoperFillBuffer()
 {
-    int bytesPending = reportDataSizes[1];  /* guess how much data is buffered in device */
+    /* guess how much data is buffered in device, unless we were told */
+    int bytesPending = rxExpect > 0 ? rxExpect : reportDataSizes[1];
 
+    rxExpect = 0;
     avrdoperRxPosition = avrdoperRxLength = 0;
     while(bytesPending > 0){
         int len, usbErr, lenIndex = chooseDataSize(bytesPending);
@@ -595,20 +886,16 @@ void avrdoper::avrdoperFillBuffer()
         len = reportDataSizes[lenIndex] + 2;
         usbErr = usbGetReport(USB_HID_REPORT_TYPE_FEATURE, lenIndex + 1,
 			      (char *)buffer, &len);
-        if(usbErr != 0){
-            fprintf(stderr, "avrdoperFillBuffer(): %s\n", usbErrorText(usbErr));
-            exit(1);
-        }
+        if(usbErr != 0)
+            throw avrdoper_error(std::string("avrdoperFillBuffer(): ") + usbErrorText(usbErr));
         if(verbose > 3)
             fprintf(stderr, "Received %d bytes data chunk of total %d\n", len - 2, buffer[1]);
         len -= 2;   /* compensate for report ID and length byte */
         bytesPending = buffer[1] - len; /* amount still buffered */
         if(len > buffer[1])             /* cut away padding */
             len = buffer[1];
-        if(avrdoperRxLength + len > sizeof(avrdoperRxBuffer)){
-            fprintf(stderr, "avrdoperFillBuffer(): internal error: buffer overflow\n");
-            exit(1);
-        }
+        if(avrdoperRxLength + len > sizeof(avrdoperRxBuffer))
+            throw avrdoper_error("avrdoperFillBuffer(): internal error: buffer overflow");
         memcpy(avrdoperRxBuffer + avrdoperRxLength, buffer + 2, len);
         avrdoperRxLength += len;
     }
@@ -619,6 +906,8 @@ int avrdoper::avrdoper_recv( unsigned char *buf, size_t buflen)
     unsigned char   *p = buf;
     int             remaining = buflen;
 
+    if(emu != NULL)
+        return emu->recv(buf, buflen);
     while(remaining > 0){
         int len, available = avrdoperRxLength - avrdoperRxPosition;
         if(available <= 0){ /* buffer is empty */
@@ -640,6 +929,10 @@ int avrdoper::avrdoper_recv( unsigned char *buf, size_t buflen)
 
 int avrdoper::avrdoper_drain()
 {
+    if(emu != NULL){
+        emu->drain();
+        return 0;
+    }
     do{
         avrdoperFillBuffer();
     }while(avrdoperRxLength > 0);
@@ -8,26 +8,60 @@
 #ifndef SER_AVRDOPER_H_
 #define SER_AVRDOPER_H_
 
+#include <stdexcept>
+#include <string>
+#include <vector>
+
 #include "serial.h"
+#ifdef HAVE_LIBUSB_1_0
+#include <libusb.h>
+#else
 #include <usb.h>
+#endif
+
+class emulator;
+
+/* A programmer that cannot be opened or talked to.  It ends the job on
+   that programmer only: gang mode catches it per slot. */
+class avrdoper_error : public std::runtime_error {
+public:
+	explicit avrdoper_error(const std::string &what)
+		: std::runtime_error(what) {}
+};
 
 class avrdoper{
 public:
 	avrdoper();
 	~avrdoper();
-	int avrdoper_open();
+	int avrdoper_open(const char *serial = NULL);
+	static int avrdoper_list(std::vector<std::string> &serials);
 	void avrdoper_close();
 	int avrdoper_send(unsigned char *buf, size_t buflen);
 	int avrdoper_recv(unsigned char *buf, size_t buflen);
 	int avrdoper_drain();
+	/* Size of the next reply if it is known, 0 if not. */
+	void avrdoper_expect(int len) { rxExpect = len; }
 
 private:
+#ifdef HAVE_LIBUSB_1_0
+	libusb_context *ctx;
+	libusb_device_handle *pfd;
+	int inflight;		/* feature reports submitted, not yet completed */
+	int xferError;		/* an asynchronous transfer failed */
+
+	static void LIBUSB_CALL sendDone(struct libusb_transfer *xfer);
+	int usbWaitSent(int maxInflight);
+#else
 	usb_dev_handle *pfd;
+#endif
 	static const int  reportDataSizes[4];
 
+	emulator	*emu;	/* PIC_EMULATE set: no hardware, talk to this */
+
 	unsigned char    avrdoperRxBuffer[280];  /* buffer for receive data */
 	int              avrdoperRxLength;   /* amount of valid bytes in rx buffer */
 	int              avrdoperRxPosition; /* amount of bytes already consumed in rx buffer */
+	int              rxExpect;           /* avrdoper_expect() hint for the next fill */
 
 	int  usesReportIDs;
 
@@ -36,8 +70,11 @@ private:
 	const char *usbErrorText(int usbErrno);
 	void dumpBlock(const char *prefix, unsigned char *buf, int len);
 	int usbGetReport(int reportType, int reportNumber,char *buffer, int *len);
+#ifndef HAVE_LIBUSB_1_0
 	int usbGetStringAscii(usb_dev_handle *dev, int index, int langid, char *buf, int buflen);
-	int usbOpenDevice(int vendor, const char *vendorName, int product, const char *productName, int doReportIDs);
+#endif
+	int usbOpenDevice(int vendor, const char *vendorName, int product, const char *productName, int doReportIDs,
+			  const char *serial = NULL, std::vector<std::string> *found = NULL);
 	int usbSetReport( int reportType, char *buffer, int len);
 };
 